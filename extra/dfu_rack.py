@@ -0,0 +1,567 @@
+#!/usr/bin/env python3
+
+# This file is Copyright (c) Greg Davill <greg.davill@gmail.com>
+# License: BSD
+#
+# Flashes every ButterStick bootloader on the bus at the same time.
+#
+#   python3 dfu_rack.py -a 0 -D butterstick_r1d0.dfu
+#
+# Boards are found by VID:PID and identified by their serial string, which is the flash UUID.
+# Each board runs its own DFU download on asynchronous libusb control transfers, so a board
+# that is waiting on flash never holds up the others. GETSTATUS is submitted from the DNLOAD
+# completion callback, because the bootloader only starts the erase/program once that
+# GETSTATUS arrives. Busy polls are scheduled by bwPollTimeout on a timer instead of a sleep.
+#
+# Works against the host build (firmware/host) under dummy_hcd like any other device.
+# --mock N runs the same downloads against N simulated bootloaders on a virtual clock.
+#
+# Requires python-libusb1, except with --mock.
+
+import argparse
+import heapq
+import random
+import struct
+import sys
+import time
+import zlib
+
+VID, PID = 0x1209, 0x5af1
+
+# DFU class requests
+DFU_DNLOAD, DFU_GETSTATUS, DFU_CLRSTATUS, DFU_ABORT = 1, 3, 4, 6
+
+# DFU states
+DFU_IDLE                = 2
+DFU_DNLOAD_SYNC         = 3
+DFU_DNBUSY              = 4
+DFU_DNLOAD_IDLE         = 5
+DFU_MANIFEST_SYNC       = 6
+DFU_MANIFEST            = 7
+DFU_MANIFEST_WAIT_RESET = 8
+DFU_ERROR               = 10
+
+DFU_STATUS_OK         = 0x00
+DFU_STATUS_ERR_VERIFY = 0x07
+
+REQUEST_OUT = 0x21  # class, interface, host to device
+REQUEST_IN  = 0xa1
+
+# CFG_TUD_DFU_XFER_BUFSIZE, used when the functional descriptor can't be read
+DEFAULT_TRANSFER_SIZE = 512
+
+
+def load_image(path):
+    """ Returns the payload of a .dfu file with its suffix checked and removed, or a raw binary as is. """
+    with open(path, "rb") as f:
+        data = f.read()
+
+    if len(data) < 16 or data[-8:-5] != b"UFD":
+        return data
+
+    length = data[-5]
+    crc, = struct.unpack("<I", data[-4:])
+    if crc != zlib.crc32(data[:-4]) ^ 0xffffffff:
+        raise SystemExit(f"{path}: DFU suffix CRC mismatch")
+
+    product, vendor = struct.unpack("<HH", data[-14:-10])
+    if vendor not in (0xffff, VID) or product not in (0xffff, PID):
+        raise SystemExit(f"{path}: built for {vendor:04x}:{product:04x}, not {VID:04x}:{PID:04x}")
+
+    return data[:-length]
+
+
+# Event loop ---------------------------------------------------------------------------------
+
+class Loop:
+    """ Timers on top of a backend's event pump, so nothing ever sleeps while transfers are due. """
+
+    def __init__(self, backend):
+        self.backend = backend
+        self.timers = []
+        self.sequence = 0
+
+    def now(self):
+        return self.backend.now()
+
+    def call_later(self, delay, fn):
+        heapq.heappush(self.timers, (self.now() + delay, self.sequence, fn))
+        self.sequence += 1
+
+    def run_until(self, done, on_tick, interval):
+        next_tick = self.now()
+        while not done():
+            now = self.now()
+            while self.timers and self.timers[0][0] <= now:
+                _, _, fn = heapq.heappop(self.timers)
+                fn()
+
+            if now >= next_tick:
+                on_tick()
+                next_tick = now + interval
+
+            deadline = min(self.timers[0][0], next_tick) if self.timers else next_tick
+            self.backend.poll(max(0.0, deadline - now))
+
+
+# libusb backend -----------------------------------------------------------------------------
+
+def dfu_interface(device):
+    """ Interface number and wTransferSize of the DFU interface, from the config descriptor. """
+    for config in device.iterConfigurations():
+        for interface in config.iterInterfaces():
+            for setting in interface.iterSettings():
+                if (setting.getClass(), setting.getSubClass()) != (0xfe, 0x01):
+                    continue
+
+                extra = setting.getExtra()
+                blob = b"".join(bytes(d) for d in extra) if isinstance(extra, list) else bytes(extra)
+                while len(blob) >= 2 and blob[0]:
+                    if blob[1] == 0x21 and blob[0] >= 7:
+                        return setting.getNumber(), struct.unpack("<H", blob[5:7])[0]
+                    blob = blob[blob[0]:]
+                return setting.getNumber(), DEFAULT_TRANSFER_SIZE
+
+    return None, None
+
+
+class LibusbBoard:
+    def __init__(self, usb1, device, handle, serial):
+        self.usb1 = usb1
+        self.device = device
+        self.handle = handle
+        self.serial = serial
+        self.location = "{}-{}".format(device.getBusNumber(), ".".join(str(p) for p in device.getPortNumberList()))
+        self.interface, self.transfer_size = dfu_interface(device)
+
+        # DFU allows one request at a time, so a single transfer is reused for the whole download
+        self.transfer = handle.getTransfer()
+
+    def open(self, alt):
+        self.handle.claimInterface(self.interface)
+        self.handle.setInterfaceAltSetting(self.interface, alt)
+
+    def control(self, request_type, request, value, data, callback, timeout=5.0):
+        """ Submits a control transfer; callback(data, error) runs from the event pump. """
+        def done(transfer):
+            status = transfer.getStatus()
+            if status != self.usb1.TRANSFER_COMPLETED:
+                callback(None, "transfer status {}".format(status))
+            else:
+                callback(bytes(transfer.getBuffer()[:transfer.getActualLength()]), None)
+
+        self.transfer.setControl(request_type, request, value, self.interface, data,
+            callback=done, timeout=int(timeout * 1000))
+        try:
+            self.transfer.submit()
+        except self.usb1.USBError as e:
+            callback(None, str(e))
+
+    def reset(self):
+        # The bootloader hands over on reset, so the device is gone before this returns
+        try:
+            self.handle.resetDevice()
+        except self.usb1.USBError:
+            pass
+
+    def close(self):
+        try:
+            self.handle.releaseInterface(self.interface)
+        except self.usb1.USBError:
+            pass
+        self.handle.close()
+
+
+class LibusbBackend:
+    def __init__(self):
+        import usb1
+        self.usb1 = usb1
+        self.context = usb1.USBContext()
+        if hasattr(self.context, "open"):
+            self.context.open()
+
+    def now(self):
+        return time.monotonic()
+
+    def poll(self, timeout):
+        self.context.handleEventsTimeout(timeout)
+
+    def find(self, serials):
+        boards = []
+        for device in self.context.getDeviceIterator(skip_on_error=True):
+            if (device.getVendorID(), device.getProductID()) != (VID, PID):
+                device.close()
+                continue
+
+            try:
+                handle = device.open()
+                serial = handle.getSerialNumber()
+            except self.usb1.USBError as e:
+                print(f"skipping {device}: {e}", file=sys.stderr)
+                device.close()
+                continue
+
+            if serials and serial.lower() not in serials:
+                handle.close()
+                device.close()
+                continue
+
+            boards.append(LibusbBoard(self.usb1, device, handle, serial))
+        return boards
+
+
+# Mock backend -------------------------------------------------------------------------------
+
+# Shared bus: fixed cost per control transfer, then the data phase at high speed bulk rate
+MOCK_CONTROL_LATENCY = 250e-6
+MOCK_BYTE_TIME       = 1 / 40e6
+
+# flash_job.c on a W25Q128JV, typical datasheet times (see firmware/host/flash-bench)
+MOCK_ERASE_64K = 150e-3
+MOCK_PAGE      = 571e-6
+MOCK_POLL_MS   = 1
+
+
+class MockBoard:
+    """ The tinyusb DFU state machine in front of background erase/program jobs, as main.c runs it. """
+
+    def __init__(self, backend, index, jitter, fail_block=None):
+        self.backend = backend
+        self.serial = "e463-{:04x}-{:04x}-{:04x}".format(0x5a00 + index, index * 0x1d3 & 0xffff, index)
+        self.location = f"mock-{index}"
+        self.interface = 0
+        self.transfer_size = DEFAULT_TRANSFER_SIZE
+        self.jitter = jitter
+        self.fail_block = fail_block
+
+        self.state = DFU_IDLE
+        self.status = DFU_STATUS_OK
+        self.pending = None
+        self.busy_until = 0.0
+        self.erased = set()
+
+    def open(self, alt):
+        pass
+
+    def get_status(self):
+        now = self.backend.now()
+        poll = 0
+
+        if self.state == DFU_DNLOAD_SYNC:
+            # The flash job starts now, the 64K erase only on the first block in it
+            block, length = self.pending
+            address = block * self.transfer_size
+            busy = MOCK_PAGE * ((length + 255) // 256)
+            if address // 0x10000 not in self.erased:
+                self.erased.add(address // 0x10000)
+                busy += MOCK_ERASE_64K
+            self.busy_until = now + busy * self.jitter
+            self.state = DFU_DNBUSY
+            poll = MOCK_POLL_MS
+
+        elif self.state == DFU_DNBUSY:
+            if now < self.busy_until:
+                poll = MOCK_POLL_MS
+            elif self.pending[0] == self.fail_block:
+                self.state, self.status = DFU_ERROR, DFU_STATUS_ERR_VERIFY
+            else:
+                self.state = DFU_DNLOAD_IDLE
+
+        elif self.state == DFU_MANIFEST_SYNC:
+            self.state = DFU_MANIFEST
+
+        elif self.state == DFU_MANIFEST:
+            # Manifestation tolerant
+            self.state = DFU_IDLE
+
+        return bytes([self.status, poll & 0xff, (poll >> 8) & 0xff, poll >> 16, self.state, 0])
+
+    def request(self, request, value, data):
+        if request == DFU_DNLOAD and self.state in (DFU_IDLE, DFU_DNLOAD_IDLE):
+            if len(data):
+                self.pending = (value, len(data))
+                self.state = DFU_DNLOAD_SYNC
+            else:
+                self.state = DFU_MANIFEST_SYNC
+            return b""
+        if request == DFU_GETSTATUS:
+            return self.get_status()
+        if request in (DFU_CLRSTATUS, DFU_ABORT):
+            self.state, self.status = DFU_IDLE, DFU_STATUS_OK
+            return b""
+
+        # Anything else stalls, and the DFU class drops into dfuERROR
+        self.state = DFU_ERROR
+        return None
+
+    def control(self, request_type, request, value, data, callback, timeout=5.0):
+        size = data if isinstance(data, int) else len(data)
+        self.backend.transfer(size, lambda: self.complete(request, value, data, callback))
+
+    def complete(self, request, value, data, callback):
+        result = self.request(request, value, data if isinstance(data, (bytes, bytearray)) else b"")
+        if result is None:
+            callback(None, "stall")
+        else:
+            callback(result, None)
+
+    def reset(self):
+        pass
+
+    def close(self):
+        pass
+
+
+class MockBackend:
+    """ N bootloaders on one shared bus, on a virtual clock that jumps to the next event. """
+
+    def __init__(self, count, fail=None, seed=1):
+        rng = random.Random(seed)
+        self.time = 0.0
+        self.bus_free = 0.0
+        self.events = []
+        self.sequence = 0
+        self.boards = [MockBoard(self, i, rng.uniform(0.9, 1.2), fail if i == 0 else None) for i in range(count)]
+
+    def now(self):
+        return self.time
+
+    def transfer(self, size, fn):
+        start = max(self.time, self.bus_free)
+        self.bus_free = start + size * MOCK_BYTE_TIME
+        heapq.heappush(self.events, (self.bus_free + MOCK_CONTROL_LATENCY, self.sequence, fn))
+        self.sequence += 1
+
+    def poll(self, timeout):
+        deadline = self.time + timeout
+        if self.events and self.events[0][0] <= deadline:
+            when, _, fn = heapq.heappop(self.events)
+            self.time = max(self.time, when)
+            fn()
+        else:
+            self.time = deadline
+
+    def find(self, serials):
+        return [b for b in self.boards if not serials or b.serial.lower() in serials]
+
+
+# DFU download -------------------------------------------------------------------------------
+
+class Download:
+    """ One board's download, as a chain of transfer callbacks and timers. """
+
+    def __init__(self, loop, board, image, alt, reset):
+        self.loop = loop
+        self.board = board
+        self.image = image
+        self.alt = alt
+        self.reset = reset
+
+        self.block = 0
+        self.offset = 0
+        self.phase = "waiting"
+        self.error = None
+        self.done = False
+
+        self.started = None
+        self.finished = None
+        self.getstatus = 0
+        self.busy_polls = 0
+        self.dnload_time = 0.0
+        self.block_time = 0.0
+        self.block_started = 0.0
+
+    def start(self):
+        self.started = self.loop.now()
+        self.phase = "starting"
+        try:
+            self.board.open(self.alt)
+        except Exception as e:
+            return self.fail(f"open: {e}")
+        self.get_status(self.on_initial_status)
+
+    def fail(self, error):
+        self.error = error
+        self.phase = "failed"
+        self.finish()
+
+    def finish(self):
+        self.finished = self.loop.now()
+        self.done = True
+        self.board.close()
+
+    def get_status(self, then):
+        self.getstatus += 1
+
+        def done(data, error):
+            if error or len(data) < 6:
+                return self.fail(f"GETSTATUS: {error or 'short reply'}")
+            then(data[0], (data[1] | (data[2] << 8) | (data[3] << 16)) / 1000, data[4])
+
+        self.board.control(REQUEST_IN, DFU_GETSTATUS, 0, 6, done)
+
+    def request(self, request, value, data, then):
+        def done(result, error):
+            if error:
+                return self.fail(f"request {request}: {error}")
+            then()
+        self.board.control(REQUEST_OUT, request, value, data, done)
+
+    # A board left in an error state, or mid transfer, by an earlier run is brought back to idle
+    def on_initial_status(self, status, poll, state):
+        if state == DFU_ERROR:
+            self.request(DFU_CLRSTATUS, 0, b"", self.send_block)
+        elif state != DFU_IDLE:
+            self.request(DFU_ABORT, 0, b"", self.send_block)
+        else:
+            self.send_block()
+
+    def send_block(self):
+        self.phase = "download"
+        chunk = self.image[self.offset:self.offset + self.board.transfer_size]
+        self.block_started = self.loop.now()
+
+        def done(result, error):
+            if error:
+                return self.fail(f"DNLOAD {self.block}: {error}")
+            self.dnload_time += self.loop.now() - self.block_started
+            self.get_status(self.on_block_status)
+
+        self.board.control(REQUEST_OUT, DFU_DNLOAD, self.block, chunk, done)
+
+    def on_block_status(self, status, poll, state):
+        if status != DFU_STATUS_OK or state == DFU_ERROR:
+            return self.fail(f"block {self.block}: status {status} state {state}")
+
+        if state == DFU_DNBUSY:
+            self.busy_polls += 1
+            self.loop.call_later(poll, lambda: self.get_status(self.on_block_status))
+        elif state == DFU_DNLOAD_IDLE:
+            self.block_time += self.loop.now() - self.block_started
+            self.offset += min(self.board.transfer_size, len(self.image) - self.offset)
+            self.block += 1
+            if self.offset < len(self.image):
+                self.send_block()
+            else:
+                self.phase = "manifest"
+                self.request(DFU_DNLOAD, self.block, b"", lambda: self.get_status(self.on_manifest_status))
+        else:
+            self.fail(f"block {self.block}: unexpected state {state}")
+
+    def on_manifest_status(self, status, poll, state):
+        if status != DFU_STATUS_OK or state == DFU_ERROR:
+            return self.fail(f"manifest: status {status} state {state}")
+
+        if state in (DFU_MANIFEST_SYNC, DFU_MANIFEST):
+            self.loop.call_later(poll, lambda: self.get_status(self.on_manifest_status))
+        elif state in (DFU_IDLE, DFU_MANIFEST_WAIT_RESET):
+            self.phase = "done"
+            if self.reset:
+                self.board.reset()
+            self.finish()
+        else:
+            self.fail(f"manifest: unexpected state {state}")
+
+    def elapsed(self):
+        if self.started is None:
+            return 0.0
+        return (self.finished if self.finished is not None else self.loop.now()) - self.started
+
+    def progress(self):
+        return self.offset / len(self.image) if self.image else 1.0
+
+
+# Reporting ----------------------------------------------------------------------------------
+
+class Progress:
+    """ One line per board, redrawn in place on a terminal, a single summary line otherwise. """
+
+    def __init__(self, downloads, stream=sys.stdout):
+        self.downloads = downloads
+        self.stream = stream
+        self.tty = stream.isatty()
+        self.drawn = 0
+
+    def update(self):
+        if self.tty:
+            if self.drawn:
+                self.stream.write(f"\x1b[{self.drawn}F")
+            for d in self.downloads:
+                width = 30
+                filled = int(d.progress() * width)
+                rate = d.offset / d.elapsed() / 1e3 if d.elapsed() else 0
+                self.stream.write(f"{d.board.serial:<20} [{'#' * filled}{'.' * (width - filled)}] "
+                                  f"{100 * d.progress():5.1f}% {rate:8.1f} KB/s {d.phase}\x1b[K\n")
+            self.drawn = len(self.downloads)
+        else:
+            finished = sum(d.done for d in self.downloads)
+            total = sum(d.progress() for d in self.downloads) / len(self.downloads)
+            self.stream.write(f"{finished}/{len(self.downloads)} finished, {100 * total:.1f}%\n")
+        self.stream.flush()
+
+
+def report(downloads, wall):
+    print()
+    print(f"{'serial':<20} {'location':<10} {'result':<7} {'bytes':>9} {'time s':>8} {'KB/s':>8} "
+          f"{'blocks':>6} {'polls':>6} {'dnload ms':>9} {'block ms':>9}")
+    for d in downloads:
+        blocks = max(d.block, 1)
+        print(f"{d.board.serial:<20} {d.board.location:<10} {'ok' if d.error is None else 'FAIL':<7} "
+              f"{d.offset:9d} {d.elapsed():8.2f} {d.offset / max(d.elapsed(), 1e-9) / 1e3:8.1f} "
+              f"{d.block:6d} {d.busy_polls:6d} {1e3 * d.dnload_time / blocks:9.2f} {1e3 * d.block_time / blocks:9.2f}")
+        if d.error:
+            print(f"  {d.error}")
+
+    total = sum(d.offset for d in downloads)
+    sequential = sum(d.elapsed() for d in downloads)
+    print(f"\n{len(downloads)} boards, {total} bytes in {wall:.2f}s, {total / max(wall, 1e-9) / 1e3:.1f} KB/s aggregate, "
+          f"{sequential / max(wall, 1e-9):.1f}x one board at a time")
+
+
+# Main ---------------------------------------------------------------------------------------
+
+def main():
+    parser = argparse.ArgumentParser(description="Flash every ButterStick bootloader on the bus in parallel")
+    parser.add_argument("-D", "--download", required=True, help="image to download, .dfu or raw binary")
+    parser.add_argument("-a", "--alt", type=int, default=0, help="DFU alt setting (default=0, gateware)")
+    parser.add_argument("-s", "--serial", action="append", default=[], help="only flash this serial, can be repeated")
+    parser.add_argument("-n", "--expect", type=int, default=None, help="fail unless exactly this many boards are found")
+    parser.add_argument("-R", "--reset", action="store_true", help="reset each board once its download is done")
+    parser.add_argument("--interval", type=float, default=1.0, help="seconds between progress updates (default=1.0)")
+    parser.add_argument("--mock", type=int, default=None, metavar="N", help="flash N simulated bootloaders instead")
+    parser.add_argument("--mock-fail", type=int, default=None, metavar="BLOCK", help="the first mock board fails verify on this block")
+    args = parser.parse_args()
+
+    image = load_image(args.download)
+    serials = {s.lower() for s in args.serial}
+
+    backend = MockBackend(args.mock, fail=args.mock_fail) if args.mock else LibusbBackend()
+    boards = backend.find(serials)
+
+    if not boards:
+        raise SystemExit("No ButterStick bootloader found")
+    if args.expect is not None and len(boards) != args.expect:
+        raise SystemExit(f"Found {len(boards)} boards, expected {args.expect}")
+    for board in boards:
+        if board.interface is None:
+            raise SystemExit(f"{board.serial}: no DFU interface")
+
+    print(f"flashing {len(image)} bytes to alt {args.alt} on {len(boards)} boards")
+
+    loop = Loop(backend)
+    downloads = [Download(loop, board, image, args.alt, args.reset) for board in boards]
+    progress = Progress(downloads)
+
+    start = loop.now()
+    for d in downloads:
+        d.start()
+    loop.run_until(lambda: all(d.done for d in downloads), progress.update, args.interval)
+    wall = loop.now() - start
+    progress.update()
+
+    report(downloads, wall)
+    sys.exit(1 if any(d.error for d in downloads) else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+
+# This file is Copyright (c) Greg Davill <greg.davill@gmail.com>
+# License: BSD
+#
+# Decodes the deferred binary log (firmware built with --dlog) from the debug UART.
+# Format strings come from the firmware ELF: the .dlog section for DLOG() call sites
+# and .rodata for tinyusb's TU_LOG.
+#
+#   python3 dlog.py build/butterstick_r1d0/software/fw/oc-fw.elf /dev/ttyUSB0
+#   python3 dlog.py oc-fw.elf --file capture.bin
+#
+# Requires pyelftools, and pyserial for live capture.
+
+import argparse
+import re
+import struct
+import sys
+
+from elftools.elf.elffile import ELFFile
+
+DLOG_SYNC = 0xa5
+DLOG_FMT_RODATA = 0x80
+DLOG_MAX_ARGS = 15
+
+CONVERSION = re.compile(r"%([-+ #0]*)(\d*)(?:\.(\d+))?(hh|h|ll|l|z|j|t)?([diuxXcspo%])")
+
+
+class Image:
+    def __init__(self, filename):
+        self.elf = ELFFile(open(filename, "rb"))
+        dlog = self.elf.get_section_by_name(".dlog")
+        self.dlog = dlog.data() if dlog is not None else b""
+
+    def cstring(self, data, offset):
+        end = data.find(b"\0", offset)
+        return data[offset:end if end >= 0 else None].decode("ascii", "replace")
+
+    def lookup(self, addr):
+        """String at a loaded address, None if it isn't in the image"""
+        for section in self.elf.iter_sections():
+            start, size = section["sh_addr"], section["sh_size"]
+            if section["sh_flags"] & 2 and start <= addr < start + size and section["sh_type"] != "SHT_NOBITS":
+                return self.cstring(section.data(), addr - start)
+        return None
+
+    def format_string(self, flags, fmt):
+        if flags & DLOG_FMT_RODATA:
+            return self.lookup(fmt)
+        if fmt < len(self.dlog):
+            return self.cstring(self.dlog, fmt)
+        return None
+
+
+def c_format(image, fmt, args):
+    args = list(args)
+
+    def conv(m):
+        flags, width, precision, _, kind = m.groups()
+        if kind == "%":
+            return "%"
+        value = args.pop(0) if args else 0
+        if kind in "di":
+            value = value - (1 << 32) if value & 0x80000000 else value
+            kind = "d"
+        elif kind == "u":
+            kind = "d"
+        elif kind == "p":
+            return f"0x{value:08x}"
+        elif kind == "c":
+            value = chr(value & 0xff)
+        elif kind == "s":
+            value = image.lookup(value) or f"<0x{value:08x}>"
+        spec = "%" + flags + width + ("." + precision if precision else "") + kind
+        return spec % value
+
+    return CONVERSION.sub(conv, fmt)
+
+
+def records(stream, live):
+    """Yields (flags, seq, fmt, stamp, args), resynchronising on the sync byte"""
+    buf = b""
+    while True:
+        chunk = stream.read(256)
+        if not chunk:
+            if not live:
+                return
+            continue
+        buf += chunk
+        while True:
+            sync = buf.find(bytes([DLOG_SYNC]))
+            if sync < 0:
+                buf = b""
+                break
+            buf = buf[sync:]
+            if len(buf) < 12:
+                break
+            header, fmt, stamp = struct.unpack_from("<III", buf)
+            flags, seq = (header >> 8) & 0xff, header >> 16
+            nargs = flags & DLOG_MAX_ARGS
+            if flags & 0x70:
+                buf = buf[1:]  # not a header, keep looking
+                continue
+            size = 12 + 4 * nargs
+            if len(buf) < size:
+                break
+            args = struct.unpack_from(f"<{nargs}I", buf, 12)
+            buf = buf[size:]
+            yield flags, seq, fmt, stamp, args
+
+
+def main():
+    parser = argparse.ArgumentParser(description="ButterStick bootloader deferred log decoder")
+    parser.add_argument("elf", help="firmware ELF the device is running (oc-fw.elf)")
+    parser.add_argument("port", nargs="?", default=None, help="serial port for live capture")
+    parser.add_argument("--baud", type=int, default=1000000, help="UART baud rate (default=1000000)")
+    parser.add_argument("--file", default=None, help="decode a raw capture instead of a serial port")
+    parser.add_argument("--clock", type=float, default=60e6, help="sys clock in Hz, to scale stamps")
+    args = parser.parse_args()
+
+    image = Image(args.elf)
+
+    if args.file:
+        stream = open(args.file, "rb")
+    elif args.port:
+        import serial
+        stream = serial.Serial(args.port, args.baud, timeout=0.1)
+    else:
+        raise SystemExit("give a serial port or --file")
+
+    last_seq = None
+    last_stamp = None
+    cycles = 0
+    try:
+        for flags, seq, fmt, stamp, values in records(stream, live=args.file is None):
+            if last_seq is not None and seq != (last_seq + 1) & 0xffff:
+                print(f"--- {(seq - last_seq - 1) & 0xffff} records dropped ---")
+            last_seq = seq
+
+            # Stamps are the low 32 bits of the cycle counter
+            if last_stamp is not None:
+                cycles += (stamp - last_stamp) & 0xffffffff
+            last_stamp = stamp
+
+            text = image.format_string(flags, fmt)
+            if text is None:
+                text = f"<unknown format 0x{fmt:08x}> " + " ".join(f"{v:#x}" for v in values)
+            else:
+                text = c_format(image, text, values)
+            sys.stdout.write(f"[{cycles / args.clock:12.6f}] {text.rstrip()}\n")
+            sys.stdout.flush()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
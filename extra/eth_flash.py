@@ -0,0 +1,543 @@
+#!/usr/bin/env python3
+
+# This file is Copyright (c) Greg Davill <greg.davill@gmail.com>
+# License: BSD
+#
+# Pushes an image over UDP to every ButterStick bootloader built with --eth-flash, in parallel.
+#
+#   python3 eth_flash.py -a 0 -D butterstick_r1d0.dfu -s 0a1b-2c3d-4e5f-6071 -s ...
+#   python3 eth_flash.py -a 0 -D butterstick_r1d0.dfu -b 10.42.17.3 -b 10.42.99.120
+#
+# Boards are addressed by IP. With --eth-flash 10.42.0.0/16 each board takes the host part of
+# its address from the flash UUID, which is also its USB serial number, so -s SERIAL works out
+# the address (--ip-for prints it). Blocks follow the go-back-N protocol in
+# firmware/include/eth_flash.h: the board holds a window of blocks it has received but not yet
+# programmed, and says in every reply which block it wants next and how many are programmed.
+# A board that is out of buffers answers BUSY and is probed again a little later, a lost
+# packet is caught by a timeout and everything from the board's next block is sent again.
+#
+# Works against the host build (firmware/host, -N -e PORT) on 127.0.0.1.
+# --mock N runs the same downloads against N simulated bootloaders on 127.0.0.1.
+
+import argparse
+import heapq
+import ipaddress
+import random
+import selectors
+import socket
+import struct
+import sys
+import threading
+import time
+import zlib
+
+PORT = 6565
+
+MAGIC = 0x4642
+BLOCK_SIZE = 1024
+WINDOW = 2
+
+OP_INFO, OP_START, OP_DATA, OP_END, OP_REBOOT = range(5)
+
+STATUS_OK, STATUS_BUSY, STATUS_ERR_ADDRESS, STATUS_ERR_VERIFY, STATUS_ERR_STATE = range(5)
+STATUS_NAMES = ["ok", "busy", "address error", "verify error", "state error"]
+
+HEADER = struct.Struct("<HBBI")
+REPLY = struct.Struct("<HBBIB3xII20s")
+
+VID, PID = 0x1209, 0x5af1
+
+
+def load_image(path):
+    """ Returns the payload of a .dfu file with its suffix checked and removed, or a raw binary as is. """
+    with open(path, "rb") as f:
+        data = f.read()
+
+    if len(data) < 16 or data[-8:-5] != b"UFD":
+        return data
+
+    length = data[-5]
+    crc, = struct.unpack("<I", data[-4:])
+    if crc != zlib.crc32(data[:-4]) ^ 0xffffffff:
+        raise SystemExit(f"{path}: DFU suffix CRC mismatch")
+
+    product, vendor = struct.unpack("<HH", data[-14:-10])
+    if vendor not in (0xffff, VID) or product not in (0xffff, PID):
+        raise SystemExit(f"{path}: built for {vendor:04x}:{product:04x}, not {VID:04x}:{PID:04x}")
+
+    return data[:-length]
+
+
+def board_ip(serial, network):
+    """ Address a board takes under --eth-flash NETWORK, same as eth_ip() in firmware/eth_flash.c. """
+    uuid = bytes.fromhex(serial.replace("-", ""))
+    if len(uuid) != 8:
+        raise SystemExit(f"{serial}: not a flash UUID serial number")
+
+    host = int(network.hostmask)
+    if host == 0:
+        return network.network_address
+
+    ident = zlib.crc32(uuid) & host
+    if ident == 0:
+        ident = 1
+    elif ident == host:
+        ident = host - 1
+    return network.network_address + ident
+
+
+def parse_board(text):
+    host, _, port = text.partition(":")
+    return (str(ipaddress.ip_address(host)), int(port) if port else PORT)
+
+
+# Event loop ---------------------------------------------------------------------------------
+
+class Loop:
+    """ Timers and socket readiness on the wall clock. """
+
+    def __init__(self):
+        self.selector = selectors.DefaultSelector()
+        self.timers = []
+        self.sequence = 0
+
+    def now(self):
+        return time.monotonic()
+
+    def call_later(self, delay, fn):
+        timer = [self.now() + delay, self.sequence, fn]
+        heapq.heappush(self.timers, timer)
+        self.sequence += 1
+        return timer
+
+    def cancel(self, timer):
+        if timer is not None:
+            timer[2] = None
+
+    def add_reader(self, sock, fn):
+        self.selector.register(sock, selectors.EVENT_READ, fn)
+
+    def remove_reader(self, sock):
+        self.selector.unregister(sock)
+
+    def run_until(self, done, on_tick, interval):
+        next_tick = self.now()
+        while not done():
+            now = self.now()
+            while self.timers and self.timers[0][0] <= now:
+                _, _, fn = heapq.heappop(self.timers)
+                if fn is not None:
+                    fn()
+
+            if now >= next_tick:
+                on_tick()
+                next_tick = now + interval
+
+            deadline = min(self.timers[0][0], next_tick) if self.timers else next_tick
+            for key, _ in self.selector.select(max(0.0, deadline - self.now())):
+                key.data()
+
+
+# Download -----------------------------------------------------------------------------------
+
+class Download:
+    """ One board's download: INFO, START, a window of DATA blocks, END and an optional REBOOT. """
+
+    def __init__(self, loop, address, image, alt, reboot, serial=None, window=WINDOW,
+                 timeout=0.1, busy_delay=0.002, retries=20):
+        self.loop = loop
+        self.address = address
+        self.image = image
+        self.alt = alt
+        self.reboot = reboot
+        self.expected_serial = serial
+        self.serial = serial or "?"
+        self.window = window
+        self.timeout = timeout
+        self.busy_delay = busy_delay
+        self.retries = retries
+
+        self.blocks = (len(image) + BLOCK_SIZE - 1) // BLOCK_SIZE
+        self.received = 0    # board's next block
+        self.committed = 0   # blocks programmed and verified on the board
+        self.sent = 0        # blocks sent since the last go-back
+
+        self.phase = "waiting"
+        self.error = None
+        self.done = False
+
+        self.started = None
+        self.finished = None
+        self.packets = 0
+        self.timeouts = 0
+        self.busy = 0
+        self.missed = 0
+        self.timer = None
+        self.probe = None
+
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.setblocking(False)
+
+    @property
+    def location(self):
+        return f"{self.address[0]}:{self.address[1]}"
+
+    def start(self):
+        self.started = self.loop.now()
+        self.loop.add_reader(self.sock, self.on_readable)
+        self.phase = "info"
+        self.request(OP_INFO)
+
+    def fail(self, error):
+        self.error = error
+        self.phase = "failed"
+        self.finish()
+
+    def finish(self):
+        self.finished = self.loop.now()
+        self.done = True
+        self.loop.cancel(self.timer)
+        self.loop.cancel(self.probe)
+        self.loop.remove_reader(self.sock)
+        self.sock.close()
+
+    def send(self, op, seq=0, payload=b""):
+        self.packets += 1
+        self.sock.sendto(HEADER.pack(MAGIC, op, self.alt, seq) + payload, self.address)
+
+    # Requests other than DATA are sent again until they get a reply
+    def request(self, op, seq=0):
+        self.send(op, seq)
+        self.arm(lambda: self.request(op, seq))
+
+    def arm(self, retry):
+        self.loop.cancel(self.timer)
+        self.timer = self.loop.call_later(self.timeout, lambda: self.on_timeout(retry))
+
+    def on_timeout(self, retry):
+        self.timer = None
+        self.timeouts += 1
+        self.missed += 1
+        if self.missed > self.retries:
+            return self.fail(f"no reply in {self.phase}")
+        retry()
+
+    def on_readable(self):
+        while not self.done:
+            try:
+                data = self.sock.recv(2048)
+            except BlockingIOError:
+                return
+            if len(data) < REPLY.size:
+                continue
+
+            magic, op, alt, seq, status, received, committed, serial = REPLY.unpack_from(data)
+            if magic == MAGIC:
+                self.on_reply(op, seq, status, received, committed, serial.split(b"\0")[0].decode(errors="replace"))
+
+    def on_reply(self, op, seq, status, received, committed, serial):
+        self.missed = 0
+        if status not in (STATUS_OK, STATUS_BUSY):
+            return self.fail(f"{self.phase}: {STATUS_NAMES[status] if status < len(STATUS_NAMES) else status}")
+
+        if self.phase == "info" and op == OP_INFO:
+            self.loop.cancel(self.timer)
+            if self.expected_serial and serial != self.expected_serial:
+                return self.fail(f"answered as {serial}")
+            self.serial = serial
+            self.phase = "start"
+            self.request(OP_START)
+
+        elif self.phase == "start" and op == OP_START:
+            self.loop.cancel(self.timer)
+            if status == STATUS_BUSY:
+                self.timer = self.loop.call_later(self.busy_delay * 10, lambda: self.request(OP_START))
+                return
+            self.phase = "download"
+            self.pump()
+
+        elif self.phase == "download" and op == OP_DATA:
+            self.received = received
+            self.committed = committed
+            self.sent = max(min(self.sent, self.blocks), self.received)
+            if status == STATUS_BUSY:
+                self.busy += 1
+            if self.received == self.blocks:
+                self.loop.cancel(self.timer)
+                self.loop.cancel(self.probe)
+                self.phase = "end"
+                self.request(OP_END, self.blocks)
+            else:
+                self.pump()
+
+        elif self.phase == "end" and op == OP_END:
+            self.committed = committed
+            self.loop.cancel(self.timer)
+            if status == STATUS_BUSY:
+                self.timer = self.loop.call_later(self.busy_delay, lambda: self.request(OP_END, self.blocks))
+            elif self.reboot:
+                self.phase = "reboot"
+                self.request(OP_REBOOT)
+            else:
+                self.phase = "done"
+                self.finish()
+
+        elif self.phase == "reboot" and op == OP_REBOOT:
+            self.phase = "done"
+            self.finish()
+
+    # Keeps the board's window full, blocks past it would only be answered BUSY
+    def pump(self):
+        limit = min(self.committed + self.window, self.blocks)
+        while self.sent < limit:
+            self.send_block(self.sent)
+            self.sent += 1
+
+        self.arm(self.go_back)
+
+        # Window full, ask again once the flash has had time to take a block
+        if self.sent >= limit and self.probe is None:
+            self.probe = self.loop.call_later(self.busy_delay, self.on_probe)
+
+    def send_block(self, block):
+        offset = block * BLOCK_SIZE
+        self.send(OP_DATA, block, self.image[offset:offset + BLOCK_SIZE])
+
+    def on_probe(self):
+        self.probe = None
+        if self.phase == "download":
+            self.send_block(self.received)
+
+    def go_back(self):
+        self.sent = self.received
+        self.pump()
+
+    def elapsed(self):
+        if self.started is None:
+            return 0.0
+        return (self.finished if self.finished is not None else self.loop.now()) - self.started
+
+    def progress(self):
+        return self.committed / self.blocks if self.blocks else 1.0
+
+    def bytes_done(self):
+        return min(self.committed * BLOCK_SIZE, len(self.image))
+
+
+# Mock boards --------------------------------------------------------------------------------
+
+class MockBoard(threading.Thread):
+    """ Board side of the protocol on a loopback socket, the flash takes typical W25Q128JV times. """
+
+    PAGE_PROGRAM = 0.0007
+    BLOCK_ERASE = 0.15
+
+    def __init__(self, index, limit, loss=0.0, fail=None):
+        super().__init__(daemon=True)
+        self.uuid = bytes(random.getrandbits(8) for _ in range(8))
+        self.serial = "-".join(self.uuid[i:i + 2].hex() for i in range(0, 8, 2))
+        self.limit = limit
+        self.loss = loss
+        self.fail = fail
+
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.bind(("127.0.0.1", 0))
+        self.address = self.sock.getsockname()
+
+        self.state = "idle"
+        self.error = STATUS_OK
+        self.received = 0
+        self.committed = 0
+        self.busy_until = None
+
+    def run(self):
+        while True:
+            timeout = None
+            if self.busy_until is not None:
+                timeout = max(0.0, self.busy_until - time.monotonic())
+            self.sock.settimeout(timeout)
+
+            try:
+                data, source = self.sock.recvfrom(2048)
+            except (socket.timeout, BlockingIOError):
+                data = None
+
+            if self.busy_until is not None and time.monotonic() >= self.busy_until:
+                self.program_done()
+
+            if data is None or random.random() < self.loss or len(data) < HEADER.size:
+                continue
+
+            magic, op, alt, seq = HEADER.unpack_from(data)
+            if magic != MAGIC:
+                continue
+            status = self.handle(op, alt, seq, len(data) - HEADER.size)
+            if status is None or random.random() < self.loss:
+                continue
+
+            self.sock.sendto(REPLY.pack(magic, op, alt, seq, status, self.received, self.committed,
+                                        self.serial.encode()), source)
+            if op == OP_REBOOT:
+                return
+
+    def handle(self, op, alt, seq, length):
+        if op == OP_INFO or op == OP_REBOOT:
+            return STATUS_OK
+        if op == OP_START:
+            if self.busy_until is not None:
+                return STATUS_BUSY
+            if alt > 2:
+                return STATUS_ERR_ADDRESS
+            self.state, self.error, self.received, self.committed = "receiving", STATUS_OK, 0, 0
+            return STATUS_OK
+        if op == OP_DATA:
+            if self.state == "failed":
+                return self.error
+            if self.state != "receiving":
+                return STATUS_ERR_STATE
+            if seq != self.received or length == 0 or length > BLOCK_SIZE:
+                return STATUS_OK
+            if self.received - self.committed >= WINDOW:
+                return STATUS_BUSY
+            self.received += 1
+            self.program_next()
+            return STATUS_OK
+        if op == OP_END:
+            if self.state == "failed":
+                return self.error
+            if self.state == "done" and seq == self.received:
+                return STATUS_OK
+            if self.state != "receiving" or seq != self.received:
+                return STATUS_ERR_STATE
+            if self.committed != self.received:
+                return STATUS_BUSY
+            self.state = "done"
+            return STATUS_OK
+        return None
+
+    def program_next(self):
+        if self.busy_until is not None or self.committed == self.received or self.state != "receiving":
+            return
+        if self.committed * BLOCK_SIZE >= self.limit:
+            self.state, self.error = "failed", STATUS_ERR_ADDRESS
+            return
+        duration = (BLOCK_SIZE // 256) * self.PAGE_PROGRAM
+        if (self.committed * BLOCK_SIZE) % (64 * 1024) == 0:
+            duration += self.BLOCK_ERASE
+        self.busy_until = time.monotonic() + duration
+
+    def program_done(self):
+        self.busy_until = None
+        if self.fail is not None and self.committed == self.fail:
+            self.state, self.error = "failed", STATUS_ERR_VERIFY
+            return
+        self.committed += 1
+        self.program_next()
+
+
+# Reporting ----------------------------------------------------------------------------------
+
+class Progress:
+    """ One line per board, redrawn in place on a terminal, a single summary line otherwise. """
+
+    def __init__(self, downloads, stream=sys.stdout):
+        self.downloads = downloads
+        self.stream = stream
+        self.tty = stream.isatty()
+        self.drawn = 0
+
+    def update(self):
+        if self.tty:
+            if self.drawn:
+                self.stream.write(f"\x1b[{self.drawn}F")
+            for d in self.downloads:
+                width = 30
+                filled = int(d.progress() * width)
+                rate = d.bytes_done() / d.elapsed() / 1e3 if d.elapsed() else 0
+                self.stream.write(f"{d.serial:<20} [{'#' * filled}{'.' * (width - filled)}] "
+                                  f"{100 * d.progress():5.1f}% {rate:8.1f} KB/s {d.phase}\x1b[K\n")
+            self.drawn = len(self.downloads)
+        else:
+            finished = sum(d.done for d in self.downloads)
+            total = sum(d.progress() for d in self.downloads) / len(self.downloads)
+            self.stream.write(f"{finished}/{len(self.downloads)} finished, {100 * total:.1f}%\n")
+        self.stream.flush()
+
+
+def report(downloads, wall):
+    print()
+    print(f"{'serial':<20} {'address':<21} {'result':<7} {'bytes':>9} {'time s':>8} {'KB/s':>8} "
+          f"{'packets':>7} {'timeouts':>8} {'busy':>6}")
+    for d in downloads:
+        print(f"{d.serial:<20} {d.location:<21} {'ok' if d.error is None else 'FAIL':<7} "
+              f"{d.bytes_done():9d} {d.elapsed():8.2f} {d.bytes_done() / max(d.elapsed(), 1e-9) / 1e3:8.1f} "
+              f"{d.packets:7d} {d.timeouts:8d} {d.busy:6d}")
+        if d.error:
+            print(f"  {d.error}")
+
+    total = sum(d.bytes_done() for d in downloads)
+    sequential = sum(d.elapsed() for d in downloads)
+    print(f"\n{len(downloads)} boards, {total} bytes in {wall:.2f}s, {total / max(wall, 1e-9) / 1e3:.1f} KB/s aggregate, "
+          f"{sequential / max(wall, 1e-9):.1f}x one board at a time")
+
+
+# Main ---------------------------------------------------------------------------------------
+
+def main():
+    parser = argparse.ArgumentParser(description="Push an image to ButterStick bootloaders over UDP in parallel")
+    parser.add_argument("-D", "--download", help="image to download, .dfu or raw binary")
+    parser.add_argument("-a", "--alt", type=int, default=0, help="partition, numbered like the DFU alt settings (default=0, gateware)")
+    parser.add_argument("-b", "--board", action="append", default=[], metavar="IP[:PORT]", help="flash the board at this address, can be repeated")
+    parser.add_argument("-s", "--serial", action="append", default=[], help="flash the board with this serial number, can be repeated")
+    parser.add_argument("--network", default="10.42.0.0/16", help="--eth-flash network the serial numbers are in (default=10.42.0.0/16)")
+    parser.add_argument("-p", "--port", type=int, default=PORT, help=f"UDP port for -s (default={PORT})")
+    parser.add_argument("--ip-for", metavar="SERIAL", help="print the address a board takes on --network and exit")
+    parser.add_argument("-R", "--reboot", action="store_true", help="hand each board over to its user bitstream once done")
+    parser.add_argument("--timeout", type=float, default=0.1, help="seconds before a lost packet is sent again (default=0.1)")
+    parser.add_argument("--interval", type=float, default=1.0, help="seconds between progress updates (default=1.0)")
+    parser.add_argument("--mock", type=int, default=None, metavar="N", help="flash N simulated bootloaders on 127.0.0.1 instead")
+    parser.add_argument("--mock-loss", type=float, default=0.0, metavar="P", help="mock boards drop requests and replies with probability P")
+    parser.add_argument("--mock-fail", type=int, default=None, metavar="BLOCK", help="the first mock board fails verify on this block")
+    args = parser.parse_args()
+
+    network = ipaddress.ip_network(args.network)
+    if args.ip_for:
+        print(board_ip(args.ip_for.lower(), network))
+        return
+
+    if not args.download:
+        parser.error("-D is required")
+    image = load_image(args.download)
+
+    targets = [(parse_board(b), None) for b in args.board]
+    targets += [((str(board_ip(s.lower(), network)), args.port), s.lower()) for s in args.serial]
+
+    if args.mock:
+        for i in range(args.mock):
+            board = MockBoard(i, 0x600000, loss=args.mock_loss, fail=args.mock_fail if i == 0 else None)
+            board.start()
+            targets.append((board.address, board.serial))
+
+    if not targets:
+        raise SystemExit("No boards given, use -b, -s or --mock")
+
+    print(f"flashing {len(image)} bytes to partition {args.alt} on {len(targets)} boards")
+
+    loop = Loop()
+    downloads = [Download(loop, address, image, args.alt, args.reboot, serial=serial, timeout=args.timeout)
+                 for address, serial in targets]
+    progress = Progress(downloads)
+
+    start = loop.now()
+    for d in downloads:
+        d.start()
+    loop.run_until(lambda: all(d.done for d in downloads), progress.update, args.interval)
+    wall = loop.now() - start
+    progress.update()
+
+    report(downloads, wall)
+    sys.exit(1 if any(d.error for d in downloads) else 0)
+
+
+if __name__ == "__main__":
+    main()
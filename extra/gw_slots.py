@@ -0,0 +1,65 @@
+#!/usr/bin/env python3
+
+# This file is Copyright (c) Greg Davill <greg.davill@gmail.com>
+# License: BSD
+#
+# Inspect and manage the A/B gateware slots of a bootloader built with --ab-slots.
+#
+# Requires pyusb.
+
+import argparse
+import struct
+
+import usb.core
+import usb.util
+
+VID, PID = 0x1209, 0x5af1
+
+VENDOR_REQUEST_SLOTS = 2
+SLOT_READ, SLOT_CONFIRM, SLOT_ROLLBACK = 0, 1, 2
+
+SLOT_NAMES = {0: "A", 1: "B", 0xff: "-"}
+
+
+def find_device(serial=None):
+    for dev in usb.core.find(find_all=True, idVendor=VID, idProduct=PID):
+        if serial is None or usb.util.get_string(dev, dev.iSerialNumber) == serial:
+            return dev
+    raise SystemExit("No ButterStick bootloader found")
+
+
+def request_out(dev, value):
+    bm = usb.util.build_request_type(usb.util.CTRL_OUT, usb.util.CTRL_TYPE_VENDOR, usb.util.CTRL_RECIPIENT_DEVICE)
+    dev.ctrl_transfer(bm, VENDOR_REQUEST_SLOTS, value, 0, None, timeout=5000)
+
+
+def read_record(dev):
+    bm = usb.util.build_request_type(usb.util.CTRL_IN, usb.util.CTRL_TYPE_VENDOR, usb.util.CTRL_RECIPIENT_DEVICE)
+    data = dev.ctrl_transfer(bm, VENDOR_REQUEST_SLOTS, SLOT_READ, 0, 8, timeout=1000)
+    magic, active, trial, boots, _ = struct.unpack("<IBBBB", bytes(data))
+    return active, trial, boots
+
+
+def main():
+    parser = argparse.ArgumentParser(description="ButterStick A/B gateware slot control")
+    parser.add_argument("--serial", default=None, help="select device by serial number")
+    parser.add_argument("command", nargs="?", default="status", choices=["status", "confirm", "rollback"])
+    args = parser.parse_args()
+
+    dev = find_device(args.serial)
+
+    try:
+        if args.command == "confirm":
+            request_out(dev, SLOT_CONFIRM)
+        elif args.command == "rollback":
+            request_out(dev, SLOT_ROLLBACK)
+    except usb.core.USBError as e:
+        raise SystemExit(f"{args.command} failed: {e} (bootloader built without --ab-slots, or no trial slot?)")
+
+    active, trial, boots = read_record(dev)
+    print(f"active : {SLOT_NAMES.get(active, active)}")
+    print(f"trial  : {SLOT_NAMES.get(trial, trial)}" + (f" ({boots} boots)" if trial != 0xff else ""))
+
+
+if __name__ == "__main__":
+    main()
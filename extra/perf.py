@@ -0,0 +1,228 @@
+#!/usr/bin/env python3
+
+# This file is Copyright (c) Greg Davill <greg.davill@gmail.com>
+# License: BSD
+#
+# Reads the bootloader update counters (vendor request 3) and prints where the time went.
+# With a command after --, the counters are reset first and read back once it exits:
+#
+#   python3 perf.py -- dfu-util -a 0 -D gateware.dfu
+#
+# Don't pass -R to dfu-util, the counters are lost when the bootloader hands over.
+# --bus adds the wishbone bus counters (gateware built with --bus-stats, vendor request 5).
+# --irq adds the interrupt latency histograms (gateware built with --irq-stats, vendor request 6).
+# --boot prints the boot phase stamps instead (vendor request 7) and the enumeration time.
+#
+# Requires pyusb.
+
+import argparse
+import struct
+import subprocess
+import time
+
+import usb.core
+import usb.util
+
+VID, PID = 0x1209, 0x5af1
+
+VENDOR_REQUEST_PERF = 3
+PERF_READ, PERF_RESET = 0, 1
+
+VENDOR_REQUEST_BUS = 5
+
+# Matches busmon_snapshot_t in firmware/include/busmon.h
+BUS_TAPS = ["cpu_ibus", "cpu_dbus", "csr", "csr_bank", "usb", "spiflash"]
+
+VENDOR_REQUEST_IRQ = 6
+
+# Matches irq_source_stats_t and the IRQ_SRC_ order in firmware/include/irq_stats.h
+IRQ_SOURCES = ["usb", "timer", "uart"]
+IRQ_BUCKETS = 16
+
+VENDOR_REQUEST_BOOT = 7
+
+# Matches bootprof_snapshot_t and the BOOT_STAMP_ order in firmware/include/bootprof.h
+BOOT_FORMAT = "<9I"
+BOOT_PHASES = ["start", "decided", "vccio", "usb_reset", "usb_ready", "bus_reset", "mounted", "exit"]
+
+# Matches perf_counters_t in firmware/include/perf.h
+PERF_FORMAT = "<8I4Q"
+PERF_FIELDS = ["clock_hz", "usb_rx_bytes", "dnload_count", "getstatus_count", "erase_count",
+               "program_count", "poll_count", "reserved",
+               "erase_cycles", "program_cycles", "verify_cycles", "uptime_cycles"]
+
+
+def find_device(serial=None):
+    for dev in usb.core.find(find_all=True, idVendor=VID, idProduct=PID):
+        if serial is None or usb.util.get_string(dev, dev.iSerialNumber) == serial:
+            return dev
+    raise SystemExit("No ButterStick bootloader found")
+
+
+def perf_reset(dev, request=VENDOR_REQUEST_PERF):
+    bm = usb.util.build_request_type(usb.util.CTRL_OUT, usb.util.CTRL_TYPE_VENDOR, usb.util.CTRL_RECIPIENT_DEVICE)
+    dev.ctrl_transfer(bm, request, PERF_RESET, 0, None, timeout=1000)
+
+
+def perf_read(dev):
+    bm = usb.util.build_request_type(usb.util.CTRL_IN, usb.util.CTRL_TYPE_VENDOR, usb.util.CTRL_RECIPIENT_DEVICE)
+    size = struct.calcsize(PERF_FORMAT)
+    data = bytes(dev.ctrl_transfer(bm, VENDOR_REQUEST_PERF, PERF_READ, 0, size, timeout=1000))
+    return dict(zip(PERF_FIELDS, struct.unpack(PERF_FORMAT, data[:size])))
+
+
+def bus_read(dev):
+    bm = usb.util.build_request_type(usb.util.CTRL_IN, usb.util.CTRL_TYPE_VENDOR, usb.util.CTRL_RECIPIENT_DEVICE)
+    size = 4 + 8 * len(BUS_TAPS)
+    words = struct.unpack(f"<{size // 4}I", bytes(dev.ctrl_transfer(bm, VENDOR_REQUEST_BUS, PERF_READ, 0, size, timeout=1000)))
+    return words[0], {name: (words[1 + 2 * i], words[2 + 2 * i]) for i, name in enumerate(BUS_TAPS)}
+
+
+def bus_report(cycles, taps):
+    print(f"bus window : {cycles} cycles")
+    print("             transactions      waits  busy%  waits/txn")
+    for name, (txn, waits) in taps.items():
+        busy = 100 * (txn + waits) / cycles if cycles else 0
+        per = waits / txn if txn else 0
+        print(f"{name:10s} : {txn:12d} {waits:10d} {busy:5.1f}% {per:10.2f}")
+
+
+def irq_read(dev):
+    bm = usb.util.build_request_type(usb.util.CTRL_IN, usb.util.CTRL_TYPE_VENDOR, usb.util.CTRL_RECIPIENT_DEVICE)
+    per_source = 3 + 2 * IRQ_BUCKETS
+    size = 4 * per_source * len(IRQ_SOURCES)
+    words = struct.unpack(f"<{size // 4}I", bytes(dev.ctrl_transfer(bm, VENDOR_REQUEST_IRQ, PERF_READ, 0, size, timeout=1000)))
+    stats = {}
+    for i, name in enumerate(IRQ_SOURCES):
+        w = words[i * per_source:(i + 1) * per_source]
+        stats[name] = {
+            "count": w[0], "latency_max": w[1], "duration_max": w[2],
+            "latency_hist": w[3:3 + IRQ_BUCKETS], "duration_hist": w[3 + IRQ_BUCKETS:],
+        }
+    return stats
+
+
+def boot_read(dev):
+    bm = usb.util.build_request_type(usb.util.CTRL_IN, usb.util.CTRL_TYPE_VENDOR, usb.util.CTRL_RECIPIENT_DEVICE)
+    size = struct.calcsize(BOOT_FORMAT)
+    clock_hz, *stamps = struct.unpack(BOOT_FORMAT, bytes(dev.ctrl_transfer(bm, VENDOR_REQUEST_BOOT, PERF_READ, 0, size, timeout=1000)))
+    return clock_hz, dict(zip(BOOT_PHASES, stamps))
+
+
+def boot_report(clock_hz, stamps):
+    # A phase that hasn't been reached since configuration reads as 0
+    print("boot phase   ms since configuration")
+    for name, cycles in stamps.items():
+        print(f"{name:10s} : " + (f"{cycles * 1e3 / clock_hz:9.2f}" if cycles else "        -"))
+    if stamps["bus_reset"] and stamps["mounted"]:
+        print(f"enumeration: {(stamps['mounted'] - stamps['bus_reset']) * 1e3 / clock_hz:9.2f}ms (bus reset to mounted)")
+
+
+def hist_percentile(hist, pct):
+    # Bucket b holds values below 2**(b + 1) cycles, report that upper bound
+    total = sum(hist)
+    seen = 0
+    for b, n in enumerate(hist):
+        seen += n
+        if total and seen >= total * pct / 100:
+            return 2 ** (b + 1)
+    return 0
+
+
+def irq_report(stats, clock_hz):
+    def us(cycles):
+        return cycles * 1e6 / clock_hz
+
+    print("interrupts     count    latency p50/p99/max us    duration p50/p99/max us")
+    for name, s in stats.items():
+        lat = [us(min(hist_percentile(s["latency_hist"], pct), s["latency_max"])) for pct in (50, 99)] + [us(s["latency_max"])]
+        dur = [us(min(hist_percentile(s["duration_hist"], pct), s["duration_max"])) for pct in (50, 99)] + [us(s["duration_max"])]
+        print(f"{name:10s} : {s['count']:8d}    <{lat[0]:6.1f} <{lat[1]:6.1f} {lat[2]:7.1f}    "
+              f"<{dur[0]:6.1f} <{dur[1]:6.1f} {dur[2]:7.1f}")
+
+
+def ms(cycles, p):
+    return cycles * 1e3 / p["clock_hz"]
+
+
+def report(p, wall=None):
+    def per(total, count):
+        return total / count if count else 0
+
+    erase_ms, program_ms, verify_ms = ms(p["erase_cycles"], p), ms(p["program_cycles"], p), ms(p["verify_cycles"], p)
+    flash_ms = erase_ms + program_ms + verify_ms
+
+    print(f"usb rx     : {p['usb_rx_bytes']} bytes")
+    print(f"dnload     : {p['dnload_count']} blocks")
+    print(f"getstatus  : {p['getstatus_count']} ({per(p['getstatus_count'], p['dnload_count']):.1f} per block)")
+    print(f"erase      : {p['erase_count']:6d} x {per(erase_ms, p['erase_count']):7.2f}ms = {erase_ms:9.1f}ms")
+    print(f"program    : {p['program_count']:6d} x {per(program_ms, p['program_count']):7.3f}ms = {program_ms:9.1f}ms")
+    print(f"verify     : {verify_ms:28.1f}ms")
+    print(f"wip polls  : {p['poll_count']} ({per(p['poll_count'], p['erase_count'] + p['program_count']):.1f} per op)")
+
+    if wall is not None:
+        wall_ms = wall * 1e3
+        print(f"total      : {wall_ms:.1f}ms, flash busy {100 * flash_ms / wall_ms:.0f}%, "
+              f"usb/host/idle {wall_ms - flash_ms:.1f}ms")
+        if p["usb_rx_bytes"]:
+            print(f"throughput : {p['usb_rx_bytes'] / wall / 1e3:.1f} kB/s")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="ButterStick bootloader update counters")
+    parser.add_argument("--serial", default=None, help="select device by serial number")
+    parser.add_argument("--reset", action="store_true", help="reset the counters and exit")
+    parser.add_argument("--bus", action="store_true", help="include the wishbone bus counters (--bus-stats)")
+    parser.add_argument("--irq", action="store_true", help="include the interrupt latency histograms (--irq-stats)")
+    parser.add_argument("--boot", action="store_true", help="print the boot phase stamps and exit")
+    parser.add_argument("command", nargs=argparse.REMAINDER, help="flash command to profile, after --")
+    args = parser.parse_args()
+
+    dev = find_device(args.serial)
+    command = args.command[1:] if args.command[:1] == ["--"] else args.command
+
+    if args.boot:
+        boot_report(*boot_read(dev))
+        return
+
+    if args.reset:
+        perf_reset(dev)
+        if args.bus:
+            perf_reset(dev, VENDOR_REQUEST_BUS)
+        if args.irq:
+            perf_reset(dev, VENDOR_REQUEST_IRQ)
+        return
+
+    if not command:
+        p = perf_read(dev)
+        report(p)
+        if args.bus:
+            bus_report(*bus_read(dev))
+        if args.irq:
+            irq_report(irq_read(dev), p["clock_hz"])
+        return
+
+    perf_reset(dev)
+    if args.bus:
+        perf_reset(dev, VENDOR_REQUEST_BUS)
+    if args.irq:
+        perf_reset(dev, VENDOR_REQUEST_IRQ)
+    usb.util.dispose_resources(dev)
+
+    start = time.perf_counter()
+    result = subprocess.run(command)
+    wall = time.perf_counter() - start
+    if result.returncode != 0:
+        print(f"{command[0]} exited with {result.returncode}")
+
+    dev = find_device(args.serial)
+    p = perf_read(dev)
+    report(p, wall)
+    if args.bus:
+        bus_report(*bus_read(dev))
+    if args.irq:
+        irq_report(irq_read(dev), p["clock_hz"])
+
+
+if __name__ == "__main__":
+    main()
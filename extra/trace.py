@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+
+# This file is Copyright (c) Greg Davill <greg.davill@gmail.com>
+# License: BSD
+#
+# Drains the bootloader event trace (gateware built with --trace, vendor request 4) and
+# writes it as Chrome trace JSON, open it in Perfetto (ui.perfetto.dev) or chrome://tracing.
+# With a command after --, the trace is cleared first and drained while it runs:
+#
+#   python3 trace.py -o flash.json -- dfu-util -a 0 -D gateware.dfu
+#
+# Without a command it drains until Ctrl-C.
+#
+# Requires pyusb.
+
+import argparse
+import json
+import struct
+import subprocess
+import time
+
+import usb.core
+import usb.util
+
+VID, PID = 0x1209, 0x5af1
+
+VENDOR_REQUEST_TRACE = 4
+TRACE_INFO, TRACE_DRAIN, TRACE_CLEAR = 0, 1, 2
+DRAIN_SIZE = 4096
+
+# Matches the enum in firmware/include/trace.h
+(TRACE_SETUP, TRACE_XFER_OUT, TRACE_XFER_IN, TRACE_BUS_RESET, TRACE_SUSPEND, TRACE_RESUME,
+ TRACE_DNLOAD, TRACE_DNLOAD_DONE, TRACE_ERASE_START, TRACE_ERASE_END, TRACE_PROGRAM_START,
+ TRACE_PROGRAM_END, TRACE_VERIFY_START, TRACE_VERIFY_END, TRACE_IDLE, TRACE_WAKE) = range(16)
+
+# Timeline rows
+TID_USB, TID_DFU, TID_FLASH, TID_CPU = 1, 2, 3, 4
+THREAD_NAMES = {TID_USB: "usb", TID_DFU: "dfu", TID_FLASH: "flash", TID_CPU: "cpu"}
+
+REQUEST_NAMES = {
+    (0x80, 6): "GET_DESCRIPTOR", (0x00, 5): "SET_ADDRESS", (0x00, 9): "SET_CONFIGURATION",
+    (0x01, 11): "SET_INTERFACE", (0x21, 0): "DFU_DETACH", (0x21, 1): "DFU_DNLOAD",
+    (0xa1, 2): "DFU_UPLOAD", (0xa1, 3): "DFU_GETSTATUS", (0x21, 4): "DFU_CLRSTATUS",
+    (0xa1, 5): "DFU_GETSTATE", (0x21, 6): "DFU_ABORT",
+}
+
+SPANS = {
+    TRACE_ERASE_START: (TRACE_ERASE_END, TID_FLASH, "erase"),
+    TRACE_PROGRAM_START: (TRACE_PROGRAM_END, TID_FLASH, "program"),
+    TRACE_VERIFY_START: (TRACE_VERIFY_END, TID_FLASH, "verify"),
+    TRACE_DNLOAD: (TRACE_DNLOAD_DONE, TID_DFU, "dnload"),
+    TRACE_IDLE: (TRACE_WAKE, TID_CPU, "idle"),
+}
+SPAN_ENDS = {end: (tid, name) for _, (end, tid, name) in SPANS.items()}
+
+
+def find_device(serial=None):
+    for dev in usb.core.find(find_all=True, idVendor=VID, idProduct=PID):
+        if serial is None or usb.util.get_string(dev, dev.iSerialNumber) == serial:
+            return dev
+    raise SystemExit("No ButterStick bootloader found")
+
+
+def vendor_in(dev, value, length):
+    bm = usb.util.build_request_type(usb.util.CTRL_IN, usb.util.CTRL_TYPE_VENDOR, usb.util.CTRL_RECIPIENT_DEVICE)
+    return bytes(dev.ctrl_transfer(bm, VENDOR_REQUEST_TRACE, value, 0, length, timeout=1000))
+
+
+def trace_info(dev):
+    return dict(zip(["clock_hz", "capacity", "count", "dropped"], struct.unpack("<4I", vendor_in(dev, TRACE_INFO, 16))))
+
+
+def trace_clear(dev):
+    bm = usb.util.build_request_type(usb.util.CTRL_OUT, usb.util.CTRL_TYPE_VENDOR, usb.util.CTRL_RECIPIENT_DEVICE)
+    dev.ctrl_transfer(bm, VENDOR_REQUEST_TRACE, TRACE_CLEAR, 0, None, timeout=1000)
+
+
+def trace_drain(dev):
+    """Everything currently in the ring, as (stamp, id, arg) tuples"""
+    events = []
+    while True:
+        data = vendor_in(dev, TRACE_DRAIN, DRAIN_SIZE)
+        for stamp, word in struct.iter_unpack("<II", data):
+            events.append((stamp, word >> 24, word & 0xffffff))
+        # The firmware stops at the end of the ring, so a short read isn't necessarily the last
+        if not data:
+            return events
+
+
+class ChromeTrace:
+    def __init__(self, clock_hz):
+        self.clock_hz = clock_hz
+        self.last = None
+        self.cycles = 0
+        self.events = [{"name": "thread_name", "ph": "M", "pid": 1, "tid": tid, "args": {"name": name}}
+                       for tid, name in THREAD_NAMES.items()]
+
+    def timestamp(self, stamp):
+        # Stamps are the low 32 bits of the cycle counter, unwrap assuming events are < 2^32 cycles apart
+        if self.last is not None:
+            self.cycles += (stamp - self.last) & 0xffffffff
+        self.last = stamp
+        return self.cycles * 1e6 / self.clock_hz
+
+    def add(self, ph, tid, name, ts, args=None):
+        e = {"name": name, "ph": ph, "pid": 1, "tid": tid, "ts": ts}
+        if ph == "i":
+            e["s"] = "t"
+        if args:
+            e["args"] = args
+        self.events.append(e)
+
+    def convert(self, stamp, ev, arg):
+        ts = self.timestamp(stamp)
+
+        if ev in SPANS:
+            _, tid, name = SPANS[ev]
+            label = f"{name} {arg:#08x}" if tid == TID_FLASH else f"{name} {arg}"
+            self.add("B", tid, label, ts)
+        elif ev in SPAN_ENDS:
+            tid, _ = SPAN_ENDS[ev]
+            self.add("E", tid, "", ts, {"status": arg} if ev == TRACE_DNLOAD_DONE else None)
+        elif ev == TRACE_SETUP:
+            bm, req = arg >> 8, arg & 0xff
+            name = REQUEST_NAMES.get((bm, req), f"SETUP {bm:#04x}/{req}")
+            self.add("i", TID_USB, name, ts)
+        elif ev in (TRACE_XFER_OUT, TRACE_XFER_IN):
+            direction = "OUT" if ev == TRACE_XFER_OUT else "IN"
+            self.add("i", TID_USB, f"EP{arg >> 16} {direction}", ts, {"bytes": arg & 0xffff})
+        elif ev == TRACE_BUS_RESET:
+            self.add("i", TID_USB, "bus reset", ts)
+        elif ev == TRACE_SUSPEND:
+            self.add("i", TID_USB, "suspend", ts)
+        elif ev == TRACE_RESUME:
+            self.add("i", TID_USB, "resume", ts)
+        else:
+            self.add("i", TID_CPU, f"event {ev} ({arg:#x})", ts)
+
+    def write(self, filename):
+        with open(filename, "w") as f:
+            json.dump({"traceEvents": self.events, "displayTimeUnit": "ns"}, f)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="ButterStick bootloader event trace to Chrome trace JSON")
+    parser.add_argument("--serial", default=None, help="select device by serial number")
+    parser.add_argument("-o", "--output", default="trace.json", help="output file (default=trace.json)")
+    parser.add_argument("--interval", type=float, default=0.01, help="seconds between drains")
+    parser.add_argument("command", nargs=argparse.REMAINDER, help="command to trace, after --")
+    args = parser.parse_args()
+
+    command = args.command[1:] if args.command[:1] == ["--"] else args.command
+
+    dev = find_device(args.serial)
+    info = trace_info(dev)
+    trace_clear(dev)
+
+    chrome = ChromeTrace(info["clock_hz"])
+    count = 0
+
+    proc = subprocess.Popen(command) if command else None
+    try:
+        while proc is None or proc.poll() is None:
+            for e in trace_drain(dev):
+                chrome.convert(*e)
+                count += 1
+            time.sleep(args.interval)
+    except KeyboardInterrupt:
+        pass
+
+    # The command may have left the device reset, a final drain is best effort
+    try:
+        for e in trace_drain(dev):
+            chrome.convert(*e)
+            count += 1
+        dropped = trace_info(dev)["dropped"]
+    except usb.core.USBError:
+        dropped = None
+
+    chrome.write(args.output)
+    print(f"{count} events written to {args.output}" +
+          (f", {dropped} dropped (lower --interval)" if dropped else ""))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+
+# This file is Copyright (c) Greg Davill <greg.davill@gmail.com>
+# License: BSD
+#
+# Host side of the USB benchmark interface (gateware built with --usb-bench).
+# Measures raw bulk throughput and loopback latency, without DFU or flash involved.
+#
+# Requires pyusb.
+
+import argparse
+import time
+
+import usb.core
+import usb.util
+
+VID, PID = 0x1209, 0x5af1
+
+EP_SOURCE   = 0x81
+EP_SINK     = 0x01
+EP_LOOP_OUT = 0x02
+EP_LOOP_IN  = 0x82
+
+# Size of the board's loopback buffer, BENCH_BUFSIZE in firmware/usb_bench.c
+LOOP_MAX = 1024
+
+
+def find_device(serial=None):
+    for dev in usb.core.find(find_all=True, idVendor=VID, idProduct=PID):
+        if serial is None or usb.util.get_string(dev, dev.iSerialNumber) == serial:
+            return dev
+    raise SystemExit("No ButterStick bootloader found")
+
+
+def find_bench_interface(dev):
+    cfg = dev.get_active_configuration()
+    for intf in cfg:
+        if intf.bInterfaceClass == 0xff and intf.bNumEndpoints == 4:
+            return intf
+    raise SystemExit("Bootloader was not built with --usb-bench")
+
+
+def mb_per_s(nbytes, seconds):
+    return nbytes / seconds / 1e6
+
+
+def bench_source(dev, total, chunk):
+    # The board streams i & 0xff, a read picks up where the previous one left off
+    pattern = bytes(range(256)) * (chunk // 256 + 2)
+    received = 0
+    start = time.perf_counter()
+    while received < total:
+        data = dev.read(EP_SOURCE, chunk, timeout=1000)
+        offset = received & 0xff
+        if bytes(data) != pattern[offset:offset + len(data)]:
+            raise SystemExit(f"source data mismatch at byte {received}")
+        received += len(data)
+    elapsed = time.perf_counter() - start
+    print(f"source   : {received} bytes in {elapsed:.3f}s, {mb_per_s(received, elapsed):.2f} MB/s")
+
+
+def bench_sink(dev, total, chunk):
+    payload = bytes(i & 0xff for i in range(chunk))
+    sent = 0
+    start = time.perf_counter()
+    while sent < total:
+        sent += dev.write(EP_SINK, payload, timeout=1000)
+    elapsed = time.perf_counter() - start
+    print(f"sink     : {sent} bytes in {elapsed:.3f}s, {mb_per_s(sent, elapsed):.2f} MB/s")
+
+
+def percentile(sorted_values, pct):
+    idx = min(len(sorted_values) - 1, int(round(pct / 100 * (len(sorted_values) - 1))))
+    return sorted_values[idx]
+
+
+def bench_loopback(dev, iterations, size, max_packet):
+    if not 0 < size <= LOOP_MAX:
+        raise SystemExit(f"--loop-size must be 1..{LOOP_MAX}")
+
+    # The board echoes once its OUT transfer completes, on a short packet or a full
+    # buffer. A write ending on a full packet below that needs a ZLP to end it.
+    zlp = size < LOOP_MAX and size % max_packet == 0
+
+    payload = bytes((i * 7) & 0xff for i in range(size))
+    latencies = []
+    for _ in range(iterations):
+        start = time.perf_counter()
+        dev.write(EP_LOOP_OUT, payload, timeout=1000)
+        if zlp:
+            dev.write(EP_LOOP_OUT, b"", timeout=1000)
+        data = dev.read(EP_LOOP_IN, size, timeout=1000)
+        latencies.append(time.perf_counter() - start)
+        if bytes(data) != payload:
+            raise SystemExit("loopback data mismatch")
+
+    latencies.sort()
+    us = [l * 1e6 for l in latencies]
+    total = iterations * size * 2
+    print(f"loopback : {iterations} x {size} bytes, {mb_per_s(total, sum(latencies)):.2f} MB/s")
+    print("latency  : min {:.0f}us  p50 {:.0f}us  p90 {:.0f}us  p99 {:.0f}us  max {:.0f}us".format(
+        us[0], percentile(us, 50), percentile(us, 90), percentile(us, 99), us[-1]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="ButterStick bootloader raw USB benchmark")
+    parser.add_argument("--serial", default=None, help="select device by serial number")
+    parser.add_argument("--size", type=int, default=16*1024*1024, help="bytes to move in source/sink tests")
+    parser.add_argument("--chunk", type=int, default=64*1024, help="host transfer size for source/sink tests")
+    parser.add_argument("--loop-size", type=int, default=512,
+                        help=f"loopback transfer size, up to {LOOP_MAX}. A multiple of the max packet size "
+                             "below that is followed by a ZLP, so the board sees the end of the transfer")
+    parser.add_argument("--iterations", type=int, default=1000, help="loopback iterations")
+    parser.add_argument("tests", nargs="*", default=["source", "sink", "loopback"],
+                        choices=["source", "sink", "loopback"])
+    args = parser.parse_args()
+
+    dev = find_device(args.serial)
+    intf = find_bench_interface(dev)
+    usb.util.claim_interface(dev, intf)
+
+    print(f"device   : {usb.util.get_string(dev, dev.iSerialNumber)}, "
+          f"max packet {intf[0].wMaxPacketSize} bytes")
+
+    try:
+        if "source" in args.tests:
+            bench_source(dev, args.size, args.chunk)
+        if "sink" in args.tests:
+            bench_sink(dev, args.size, args.chunk)
+        if "loopback" in args.tests:
+            loop_out = next(ep for ep in intf if ep.bEndpointAddress == EP_LOOP_OUT)
+            bench_loopback(dev, args.iterations, args.loop_size, loop_out.wMaxPacketSize)
+    finally:
+        usb.util.release_interface(dev, intf)
+
+
+if __name__ == "__main__":
+    main()
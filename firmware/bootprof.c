@@ -0,0 +1,27 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+
+#include <stdint.h>
+
+#include <generated/csr.h>
+#include <generated/soc.h>
+
+#include "bootprof.h"
+
+static bootprof_snapshot_t snapshot;
+
+/* Read back from the CSRs, they hold the stamps from before the firmware was last reset too */
+const bootprof_snapshot_t *bootprof_snapshot(void)
+{
+	snapshot.clock_hz = CONFIG_CLOCK_FREQUENCY;
+	snapshot.stamp[BOOT_STAMP_START] = bootprof_stamp0_read();
+	snapshot.stamp[BOOT_STAMP_DECIDED] = bootprof_stamp1_read();
+	snapshot.stamp[BOOT_STAMP_VCCIO] = bootprof_stamp2_read();
+	snapshot.stamp[BOOT_STAMP_USB_RESET] = bootprof_stamp3_read();
+	snapshot.stamp[BOOT_STAMP_USB_READY] = bootprof_stamp4_read();
+	snapshot.stamp[BOOT_STAMP_BUS_RESET] = bootprof_stamp5_read();
+	snapshot.stamp[BOOT_STAMP_MOUNTED] = bootprof_stamp6_read();
+	snapshot.stamp[BOOT_STAMP_EXIT] = bootprof_stamp7_read();
+	return &snapshot;
+}
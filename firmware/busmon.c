@@ -0,0 +1,52 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+
+#include <stdint.h>
+
+#include <generated/csr.h>
+
+#include "busmon.h"
+
+#ifdef BUS_STATS
+
+static busmon_snapshot_t snapshot;
+
+#define BUSMON_ENABLE (1 << CSR_BUSMON_CONTROL_ENABLE_OFFSET)
+#define BUSMON_CLEAR (1 << CSR_BUSMON_CONTROL_CLEAR_OFFSET)
+
+void busmon_init(void)
+{
+	busmon_bank_write((CSR_SPIFLASH_CORE_BASE - CSR_BASE) / BUSMON_CSR_PAGING);
+	busmon_clear();
+}
+
+/* Counting pauses while the registers are read, so every tap covers the same window */
+const busmon_snapshot_t *busmon_snapshot(void)
+{
+	busmon_control_write(0);
+
+	snapshot.cycles = busmon_cycles_read();
+	snapshot.tap[BUSMON_CPU_IBUS].transactions = busmon_cpu_ibus_transactions_read();
+	snapshot.tap[BUSMON_CPU_IBUS].waits = busmon_cpu_ibus_waits_read();
+	snapshot.tap[BUSMON_CPU_DBUS].transactions = busmon_cpu_dbus_transactions_read();
+	snapshot.tap[BUSMON_CPU_DBUS].waits = busmon_cpu_dbus_waits_read();
+	snapshot.tap[BUSMON_CSR].transactions = busmon_csr_transactions_read();
+	snapshot.tap[BUSMON_CSR].waits = busmon_csr_waits_read();
+	snapshot.tap[BUSMON_CSR_BANK].transactions = busmon_csr_bank_transactions_read();
+	snapshot.tap[BUSMON_CSR_BANK].waits = busmon_csr_bank_waits_read();
+	snapshot.tap[BUSMON_USB].transactions = busmon_usb_transactions_read();
+	snapshot.tap[BUSMON_USB].waits = busmon_usb_waits_read();
+	snapshot.tap[BUSMON_SPIFLASH].transactions = busmon_spiflash_transactions_read();
+	snapshot.tap[BUSMON_SPIFLASH].waits = busmon_spiflash_waits_read();
+
+	busmon_control_write(BUSMON_ENABLE);
+	return &snapshot;
+}
+
+void busmon_clear(void)
+{
+	busmon_control_write(BUSMON_ENABLE | BUSMON_CLEAR);
+}
+
+#endif
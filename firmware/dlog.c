@@ -0,0 +1,95 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+
+#include <stdint.h>
+#include <stdarg.h>
+
+#include <generated/csr.h>
+#include <irq.h>
+
+#include "timing.h"
+#include "dlog.h"
+
+#ifdef DEFERRED_LOG
+
+static uint8_t ring[DLOG_BUFFER_SIZE];
+static uint32_t head;
+static uint32_t tail;
+static uint16_t seq;
+
+static void put_word(uint32_t w)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		ring[head++ & (DLOG_BUFFER_SIZE - 1)] = w;
+		w >>= 8;
+	}
+}
+
+/* Moves as much as the UART FIFO takes, called with interrupts off */
+static void uart_pump(void)
+{
+	while (tail != head && !uart_txfull_read())
+		uart_rxtx_write(ring[tail++ & (DLOG_BUFFER_SIZE - 1)]);
+}
+
+void dlog_write(uint32_t flags, uint32_t fmt, const uint32_t *args)
+{
+	unsigned int ie = irq_getie();
+	irq_setie(0);
+
+	uint32_t nargs = flags & DLOG_MAX_ARGS;
+	uint32_t size = 12 + 4 * nargs;
+
+	if (DLOG_BUFFER_SIZE - (head - tail) >= size)
+	{
+		put_word(DLOG_SYNC | (flags << 8) | ((uint32_t)seq << 16));
+		put_word(fmt);
+		put_word(timing_cycles32());
+		for (uint32_t i = 0; i < nargs; i++)
+			put_word(args[i]);
+
+		/* Prime the FIFO, the tx interrupt takes over once it has filled */
+		uart_pump();
+	}
+
+	seq++;
+	irq_setie(ie);
+}
+
+/* tinyusb's tu_printf (CFG_TUSB_DEBUG_PRINTF). Only counts conversions, the
+ * arguments go out unformatted.
+ */
+int dlog_printf(const char *fmt, ...)
+{
+	uint32_t args[DLOG_MAX_ARGS];
+	uint32_t nargs = 0;
+	va_list ap;
+
+	va_start(ap, fmt);
+	for (const char *p = fmt; *p; p++)
+	{
+		if (*p != '%')
+			continue;
+		p++;
+		if (*p == '\0')
+			break;
+		if (*p == '%')
+			continue;
+		if (nargs < DLOG_MAX_ARGS)
+			args[nargs++] = va_arg(ap, uint32_t);
+	}
+	va_end(ap);
+
+	dlog_write(nargs | DLOG_FMT_RODATA, (uint32_t)fmt, args);
+	return 0;
+}
+
+/* From app_isr, after the libbase handler has acknowledged the UART events */
+void dlog_uart_isr(void)
+{
+	uart_pump();
+}
+
+#endif
@@ -0,0 +1,312 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ *
+ * Image push over UDP, see eth_flash.h for the protocol. Requests are
+ * handled in the libliteeth receive callback, which only updates state. The
+ * reply and any flash work follow from the task once udp_service() returns,
+ * resolving the sender's MAC runs udp_service() again.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <generated/soc.h>
+
+#include "eth_flash.h"
+
+#ifdef ETH_FLASH
+
+#include <generated/csr.h>
+#include <irq.h>
+#include <crc.h>
+#include <libliteeth/udp.h>
+
+#include "flash.h"
+#include "flash_job.h"
+#include "sched.h"
+
+/* Millisecond time base, provided by main.c */
+uint32_t board_millis(void);
+
+enum
+{
+	ETH_IDLE,
+	ETH_RECEIVING,
+	ETH_DONE,
+	ETH_FAILED,
+};
+
+static uint8_t state = ETH_IDLE;
+static uint8_t error;
+static uint8_t partition;
+
+/* Block n waits in blocks[n % ETH_FLASH_WINDOW] until it is programmed */
+static uint8_t blocks[ETH_FLASH_WINDOW][ETH_FLASH_BLOCK_SIZE];
+static uint32_t block_length[ETH_FLASH_WINDOW];
+static uint32_t next;
+static uint32_t committed;
+
+static flash_job_t eth_job;
+static bool reboot;
+
+static eth_flash_reply_t reply;
+static uint32_t reply_ip;
+static uint16_t reply_port;
+static bool reply_pending;
+static bool resolving;
+
+/* board_millis() of the last request, a silent host gives up the flash */
+static uint32_t last_request_ms;
+
+static void eth_flash_run(sched_task_t *task);
+
+/* Woken by the ethmac interrupt and by the end of each flash job */
+sched_task_t eth_flash_task = SCHED_TASK(eth_flash_run, 2, SCHED_EVENT);
+
+static char hex(uint8_t nibble)
+{
+	return nibble < 10 ? '0' + nibble : 'a' + nibble - 10;
+}
+
+static uint32_t eth_ip(const uint8_t *uuid)
+{
+	uint32_t netmask = (uint32_t)ETH_NETMASK;
+	uint32_t host = ~netmask;
+
+	if (host == 0)
+		return (uint32_t)ETH_IP;
+
+	/* Network and broadcast addresses can't be used */
+	uint32_t id = crc32(uuid, 8) & host;
+	if (id == 0)
+		id = 1;
+	else if (id == host)
+		id = host - 1;
+
+	return ((uint32_t)ETH_IP & netmask) | id;
+}
+
+static uint8_t op_start(uint8_t alt)
+{
+	uint32_t address;
+
+	/* A block of an earlier download still in flight, or a DFU download */
+	if (flash_job_busy() || !download_claim(DOWNLOAD_ETH))
+		return ETH_FLASH_BUSY;
+
+	if (!partition_write_address(alt, 0, &address))
+	{
+		download_release(DOWNLOAD_ETH);
+		return ETH_FLASH_ERR_ADDRESS;
+	}
+
+	partition = alt;
+	next = 0;
+	committed = 0;
+	error = ETH_FLASH_OK;
+	state = ETH_RECEIVING;
+	return ETH_FLASH_OK;
+}
+
+static uint8_t op_data(uint32_t seq, const uint8_t *data, uint32_t length)
+{
+	if (state == ETH_FAILED)
+		return error;
+	if (state != ETH_RECEIVING)
+		return ETH_FLASH_ERR_STATE;
+
+	/* Duplicates and blocks past a gap are dropped, next in the reply says where to resume */
+	if (seq != next || length == 0 || length > ETH_FLASH_BLOCK_SIZE)
+		return ETH_FLASH_OK;
+
+	if (next - committed >= ETH_FLASH_WINDOW)
+		return ETH_FLASH_BUSY;
+
+	uint32_t slot = next % ETH_FLASH_WINDOW;
+	memcpy(blocks[slot], data, length);
+	block_length[slot] = length;
+	next++;
+	return ETH_FLASH_OK;
+}
+
+static uint8_t op_end(uint32_t count)
+{
+	if (state == ETH_FAILED)
+		return error;
+
+	/* A repeated END, its first reply was lost */
+	if (state == ETH_DONE && count == next)
+		return ETH_FLASH_OK;
+
+	if (state != ETH_RECEIVING || count != next)
+		return ETH_FLASH_ERR_STATE;
+
+	if (committed != next)
+		return ETH_FLASH_BUSY;
+
+	partition_manifest(partition);
+	download_release(DOWNLOAD_ETH);
+	state = ETH_DONE;
+	return ETH_FLASH_OK;
+}
+
+static void eth_flash_rx(unsigned int src_ip, unsigned short src_port, unsigned short dst_port, void *data, unsigned int length)
+{
+	const eth_flash_header_t *header = data;
+	uint8_t status = ETH_FLASH_OK;
+
+	/* One reply at a time, the host retries anything dropped here */
+	if (dst_port != ETH_FLASH_PORT || reply_pending || resolving)
+		return;
+	if (length < sizeof(*header) || header->magic != ETH_FLASH_MAGIC)
+		return;
+
+	last_request_ms = board_millis();
+
+	switch (header->op)
+	{
+	case ETH_FLASH_OP_INFO:
+		break;
+	case ETH_FLASH_OP_START:
+		status = op_start(header->alt);
+		break;
+	case ETH_FLASH_OP_DATA:
+		status = op_data(header->seq, (const uint8_t *)(header + 1), length - sizeof(*header));
+		break;
+	case ETH_FLASH_OP_END:
+		status = op_end(header->seq);
+		break;
+	case ETH_FLASH_OP_REBOOT:
+		reboot = true;
+		break;
+	default:
+		return;
+	}
+
+	memcpy(&reply.header, header, sizeof(*header));
+	reply.status = status;
+	reply.next = next;
+	reply.committed = committed;
+
+	reply_ip = src_ip;
+	reply_port = src_port;
+	reply_pending = true;
+}
+
+static void reply_send(void)
+{
+	reply_pending = false;
+
+	resolving = true;
+	int resolved = udp_arp_resolve(reply_ip);
+	resolving = false;
+	if (!resolved)
+		return;
+
+	memcpy(udp_get_tx_buffer(), &reply, sizeof(reply));
+	udp_send(ETH_FLASH_PORT, reply_port, sizeof(reply));
+}
+
+static void eth_fail(uint8_t status)
+{
+	state = ETH_FAILED;
+	error = status;
+	download_release(DOWNLOAD_ETH);
+}
+
+static void eth_job_done(int status)
+{
+	if (status != FLASH_JOB_OK)
+	{
+		eth_fail(ETH_FLASH_ERR_VERIFY);
+	}
+	else
+	{
+		committed++;
+	}
+
+	sched_wake(&eth_flash_task);
+}
+
+/* Oldest block held goes to the flash, one job at a time */
+static void program_next(void)
+{
+	uint32_t address;
+	uint32_t slot = committed % ETH_FLASH_WINDOW;
+
+	if (!partition_write_address(partition, committed * ETH_FLASH_BLOCK_SIZE, &address))
+	{
+		eth_fail(ETH_FLASH_ERR_ADDRESS);
+		return;
+	}
+
+	eth_job.address = address;
+	eth_job.data = blocks[slot];
+	eth_job.length = block_length[slot];
+	eth_job.done = eth_job_done;
+	flash_job_start(&eth_job);
+}
+
+static void eth_flash_run(sched_task_t *task)
+{
+
+	/* udp_service() takes one frame per call, the interrupt brings us back for the rest */
+	udp_service();
+	if (reply_pending)
+		reply_send();
+
+	if (state == ETH_RECEIVING && committed < next && !flash_job_busy())
+		program_next();
+
+	/* Come back to check on a download that has gone quiet */
+	if (state == ETH_RECEIVING && !flash_job_busy())
+	{
+		uint32_t idle = board_millis() - last_request_ms;
+		if (idle >= ETH_FLASH_TIMEOUT_MS)
+			eth_fail(ETH_FLASH_ERR_STATE);
+		else
+			sched_delay(task, ETH_FLASH_TIMEOUT_MS - idle);
+	}
+
+	if (reboot && !flash_job_busy())
+		sched_stop();
+
+	ethmac_sram_writer_ev_enable_write(1);
+}
+
+void eth_flash_init(void)
+{
+	uint8_t uuid[8];
+	spiflash_read_uuid(uuid);
+
+	/* Dashes every 2 bytes, as in the USB serial number */
+	char *s = reply.serial;
+	for (int i = 0; i < 8; i++)
+	{
+		if (i && !(i & 1))
+			*s++ = '-';
+
+		*s++ = hex(uuid[i] >> 4);
+		*s++ = hex(uuid[i] & 0xF);
+	}
+
+	/* Locally administered unicast MAC, the rest from the UUID */
+	uint8_t mac[6] = {0x02, uuid[3], uuid[4], uuid[5], uuid[6], uuid[7]};
+
+	eth_init();
+	udp_start(mac, eth_ip(uuid));
+	udp_set_callback(eth_flash_rx);
+
+	ethmac_sram_writer_ev_enable_write(1);
+	irq_setmask(irq_getmask() | (1 << ETHMAC_INTERRUPT));
+}
+
+/* The frame stays pending until udp_service(), hold the interrupt off until the task has run */
+void eth_flash_isr(void)
+{
+	ethmac_sram_writer_ev_enable_write(0);
+	sched_wake(&eth_flash_task);
+}
+
+#endif
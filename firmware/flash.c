@@ -11,8 +11,35 @@
 #include <stdlib.h>
 #include <time.h>
 #include <generated/csr.h>
+#include <generated/soc.h>
+#include <irq.h>
 
 #include "flash.h"
+#include "sleep.h"
+
+#ifdef FIRMWARE_XIP
+/* Most of the firmware executes from this flash (see xip.h). An instruction fetch
+   stalls while the master holds CS, so interrupts are off for exactly that long.
+   A fetch reads garbage while a program or erase is running, so the commands that
+   set WIP poll it before returning to a caller that may be in the xip region.
+   Everything the interrupt handler reaches is in rom, interrupts stay on meanwhile. */
+static unsigned int xip_lock(void)
+{
+	unsigned int ie = irq_getie();
+	irq_setie(0);
+	return ie;
+}
+
+static void xip_unlock(unsigned int ie, bool busy)
+{
+	irq_setie(ie);
+	if(busy)
+		while(spiflash_read_status_register() & 1){}
+}
+#else
+static inline unsigned int xip_lock(void){ return 0; }
+static inline void xip_unlock(unsigned int ie, bool busy){ (void)ie; (void)busy; }
+#endif
 
 
 static uint32_t transfer_byte(uint8_t b)
@@ -32,6 +59,8 @@ static uint32_t transfer_byte(uint8_t b)
 
 static void transfer_cmd(uint8_t *bs, uint8_t *resp, int len)
 {
+	unsigned int ie = xip_lock();
+
 	spiflash_core_master_phyconfig_len_write(8);
 	spiflash_core_master_phyconfig_width_write(1);
 	spiflash_core_master_phyconfig_mask_write(1);
@@ -51,6 +80,8 @@ static void transfer_cmd(uint8_t *bs, uint8_t *resp, int len)
 	}
 
 	spiflash_core_master_cs_write(0);
+
+	xip_unlock(ie, false);
 }
 
 uint32_t spiflash_read_status_register(void)
@@ -72,8 +103,10 @@ void spiflash_write_enable(void)
     transfer_cmd((uint8_t[]){0x06}, 0, 1);
 }
 
-void spiflash_page_program(uint32_t addr, uint8_t *data, int len)
+void spiflash_page_program(uint32_t addr, const uint8_t *data, int len)
 {
+	unsigned int ie = xip_lock();
+
 	spiflash_core_master_phyconfig_len_write(8);
 	spiflash_core_master_phyconfig_width_write(1);
 	spiflash_core_master_phyconfig_mask_write(1);
@@ -98,10 +131,14 @@ void spiflash_page_program(uint32_t addr, uint8_t *data, int len)
 	}
 
 	spiflash_core_master_cs_write(0);
+
+	xip_unlock(ie, true);
 }
 
 void spiflash_sector_erase(uint32_t addr)
 {
+	unsigned int ie = xip_lock();
+
 	spiflash_core_master_phyconfig_len_write(8);
 	spiflash_core_master_phyconfig_width_write(1);
 	spiflash_core_master_phyconfig_mask_write(1);
@@ -113,6 +150,8 @@ void spiflash_sector_erase(uint32_t addr)
 	transfer_byte(addr >> 0);
 
 	spiflash_core_master_cs_write(0);
+
+	xip_unlock(ie, true);
 }
 
 #define min(x, y) (((x) < (y)) ? (x) : (y))
@@ -157,6 +196,7 @@ int spiflash_write_stream(uint32_t addr, uint8_t *stream, int len)
 	bit ID is shifted out on the falling edge of CLK
 */
 void spiflash_read_uuid(uint8_t* uuid) {
+	unsigned int ie = xip_lock();
 
 	spiflash_core_master_phyconfig_len_write(8);
 	spiflash_core_master_phyconfig_width_write(1);
@@ -173,6 +213,8 @@ void spiflash_read_uuid(uint8_t* uuid) {
 		uuid[i] = transfer_byte(0xFF);
 
 	spiflash_core_master_cs_write(0);
+
+	xip_unlock(ie, false);
 }
 
 bool spiflash_protection_read(void){
@@ -197,6 +239,8 @@ void spiflash_protection_write(bool lock){
 	if(((status1 = spiflash_read_status_register()) & 0b11111100) != (lock ? 0b00110000 : 0b00000000)){
 		spiflash_write_enable();
 		
+		unsigned int ie = xip_lock();
+
 		spiflash_core_master_phyconfig_len_write(8);
 		spiflash_core_master_phyconfig_width_write(1);
 		spiflash_core_master_phyconfig_mask_write(1);
@@ -210,14 +254,25 @@ void spiflash_protection_write(bool lock){
 		}
 
 		spiflash_core_master_cs_write(0);
+
+		xip_unlock(ie, true);
+
+		while(spiflash_read_status_register() & 1){}
 	}
 
+	spiflash_quad_enable();
+}
 
+/* Sets the non-volatile QE bit (status register 2) if it isn't already, and waits for the write
+   to finish. The FPGA configures in quad mode, so this must hold before reset_out_write(). */
+void spiflash_quad_enable(void){
 	uint8_t status2 = 0;
 	if(((status2 = spiflash_read_status2_register()) & 0x02) == 0){
 	
 		spiflash_write_enable();
 		
+		unsigned int ie = xip_lock();
+
 		spiflash_core_master_phyconfig_len_write(8);
 		spiflash_core_master_phyconfig_width_write(1);
 		spiflash_core_master_phyconfig_mask_write(1);
@@ -227,10 +282,17 @@ void spiflash_protection_write(bool lock){
 		transfer_byte(0b00000010 | status2);
 
 		spiflash_core_master_cs_write(0);
+
+		xip_unlock(ie, true);
 	}
+
+	while(spiflash_read_status_register() & 1){}
 }
 
-void spiflash_read_security_register(uint8_t security_page, uint8_t* buff){
+/* Reads the first len bytes of a security page, no need to clock out all 256 to check a header */
+void spiflash_read_security_register_len(uint8_t security_page, uint8_t* buff, int len){
+	unsigned int ie = xip_lock();
+
 	spiflash_core_master_phyconfig_len_write(8);
 	spiflash_core_master_phyconfig_width_write(1);
 	spiflash_core_master_phyconfig_mask_write(1);
@@ -243,14 +305,22 @@ void spiflash_read_security_register(uint8_t security_page, uint8_t* buff){
 
 	transfer_byte(0x00);
 
-	for(int byte_index = 0; byte_index < 256; byte_index++){
+	for(int byte_index = 0; byte_index < len; byte_index++){
 		*buff++ = transfer_byte(0);
 	}
 
 	spiflash_core_master_cs_write(0);	
+
+	xip_unlock(ie, false);
+}
+
+void spiflash_read_security_register(uint8_t security_page, uint8_t* buff){
+	spiflash_read_security_register_len(security_page, buff, 256);
 }
 
 void spiflash_write_security_register(uint8_t security_page, uint8_t* buff){
+	unsigned int ie = xip_lock();
+
 	spiflash_core_master_phyconfig_len_write(8);
 	spiflash_core_master_phyconfig_width_write(1);
 	spiflash_core_master_phyconfig_mask_write(1);
@@ -267,10 +337,14 @@ void spiflash_write_security_register(uint8_t security_page, uint8_t* buff){
 
 	spiflash_core_master_cs_write(0);	
 
+	xip_unlock(ie, true);
+
 	while(spiflash_read_status_register() & 1){}
 }
 
 void spiflash_erase_security_register(uint8_t security_page){
+	unsigned int ie = xip_lock();
+
 	spiflash_core_master_phyconfig_len_write(8);
 	spiflash_core_master_phyconfig_width_write(1);
 	spiflash_core_master_phyconfig_mask_write(1);
@@ -283,6 +357,20 @@ void spiflash_erase_security_register(uint8_t security_page){
 
 	spiflash_core_master_cs_write(0);	
 
+	xip_unlock(ie, true);
+
 	while(spiflash_read_status_register() & 1){}
 }
 
+
+/* Deep power-down (B9h), the flash ignores everything but Release (ABh) until woken.
+   Nothing may touch the memory mapped window or the master while it sleeps. */
+void spiflash_power_down(void){
+	transfer_cmd((uint8_t[]){0xB9}, 0, 1);
+}
+
+/* Release power-down (ABh), the device is ready again after tRES1 (3us) */
+void spiflash_release_power_down(void){
+	transfer_cmd((uint8_t[]){0xAB}, 0, 1);
+	udelay(3);
+}
@@ -0,0 +1,147 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include <generated/mem.h>
+#include <system.h>
+
+#include "flash.h"
+#include "flash_job.h"
+#include "timing.h"
+#include "perf.h"
+#include "trace.h"
+
+enum
+{
+	JOB_IDLE,
+	JOB_ERASE,
+	JOB_ERASE_WAIT,
+	JOB_PROGRAM,
+	JOB_PROGRAM_WAIT,
+	JOB_VERIFY,
+};
+
+/* Erase of a 64K block takes ~150ms, no point polling WIP on every pass */
+#define ERASE_POLL_MS 1
+
+static flash_job_t *active_job;
+
+/* Start of the erase or program in flight, for the perf counters */
+static uint64_t op_start;
+
+static void flash_job_run(sched_task_t *task);
+
+sched_task_t flash_job_task = SCHED_TASK(flash_job_run, 1, SCHED_EVENT);
+
+void flash_job_start(flash_job_t *job)
+{
+	job->offset = 0;
+
+	/* First block in 64K erase block */
+	if ((job->address & (FLASH_64K_BLOCK_ERASE_SIZE - 1)) == 0)
+		job->state = JOB_ERASE;
+	else
+		job->state = JOB_PROGRAM;
+
+	active_job = job;
+	sched_wake(&flash_job_task);
+}
+
+bool flash_job_busy(void)
+{
+	return active_job != NULL;
+}
+
+static void flash_job_finish(flash_job_t *job, int status)
+{
+	job->state = JOB_IDLE;
+	active_job = NULL;
+
+	if (job->done)
+		job->done(status);
+}
+
+/* Executes at most one flash operation per call */
+static void flash_job_run(sched_task_t *task)
+{
+	flash_job_t *job = active_job;
+
+	if (job == NULL)
+		return;
+
+	switch (job->state)
+	{
+	case JOB_ERASE:
+		op_start = timing_cycles();
+		TRACE(TRACE_ERASE_START, job->address);
+		spiflash_write_enable();
+		spiflash_sector_erase(job->address);
+		perf.erase_count++;
+		job->state = JOB_ERASE_WAIT;
+		sched_delay(task, ERASE_POLL_MS);
+		break;
+
+	case JOB_ERASE_WAIT:
+		perf.poll_count++;
+		if (spiflash_read_status_register() & 1)
+		{
+			sched_delay(task, ERASE_POLL_MS);
+			break;
+		}
+		perf.erase_cycles += timing_cycles() - op_start;
+		TRACE(TRACE_ERASE_END, job->address);
+		job->state = JOB_PROGRAM;
+		break;
+
+	case JOB_PROGRAM:
+	{
+		uint32_t len = job->length - job->offset;
+		if (len > 256)
+			len = 256;
+
+		op_start = timing_cycles();
+		TRACE(TRACE_PROGRAM_START, job->address + job->offset);
+		spiflash_write_enable();
+		spiflash_page_program(job->address + job->offset, job->data + job->offset, len);
+		perf.program_count++;
+		job->offset += len;
+		job->state = JOB_PROGRAM_WAIT;
+	}
+	break;
+
+	case JOB_PROGRAM_WAIT:
+		perf.poll_count++;
+		if (spiflash_read_status_register() & 1)
+			break;
+
+		perf.program_cycles += timing_cycles() - op_start;
+		TRACE(TRACE_PROGRAM_END, job->address + job->offset);
+		job->state = (job->offset < job->length) ? JOB_PROGRAM : JOB_VERIFY;
+		break;
+
+	case JOB_VERIFY:
+	{
+		/* Read back through the memory mapped window, drop any stale cache lines first */
+		uint64_t start = timing_cycles();
+		TRACE(TRACE_VERIFY_START, job->address);
+		flush_cpu_dcache();
+		int match = memcmp((const void *)(SPIFLASH_BASE + job->address), job->data, job->length);
+		perf.verify_cycles += timing_cycles() - start;
+		TRACE(TRACE_VERIFY_END, job->address);
+		flash_job_finish(job, match == 0 ? FLASH_JOB_OK : FLASH_JOB_ERR_VERIFY);
+	}
+	break;
+
+	default:
+		break;
+	}
+
+	/* Keep stepping on the next pass unless a poll delay was asked for */
+	if (active_job != NULL && task->parked)
+		sched_wake(task);
+}
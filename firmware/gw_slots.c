@@ -0,0 +1,143 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "flash.h"
+#include "gw_slots.h"
+
+#ifdef GATEWARE_AB_SLOTS
+
+#define GW_SLOT_MAGIC 0x534c4f54 /* "SLOT" */
+#define GW_SLOT_SECURITY_PAGE 2
+
+static gw_slot_record_t record;
+
+static uint32_t slot_address(uint8_t slot)
+{
+	return slot == GW_SLOT_B ? GW_SLOT_B_ADDRESS : GW_SLOT_A_ADDRESS;
+}
+
+static uint8_t inactive_slot(void)
+{
+	return record.active == GW_SLOT_A ? GW_SLOT_B : GW_SLOT_A;
+}
+
+static void record_write(void)
+{
+	uint8_t page[256];
+
+	memset(page, 0xFF, sizeof(page));
+	memcpy(page, &record, sizeof(record));
+
+	spiflash_write_enable();
+	spiflash_erase_security_register(GW_SLOT_SECURITY_PAGE);
+	spiflash_write_enable();
+	spiflash_write_security_register(GW_SLOT_SECURITY_PAGE, page);
+}
+
+/* Preamble followed by the ECP5 JUMP command, as written by ecppack --bootaddr */
+static void stub_write(uint8_t slot)
+{
+	uint32_t addr = slot_address(slot);
+	uint8_t stub[] = {
+		0xFF, 0xFF, 0xFF, 0xFF,
+		0xFF, 0xFF, 0xBD, 0xB3,
+		0xFF, 0xFF, 0xFF, 0xFF,
+		0x7E, 0x00, 0x00, 0x00,
+		0x03, addr >> 16, addr >> 8, addr >> 0,
+	};
+
+	spiflash_write_enable();
+	spiflash_sector_erase(GW_SLOT_STUB_ADDRESS);
+	while (spiflash_read_status_register() & 1)
+	{
+	}
+
+	spiflash_write_enable();
+	spiflash_page_program(GW_SLOT_STUB_ADDRESS, stub, sizeof(stub));
+	while (spiflash_read_status_register() & 1)
+	{
+	}
+}
+
+/* A missing record means a single image still sits at 0x200000. There is no
+ * known good slot until the first download into slot A is confirmed.
+ */
+void gw_slots_init(void)
+{
+	spiflash_read_security_register_len(GW_SLOT_SECURITY_PAGE, (uint8_t *)&record, sizeof(record));
+
+	if (record.magic != GW_SLOT_MAGIC)
+	{
+		record.magic = GW_SLOT_MAGIC;
+		record.active = GW_SLOT_NONE;
+		record.trial = GW_SLOT_NONE;
+		record.boots = 0;
+		record.reserved = 0xFF;
+	}
+}
+
+const gw_slot_record_t *gw_slots_record(void)
+{
+	return &record;
+}
+
+/* Downloads always go to the slot that is not known good */
+uint32_t gw_slots_download_address(void)
+{
+	return slot_address(inactive_slot());
+}
+
+/* Called once a complete image has been written to the inactive slot */
+void gw_slots_set_trial(void)
+{
+	record.trial = inactive_slot();
+	record.boots = 0;
+	record_write();
+	stub_write(record.trial);
+}
+
+bool gw_slots_confirm(void)
+{
+	if (record.trial == GW_SLOT_NONE)
+		return false;
+
+	record.active = record.trial;
+	record.trial = GW_SLOT_NONE;
+	record.boots = 0;
+	record_write();
+	return true;
+}
+
+/* Without a known good slot there is nothing to go back to, the trial image stays */
+void gw_slots_rollback(void)
+{
+	record.trial = GW_SLOT_NONE;
+	record.boots = 0;
+	record_write();
+
+	if (record.active != GW_SLOT_NONE)
+		stub_write(record.active);
+}
+
+/* Called on the way out to the user image, counts trial boots and falls back */
+void gw_slots_boot(void)
+{
+	if (record.trial == GW_SLOT_NONE)
+		return;
+
+	if (record.boots >= GW_SLOT_MAX_TRIAL_BOOTS)
+	{
+		gw_slots_rollback();
+		return;
+	}
+
+	record.boots++;
+	record_write();
+}
+
+#endif
@@ -0,0 +1,384 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+
+/* Flash driver bench: flash.c against the W25Q128JV model on a virtual clock.
+ *
+ * Every CSR access and SPI clock moves the clock on by its estimated cost, and
+ * program/erase hold BUSY for their datasheet time, so each figure is what the
+ * driver spends on the bus plus what it waits on WIP. CPU work between
+ * register accesses isn't counted. Each operation is checked against the
+ * model's array and registers, and any command the part dropped is a failure.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <generated/csr.h>
+
+#include "flash.h"
+#include "timing.h"
+#include "host.h"
+#include "w25q128.h"
+
+/* Away from the bootloader and gateware, nothing else uses this part of the image */
+#define BENCH_BASE 0x00800000
+
+/* Security page the bench scribbles on, page 3 holds the bootloader magic */
+#define BENCH_SECURITY_PAGE 1
+
+typedef struct
+{
+	const char *name;
+	void (*setup)(uint32_t i);
+	void (*run)(uint32_t i);
+	bool (*check)(uint32_t i);
+} bench_t;
+
+static uint64_t now;
+
+static uint8_t pattern[W25Q_PAGE_SIZE];
+static uint8_t buffer[W25Q_PAGE_SIZE];
+
+//--------------------------------------------------------------------+
+// Virtual clock
+//--------------------------------------------------------------------+
+
+void host_elapse(uint32_t c)
+{
+	now += c;
+}
+
+uint64_t host_cycles(void)
+{
+	return now;
+}
+
+/* Reading the counter is a CSR access too, which keeps udelay() moving */
+uint32_t cycles_low_read(void)
+{
+	host_elapse(HOST_CSR_CYCLES);
+	return (uint32_t)now;
+}
+
+uint32_t cycles_high_read(void)
+{
+	host_elapse(HOST_CSR_CYCLES);
+	return (uint32_t)(now >> 32);
+}
+
+//--------------------------------------------------------------------+
+// Operations, written the way flash_job.c and gw_slots.c use the driver
+//--------------------------------------------------------------------+
+
+static void wait_wip(void)
+{
+	while (spiflash_read_status_register() & 1)
+	{
+	}
+}
+
+static void status_run(uint32_t i)
+{
+	(void)i;
+	spiflash_read_status_register();
+}
+
+static void uuid_run(uint32_t i)
+{
+	(void)i;
+	spiflash_read_uuid(buffer);
+}
+
+static bool uuid_check(uint32_t i)
+{
+	(void)i;
+	return memcmp(buffer, w25q_state()->uid, sizeof(w25q_state()->uid)) == 0;
+}
+
+static void security_read_run(uint32_t i)
+{
+	(void)i;
+	spiflash_read_security_register(BENCH_SECURITY_PAGE, buffer);
+}
+
+static bool security_read_check(uint32_t i)
+{
+	(void)i;
+	return memcmp(buffer, w25q_state()->security[BENCH_SECURITY_PAGE - 1], W25Q_PAGE_SIZE) == 0;
+}
+
+static void security_header_run(uint32_t i)
+{
+	(void)i;
+	spiflash_read_security_register_len(BENCH_SECURITY_PAGE, buffer, 16);
+}
+
+static bool security_header_check(uint32_t i)
+{
+	(void)i;
+	return memcmp(buffer, w25q_state()->security[BENCH_SECURITY_PAGE - 1], 16) == 0;
+}
+
+static void security_erase_run(uint32_t i)
+{
+	(void)i;
+	spiflash_write_enable();
+	spiflash_erase_security_register(BENCH_SECURITY_PAGE);
+}
+
+static bool security_erased(uint32_t i)
+{
+	(void)i;
+	for (uint32_t n = 0; n < W25Q_PAGE_SIZE; n++)
+	{
+		if (w25q_state()->security[BENCH_SECURITY_PAGE - 1][n] != 0xFF)
+			return false;
+	}
+	return true;
+}
+
+static void security_write_run(uint32_t i)
+{
+	(void)i;
+	spiflash_write_enable();
+	spiflash_write_security_register(BENCH_SECURITY_PAGE, pattern);
+}
+
+static bool security_write_check(uint32_t i)
+{
+	(void)i;
+	return memcmp(pattern, w25q_state()->security[BENCH_SECURITY_PAGE - 1], W25Q_PAGE_SIZE) == 0;
+}
+
+static uint32_t block_address(uint32_t i)
+{
+	return BENCH_BASE + i * FLASH_64K_BLOCK_ERASE_SIZE;
+}
+
+static void erase_run(uint32_t i)
+{
+	spiflash_write_enable();
+	spiflash_sector_erase(block_address(i));
+	wait_wip();
+}
+
+static bool erase_check(uint32_t i)
+{
+	for (uint32_t n = 0; n < FLASH_64K_BLOCK_ERASE_SIZE; n++)
+	{
+		if (w25q_array[block_address(i) + n] != 0xFF)
+			return false;
+	}
+	return true;
+}
+
+/* Pages go into the blocks the erase bench just cleared */
+static void program_run(uint32_t i)
+{
+	spiflash_write_enable();
+	spiflash_page_program(BENCH_BASE + i * W25Q_PAGE_SIZE, pattern, W25Q_PAGE_SIZE);
+	wait_wip();
+}
+
+static bool program_check(uint32_t i)
+{
+	return memcmp(w25q_array + BENCH_BASE + i * W25Q_PAGE_SIZE, pattern, W25Q_PAGE_SIZE) == 0;
+}
+
+/* A full 64K block as a DFU download writes it: one erase, then every page */
+static void update_run(uint32_t i)
+{
+	erase_run(i);
+
+	for (uint32_t offset = 0; offset < FLASH_64K_BLOCK_ERASE_SIZE; offset += W25Q_PAGE_SIZE)
+	{
+		spiflash_write_enable();
+		spiflash_page_program(block_address(i) + offset, pattern, W25Q_PAGE_SIZE);
+		wait_wip();
+	}
+}
+
+static bool update_check(uint32_t i)
+{
+	for (uint32_t offset = 0; offset < FLASH_64K_BLOCK_ERASE_SIZE; offset += W25Q_PAGE_SIZE)
+	{
+		if (memcmp(w25q_array + block_address(i) + offset, pattern, W25Q_PAGE_SIZE) != 0)
+			return false;
+	}
+	return true;
+}
+
+static void protection_run(uint32_t i)
+{
+	spiflash_protection_write(i & 1);
+}
+
+static bool protection_check(uint32_t i)
+{
+	return spiflash_protection_read() == (i & 1);
+}
+
+static void power_run(uint32_t i)
+{
+	(void)i;
+	spiflash_power_down();
+	spiflash_release_power_down();
+}
+
+/* Still asleep, or woken too early, and the part would ignore this */
+static bool power_check(uint32_t i)
+{
+	(void)i;
+	return (spiflash_read_status2_register() & 0x02) != 0;
+}
+
+static const bench_t benches[] = {
+	{"status read", NULL, status_run, NULL},
+	{"uuid read", NULL, uuid_run, uuid_check},
+	{"security read 256", NULL, security_read_run, security_read_check},
+	{"security read 16", NULL, security_header_run, security_header_check},
+	{"security erase", NULL, security_erase_run, security_erased},
+	{"security program", security_erase_run, security_write_run, security_write_check},
+	{"64K erase", NULL, erase_run, erase_check},
+	{"page program", NULL, program_run, program_check},
+	{"64K update", NULL, update_run, update_check},
+	{"protection toggle", NULL, protection_run, protection_check},
+	{"power down/up", NULL, power_run, power_check},
+};
+
+//--------------------------------------------------------------------+
+// Harness
+//--------------------------------------------------------------------+
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s [-n iterations] [-t none|typ|max] [image]\n"
+			"  -n  runs of each operation (default 16)\n"
+			"  -t  program and erase times from the datasheet (default typ)\n"
+			"  image is a scratch file, a temporary one is used if not given\n",
+			name);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t iterations = 16;
+	char path[] = "/tmp/flash-bench-XXXXXX";
+	const char *image = NULL;
+	int failed = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:t:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			if (strcmp(optarg, "none") == 0)
+				w25q_set_timing(W25Q_TIMING_NONE);
+			else if (strcmp(optarg, "typ") == 0)
+				w25q_set_timing(W25Q_TIMING_TYPICAL);
+			else if (strcmp(optarg, "max") == 0)
+				w25q_set_timing(W25Q_TIMING_MAX);
+			else
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind < argc - 1 || iterations == 0 || iterations > 64)
+		usage(argv[0]);
+
+	if (optind == argc - 1)
+	{
+		image = argv[optind];
+	}
+	else
+	{
+		int fd = mkstemp(path);
+		if (fd < 0)
+		{
+			perror(path);
+			return 1;
+		}
+		close(fd);
+		image = path;
+	}
+
+	if (!w25q_open(image))
+		return 1;
+
+	for (uint32_t n = 0; n < W25Q_PAGE_SIZE; n++)
+		pattern[n] = n * 13 + 7;
+
+	printf("%-20s %12s %10s %8s %10s %8s %8s\n", "operation", "cycles", "us", "csr", "spi clks", "polls", "ignored");
+
+	for (size_t b = 0; b < sizeof(benches) / sizeof(benches[0]); b++)
+	{
+		const bench_t *bench = &benches[b];
+		uint64_t cycles = 0, csr = 0, clocks = 0;
+		uint32_t polls = 0;
+		uint32_t ignored = w25q_stats.ignored;
+		bool ok = true;
+
+		for (uint32_t i = 0; i < iterations; i++)
+		{
+			/* Setup is left out of the figures */
+			if (bench->setup)
+				bench->setup(i);
+
+			uint64_t begin = now;
+			w25q_stats_t before = w25q_stats;
+
+			bench->run(i);
+
+			cycles += now - begin;
+			csr += w25q_stats.csr_accesses - before.csr_accesses;
+			clocks += w25q_stats.spi_clocks - before.spi_clocks;
+			polls += w25q_stats.busy_polls - before.busy_polls;
+
+			if (bench->check && !bench->check(i))
+				ok = false;
+		}
+
+		/* The part dropping a command is a driver bug, during setup too */
+		ignored = w25q_stats.ignored - ignored;
+		if (ignored)
+			ok = false;
+
+		printf("%-20s %12llu %10.1f %8llu %10llu %8u %8u%s\n",
+			   bench->name,
+			   (unsigned long long)(cycles / iterations),
+			   (double)cycles / iterations / TIMING_CYCLES_PER_US,
+			   (unsigned long long)(csr / iterations),
+			   (unsigned long long)(clocks / iterations),
+			   polls / iterations,
+			   ignored,
+			   ok ? "" : "  FAIL");
+
+		if (!ok)
+			failed++;
+	}
+
+	w25q_close();
+
+	if (image == path)
+	{
+		char nv_path[sizeof(path) + 3];
+		snprintf(nv_path, sizeof(nv_path), "%s.nv", path);
+		unlink(path);
+		unlink(nv_path);
+	}
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,342 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <generated/csr.h>
+#include <irq.h>
+
+#include "host.h"
+
+void app_isr(void);
+
+#define CYCLES_PER_US (CONFIG_CLOCK_FREQUENCY / 1000000)
+
+static pthread_mutex_t cpu_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cpu_cond;
+
+/* Set while this thread owns the CPU: main with interrupts off, or the ISR */
+static __thread bool cpu_held;
+static __thread bool in_isr;
+
+static unsigned int ie;
+static unsigned int mask;
+static unsigned int pending;
+
+static struct timespec start;
+
+/* timer0, only the one-shot mode main.c uses */
+static struct
+{
+	uint32_t load;
+	bool enabled;
+	bool counting; /* enabled and not down to zero yet */
+	bool ev_enabled;
+	bool fired;
+	uint64_t deadline;
+} timer;
+
+//--------------------------------------------------------------------+
+// Clock
+//--------------------------------------------------------------------+
+
+static uint64_t cycles(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	uint64_t ns = (uint64_t)(now.tv_sec - start.tv_sec) * 1000000000 + now.tv_nsec - start.tv_nsec;
+	return ns * CYCLES_PER_US / 1000;
+}
+
+static struct timespec cycles_to_timespec(uint64_t c)
+{
+	uint64_t ns = c * 1000 / CYCLES_PER_US + start.tv_nsec;
+	struct timespec ts = {
+		.tv_sec = start.tv_sec + ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+	return ts;
+}
+
+/* Two reads of the same counter can't be made atomic here either, timing_cycles() retries */
+uint32_t cycles_low_read(void)
+{
+	return (uint32_t)cycles();
+}
+
+uint32_t cycles_high_read(void)
+{
+	return (uint32_t)(cycles() >> 32);
+}
+
+/* Real time passes on its own here */
+void host_elapse(uint32_t c)
+{
+	(void)c;
+}
+
+uint64_t host_cycles(void)
+{
+	return cycles();
+}
+
+/* bootprof block, eight scratch registers */
+static uint32_t bootprof_stamp[8];
+
+#define BOOTPROF_STAMP(n)                                                 \
+	void bootprof_stamp##n##_write(uint32_t v) { bootprof_stamp[n] = v; } \
+	uint32_t bootprof_stamp##n##_read(void) { return bootprof_stamp[n]; }
+
+BOOTPROF_STAMP(0)
+BOOTPROF_STAMP(1)
+BOOTPROF_STAMP(2)
+BOOTPROF_STAMP(3)
+BOOTPROF_STAMP(4)
+BOOTPROF_STAMP(5)
+BOOTPROF_STAMP(6)
+BOOTPROF_STAMP(7)
+
+//--------------------------------------------------------------------+
+// CPU lock
+//--------------------------------------------------------------------+
+
+static void cpu_acquire(void)
+{
+	pthread_mutex_lock(&cpu_mutex);
+	cpu_held = true;
+}
+
+static void cpu_release(void)
+{
+	cpu_held = false;
+	pthread_mutex_unlock(&cpu_mutex);
+}
+
+bool host_bus_lock(void)
+{
+	if (cpu_held)
+		return false;
+
+	cpu_acquire();
+	return true;
+}
+
+void host_bus_unlock(bool locked)
+{
+	if (locked)
+		cpu_release();
+}
+
+static unsigned int pending_locked(void);
+
+/* Sleeps until something is broadcast, or the timer is due */
+static void cpu_wait(void)
+{
+	/* Latch a timer that is already due, waiting for it would return straight away */
+	pending_locked();
+
+	if (timer.counting)
+	{
+		struct timespec ts = cycles_to_timespec(timer.deadline);
+		pthread_cond_timedwait(&cpu_cond, &cpu_mutex, &ts);
+	}
+	else
+	{
+		pthread_cond_wait(&cpu_cond, &cpu_mutex);
+	}
+}
+
+//--------------------------------------------------------------------+
+// Interrupts
+//--------------------------------------------------------------------+
+
+static unsigned int pending_locked(void)
+{
+	/* Reaching zero is an edge, the event only fires once per start */
+	if (timer.counting && cycles() >= timer.deadline)
+	{
+		timer.counting = false;
+		timer.fired = true;
+	}
+
+	return pending | ((timer.fired && timer.ev_enabled) ? (1u << TIMER0_INTERRUPT) : 0);
+}
+
+void host_irq_set(unsigned int irq)
+{
+	pending |= 1u << irq;
+	pthread_cond_broadcast(&cpu_cond);
+}
+
+void host_irq_clear(unsigned int irq)
+{
+	pending &= ~(1u << irq);
+}
+
+/* The ISR sees interrupts as disabled, and can't change that */
+unsigned int irq_getie(void)
+{
+	return in_isr ? 0 : ie;
+}
+
+void irq_setie(unsigned int enable)
+{
+	if (in_isr)
+		return;
+
+	if (enable && !ie)
+	{
+		ie = 1;
+
+		/* A pending interrupt is taken straight away, as on the CPU */
+		while (pending_locked() & mask)
+		{
+			pthread_cond_broadcast(&cpu_cond);
+			pthread_cond_wait(&cpu_cond, &cpu_mutex);
+		}
+
+		cpu_release();
+	}
+	else if (!enable && ie)
+	{
+		cpu_acquire();
+		ie = 0;
+	}
+}
+
+unsigned int irq_getmask(void)
+{
+	return mask;
+}
+
+void irq_setmask(unsigned int m)
+{
+	bool locked = host_bus_lock();
+	mask = m;
+	pthread_cond_broadcast(&cpu_cond);
+	host_bus_unlock(locked);
+}
+
+unsigned int irq_pending(void)
+{
+	bool locked = host_bus_lock();
+	unsigned int p = pending_locked();
+	host_bus_unlock(locked);
+	return p;
+}
+
+/* Called with interrupts off, returns with them still off once one is pending */
+void host_wfi(void)
+{
+	while (!(pending_locked() & mask))
+		cpu_wait();
+}
+
+static void *isr_thread(void *arg)
+{
+	(void)arg;
+
+	cpu_acquire();
+	in_isr = true;
+
+	while (1)
+	{
+		if (ie && (pending_locked() & mask))
+		{
+			app_isr();
+			pthread_cond_broadcast(&cpu_cond);
+		}
+		else
+		{
+			cpu_wait();
+		}
+	}
+
+	return NULL;
+}
+
+/* Reset state: interrupts off, which means the main thread owns the CPU */
+void host_cpu_init(void)
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cpu_cond, &attr);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	cpu_acquire();
+	ie = 0;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, isr_thread, NULL) != 0)
+	{
+		perror("isr thread");
+		exit(1);
+	}
+}
+
+//--------------------------------------------------------------------+
+// timer0
+//--------------------------------------------------------------------+
+
+void timer0_load_write(uint32_t v)
+{
+	timer.load = v;
+}
+
+/* Periodic mode is never used */
+void timer0_reload_write(uint32_t v)
+{
+	(void)v;
+}
+
+void timer0_en_write(uint32_t v)
+{
+	bool locked = host_bus_lock();
+
+	if (v && !timer.enabled)
+	{
+		timer.deadline = cycles() + timer.load;
+		timer.counting = true;
+	}
+	else if (!v)
+	{
+		timer.counting = false;
+	}
+	timer.enabled = v & 1;
+	pthread_cond_broadcast(&cpu_cond);
+
+	host_bus_unlock(locked);
+}
+
+uint32_t timer0_ev_pending_read(void)
+{
+	bool locked = host_bus_lock();
+	pending_locked();
+	uint32_t fired = timer.fired;
+	host_bus_unlock(locked);
+	return fired;
+}
+
+void timer0_ev_pending_write(uint32_t v)
+{
+	bool locked = host_bus_lock();
+	if (v & 1)
+		timer.fired = false;
+	host_bus_unlock(locked);
+}
+
+void timer0_ev_enable_write(uint32_t v)
+{
+	bool locked = host_bus_lock();
+	timer.ev_enabled = v & 1;
+	host_bus_unlock(locked);
+}
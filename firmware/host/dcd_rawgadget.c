@@ -0,0 +1,432 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ *
+ * tinyusb device controller driver on top of Linux raw gadget
+ * (/dev/raw-gadget), for the host build. Bind it to dummy_hcd and the
+ * bootloader enumerates on the same machine:
+ *
+ *   modprobe dummy_hcd raw_gadget
+ *
+ * Only the control endpoint exists, which is all DFU needs. Raw gadget moves
+ * a whole control data stage with a single ioctl, so the 64 byte packets
+ * tinyusb hands over are gathered (IN) or handed out (OUT) from one buffer.
+ * The ioctls block, they run from the task that queued the transfer.
+ * Completions and bus events are raised as USB interrupts and reported to
+ * tinyusb from dcd_int_handler(), like the eptri driver does.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#include "tusb_option.h"
+
+#if TUSB_OPT_DEVICE_ENABLED
+
+#include "device/dcd.h"
+#include "generated/soc.h"
+#include "irq.h"
+#include "host.h"
+#include "perf.h"
+#include "trace.h"
+
+/* Newer kernels report these as well, older raw_gadget.h headers lack them */
+#define RAW_EVENT_RESET 3
+#define RAW_EVENT_DISCONNECT 4
+#define RAW_EVENT_SUSPEND 5
+#define RAW_EVENT_RESUME 6
+
+/* Not a raw gadget event, a transfer finished by dcd_edpt_xfer() */
+#define EVENT_XFER 0x100
+
+#define EVENT_COUNT 16
+
+/* Largest control data stage, DFU blocks are CFG_TUD_DFU_XFER_BUFSIZE */
+#define EP0_BUFFER_SIZE 4096
+
+/* bMaxPower of the configuration descriptor, 200mA */
+#define VBUS_DRAW 100
+
+typedef struct {
+	uint32_t type;
+	uint8_t ep;
+	uint16_t length;
+	uint8_t setup[8];
+} rawgadget_event_t;
+
+static int fd = -1;
+
+// Written by the event thread and dcd_edpt_xfer(), drained by the ISR. All under the bus lock.
+static rawgadget_event_t events[EVENT_COUNT];
+static uint32_t event_head;
+static uint32_t event_tail;
+
+static struct {
+	tusb_control_request_t request;
+	uint32_t length;     // IN: staged so far, OUT: received from the host
+	uint32_t offset;     // OUT: handed to tinyusb so far
+	bool done;           // data stage moved by the UDC
+	bool stalled;
+	uint8_t io[sizeof(struct usb_raw_ep_io) + EP0_BUFFER_SIZE] __attribute__((aligned(8)));
+} ep0;
+
+//--------------------------------------------------------------------+
+// Raw gadget
+//--------------------------------------------------------------------+
+
+bool dcd_rawgadget_open(const char *driver, const char *device)
+{
+	fd = open("/dev/raw-gadget", O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		perror("/dev/raw-gadget (modprobe raw_gadget dummy_hcd?)");
+		return false;
+	}
+
+	struct usb_raw_init init;
+	memset(&init, 0, sizeof(init));
+	strncpy((char *)init.driver_name, driver, UDC_NAME_LENGTH_MAX - 1);
+	strncpy((char *)init.device_name, device, UDC_NAME_LENGTH_MAX - 1);
+	init.speed = USB_SPEED_HIGH;
+
+	if (ioctl(fd, USB_RAW_IOCTL_INIT, &init) < 0) {
+		perror("USB_RAW_IOCTL_INIT");
+		return false;
+	}
+	return true;
+}
+
+static void event_push(uint32_t type, uint8_t ep, uint16_t length, const uint8_t *setup, unsigned int irq)
+{
+	bool locked = host_bus_lock();
+
+	if (event_head - event_tail < EVENT_COUNT) {
+		rawgadget_event_t *e = &events[event_head++ % EVENT_COUNT];
+		e->type = type;
+		e->ep = ep;
+		e->length = length;
+		if (setup)
+			memcpy(e->setup, setup, sizeof(e->setup));
+		host_irq_set(irq);
+	} else {
+		fprintf(stderr, "raw gadget: event queue overflow\n");
+	}
+
+	host_bus_unlock(locked);
+}
+
+static void *event_thread(void *arg)
+{
+	(void)arg;
+	uint8_t buf[sizeof(struct usb_raw_event) + sizeof(struct usb_ctrlrequest)] __attribute__((aligned(8)));
+	struct usb_raw_event *event = (struct usb_raw_event *)buf;
+
+	while (1) {
+		event->type = 0;
+		event->length = sizeof(struct usb_ctrlrequest);
+
+		if (ioctl(fd, USB_RAW_IOCTL_EVENT_FETCH, event) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("USB_RAW_IOCTL_EVENT_FETCH");
+			return NULL;
+		}
+
+		switch (event->type) {
+		case USB_RAW_EVENT_CONTROL:
+			event_push(event->type, 0, 0, event->data, USB_SETUP_INTERRUPT);
+			break;
+		case USB_RAW_EVENT_CONNECT:
+		case RAW_EVENT_RESET:
+			event_push(event->type, 0, 0, NULL, USB_DEVICE_CONTROLLER_INTERRUPT);
+			break;
+		case RAW_EVENT_DISCONNECT:
+		case RAW_EVENT_SUSPEND:
+		case RAW_EVENT_RESUME:
+			event_push(event->type, 0, 0, NULL, USB_STATUS_INTERRUPT);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static int ep0_ioctl(unsigned long request, uint32_t length, uint16_t flags)
+{
+	struct usb_raw_ep_io *io = (struct usb_raw_ep_io *)ep0.io;
+	io->ep = 0;
+	io->flags = flags;
+	io->length = length;
+
+	int rv = ioctl(fd, request, io);
+	if (rv < 0)
+		fprintf(stderr, "raw gadget ep0: %s\n", strerror(errno));
+	return rv;
+}
+
+static uint8_t *ep0_data(void)
+{
+	return ((struct usb_raw_ep_io *)ep0.io)->data;
+}
+
+//--------------------------------------------------------------------+
+// CONTROLLER API
+//--------------------------------------------------------------------+
+
+// Binds to the UDC, the host sees the device from here on.
+void dcd_init(uint8_t rhport)
+{
+	(void) rhport;
+
+	/* Started with -N, there is no UDC to bind */
+	if (fd < 0)
+		return;
+
+	if (ioctl(fd, USB_RAW_IOCTL_RUN, 0) < 0) {
+		perror("USB_RAW_IOCTL_RUN");
+		return;
+	}
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, event_thread, NULL);
+}
+
+// Interrupts are delivered by a thread, holding it off means holding off all of them.
+static unsigned int int_depth;
+static unsigned int int_ie;
+
+void dcd_int_enable(uint8_t rhport)
+{
+	(void) rhport;
+	if (int_depth > 0 && --int_depth == 0)
+		irq_setie(int_ie);
+}
+
+void dcd_int_disable(uint8_t rhport)
+{
+	(void) rhport;
+	if (int_depth++ == 0) {
+		int_ie = irq_getie();
+		irq_setie(0);
+	}
+}
+
+// The UDC answers SET_ADDRESS itself, raw gadget never passes it on.
+void dcd_set_address(uint8_t rhport, uint8_t dev_addr)
+{
+	(void) dev_addr;
+	dcd_edpt_xfer(rhport, tu_edpt_addr(0, TUSB_DIR_IN), NULL, 0);
+}
+
+void dcd_remote_wakeup(uint8_t rhport)
+{
+	(void) rhport;
+}
+
+// Raw gadget can't drop the pullup once bound, the device goes away when the process ends.
+void dcd_connect(uint8_t rhport)
+{
+	(void) rhport;
+}
+
+void dcd_disconnect(uint8_t rhport)
+{
+	(void) rhport;
+}
+
+//--------------------------------------------------------------------+
+// DCD Endpoint Port
+//--------------------------------------------------------------------+
+
+// Control endpoint only, the host build has no --usb-bench interface.
+bool dcd_edpt_open(uint8_t rhport, tusb_desc_endpoint_t const * p_endpoint_desc)
+{
+	(void) rhport;
+	(void) p_endpoint_desc;
+	return false;
+}
+
+void dcd_edpt_close_all (uint8_t rhport)
+{
+	(void) rhport;
+}
+
+void dcd_edpt_stall(uint8_t rhport, uint8_t ep_addr)
+{
+	(void) rhport;
+
+	// tinyusb stalls both directions of ep0, the UDC only needs telling once.
+	if (tu_edpt_number(ep_addr) == 0 && !ep0.stalled) {
+		ep0.stalled = true;
+		if (ioctl(fd, USB_RAW_IOCTL_EP0_STALL, 0) < 0)
+			fprintf(stderr, "raw gadget ep0 stall: %s\n", strerror(errno));
+	}
+}
+
+// A stall on ep0 ends with the next SETUP.
+void dcd_edpt_clear_stall(uint8_t rhport, uint8_t ep_addr)
+{
+	(void) rhport;
+	(void) ep_addr;
+}
+
+// Status stage of a request without data. Raw gadget acks it with a zero length read.
+static void ep0_ack(void)
+{
+	tusb_control_request_t const *req = &ep0.request;
+
+	if (req->bmRequestType == 0x00 && req->bRequest == TUSB_REQ_SET_CONFIGURATION && req->wValue != 0) {
+		ioctl(fd, USB_RAW_IOCTL_VBUS_DRAW, VBUS_DRAW);
+		ioctl(fd, USB_RAW_IOCTL_CONFIGURE, 0);
+	}
+
+	ep0_ioctl(USB_RAW_IOCTL_EP0_READ, 0, 0);
+}
+
+// IN data stage: gather packets, the stage ends on a short packet or once wLength is reached.
+static uint16_t ep0_in(uint8_t const *buffer, uint16_t total_bytes)
+{
+	if (ep0.done)
+		return total_bytes;
+
+	uint32_t n = total_bytes;
+	if (n > EP0_BUFFER_SIZE - ep0.length)
+		n = EP0_BUFFER_SIZE - ep0.length;
+	if (n)
+		memcpy(ep0_data() + ep0.length, buffer, n);
+	ep0.length += n;
+
+	if (total_bytes < CFG_TUD_ENDPOINT0_SIZE || ep0.length >= ep0.request.wLength) {
+		// A short answer that is a whole number of packets needs a ZLP to end it
+		uint16_t flags = (ep0.length < ep0.request.wLength && (ep0.length % CFG_TUD_ENDPOINT0_SIZE) == 0) ?
+				USB_RAW_IO_FLAGS_ZERO : 0;
+		ep0_ioctl(USB_RAW_IOCTL_EP0_WRITE, ep0.length, flags);
+		ep0.done = true;
+	}
+
+	return total_bytes;
+}
+
+// OUT data stage: read it all on the first packet, then hand it out.
+static uint16_t ep0_out(uint8_t *buffer, uint16_t total_bytes)
+{
+	if (!ep0.done) {
+		uint32_t len = ep0.request.wLength;
+		if (len > EP0_BUFFER_SIZE)
+			len = EP0_BUFFER_SIZE;
+
+		int rv = ep0_ioctl(USB_RAW_IOCTL_EP0_READ, len, 0);
+		ep0.length = rv > 0 ? rv : 0;
+		ep0.offset = 0;
+		ep0.done = true;
+		perf.usb_rx_bytes += ep0.length;
+	}
+
+	uint32_t n = ep0.length - ep0.offset;
+	if (n > total_bytes)
+		n = total_bytes;
+	if (n && buffer)
+		memcpy(buffer, ep0_data() + ep0.offset, n);
+	ep0.offset += n;
+
+	return n;
+}
+
+bool dcd_edpt_xfer (uint8_t rhport, uint8_t ep_addr, uint8_t* buffer, uint16_t total_bytes)
+{
+	(void)rhport;
+	uint8_t ep_dir = tu_edpt_dir(ep_addr);
+	TU_ASSERT(tu_edpt_number(ep_addr) == 0);
+
+	bool data_in = ep0.request.bmRequestType_bit.direction == TUSB_DIR_IN;
+	uint16_t xferred = 0;
+
+	if (ep0.request.wLength == 0) {
+		if (ep_dir == TUSB_DIR_IN)
+			ep0_ack();
+	}
+	else if (ep_dir == TUSB_DIR_IN) {
+		// The status IN after an OUT data stage was sent by the UDC with the data
+		if (data_in)
+			xferred = ep0_in(buffer, total_bytes);
+	}
+	else {
+		// Same for the status OUT after an IN data stage
+		if (!data_in)
+			xferred = ep0_out(buffer, total_bytes);
+	}
+
+	event_push(EVENT_XFER, ep_addr, xferred, NULL, ep_dir == TUSB_DIR_IN ? USB_IN_EP_INTERRUPT : USB_OUT_EP_INTERRUPT);
+	return true;
+}
+
+//--------------------------------------------------------------------+
+// ISR
+//--------------------------------------------------------------------+
+
+static void handle_setup(rawgadget_event_t const *e)
+{
+	memcpy(&ep0.request, e->setup, sizeof(ep0.request));
+	ep0.length = 0;
+	ep0.offset = 0;
+	ep0.done = false;
+	ep0.stalled = false;
+
+	TRACE(TRACE_SETUP, (e->setup[0] << 8) | e->setup[1]);
+	// Class IN request to an interface with bRequest 3 is DFU_GETSTATUS
+	if (e->setup[0] == 0xA1 && e->setup[1] == 3)
+		perf.getstatus_count++;
+	dcd_event_setup_received(0, e->setup, true);
+}
+
+void dcd_int_handler(uint8_t rhport)
+{
+	(void)rhport;
+
+	while (event_tail != event_head) {
+		rawgadget_event_t const *e = &events[event_tail++ % EVENT_COUNT];
+
+		switch (e->type) {
+		case USB_RAW_EVENT_CONNECT:
+		case RAW_EVENT_RESET:
+			TRACE(TRACE_BUS_RESET, 0);
+			dcd_event_bus_reset(0, TUSB_SPEED_HIGH, true);
+			break;
+		case USB_RAW_EVENT_CONTROL:
+			handle_setup(e);
+			break;
+		case RAW_EVENT_DISCONNECT:
+			dcd_event_bus_signal(0, DCD_EVENT_UNPLUGGED, true);
+			break;
+		case RAW_EVENT_SUSPEND:
+			TRACE(TRACE_SUSPEND, 0);
+			dcd_event_bus_signal(0, DCD_EVENT_SUSPEND, true);
+			break;
+		case RAW_EVENT_RESUME:
+			TRACE(TRACE_RESUME, 0);
+			dcd_event_bus_signal(0, DCD_EVENT_RESUME, true);
+			break;
+		case EVENT_XFER:
+			TRACE(tu_edpt_dir(e->ep) == TUSB_DIR_IN ? TRACE_XFER_IN : TRACE_XFER_OUT, (tu_edpt_number(e->ep) << 16) | e->length);
+			dcd_event_xfer_complete(0, e->ep, e->length, XFER_RESULT_SUCCESS, true);
+			break;
+		default:
+			break;
+		}
+	}
+
+	host_irq_clear(USB_DEVICE_CONTROLLER_INTERRUPT);
+	host_irq_clear(USB_SETUP_INTERRUPT);
+	host_irq_clear(USB_IN_EP_INTERRUPT);
+	host_irq_clear(USB_OUT_EP_INTERRUPT);
+	host_irq_clear(USB_STATUS_INTERRUPT);
+}
+
+#endif
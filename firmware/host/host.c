@@ -0,0 +1,157 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <generated/csr.h>
+#include <generated/soc.h>
+
+#include "timing.h"
+#include "host.h"
+#include "w25q128.h"
+
+int firmware_main(int i, char **c);
+
+/* The button is let go after this long, well before the 5s reboot */
+#define BUTTON_HOLD_MS 1000
+
+/* LiteX ctrl_scratch reset value, anything but 0 keeps the bootloader partition locked */
+#define SCRATCH_RESET 0x12345678
+
+static bool host_button_held = true;
+static uint32_t host_scratch = SCRATCH_RESET;
+
+static int saved_argc;
+static char **saved_argv;
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s [-n] [-u] [-N] [-g driver] [-d device] [-e port] image\n"
+			"  -n         normal boot, only a magic in security page 3 keeps the bootloader\n"
+			"  -u         bootloader partition unlocked, as after a 5s button press\n"
+			"  -g driver  UDC driver name (default dummy_udc)\n"
+			"  -d device  UDC device name (default dummy_udc.0)\n"
+			"  -N         no USB, only the Ethernet path (no raw gadget needed)\n"
+			"  -e port    UDP port on 127.0.0.1 for eth_flash (default %u)\n"
+			"  image      16MB flash image, created erased if missing\n",
+			name, ETH_FLASH_PORT);
+	exit(2);
+}
+
+uint32_t button_in_read(void)
+{
+	if (host_button_held && timing_cycles() < (uint64_t)BUTTON_HOLD_MS * TIMING_CYCLES_PER_MS)
+		return 0;
+	return 1;
+}
+
+uint32_t ctrl_scratch_read(void)
+{
+	return host_scratch;
+}
+
+void ctrl_scratch_write(uint32_t v)
+{
+	host_scratch = v;
+}
+
+/* Soft reset of the SoC: start over, only the scratch register survives */
+void ctrl_reset_write(uint32_t v)
+{
+	if (!(v & 1))
+		return;
+
+	printf("host: soft reset\n");
+	fflush(stdout);
+
+	char *argv[saved_argc + 2];
+	argv[0] = saved_argv[0];
+	int n = 1;
+	if (host_scratch == 0)
+		argv[n++] = "-u";
+	for (int i = 1; i < saved_argc; i++)
+	{
+		if (strcmp(saved_argv[i], "-u") != 0)
+			argv[n++] = saved_argv[i];
+	}
+	argv[n] = NULL;
+
+	execv("/proc/self/exe", argv);
+	perror("execv");
+	exit(1);
+}
+
+/* The FPGA would reconfigure into the user bitstream here, the process ends */
+void reset_out_write(uint32_t v)
+{
+	if (!(v & 1))
+		return;
+
+	printf("host: reconfiguring from flash\n");
+	fflush(stdout);
+	w25q_close();
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	const char *driver = "dummy_udc";
+	const char *device = "dummy_udc.0";
+	bool usb = true;
+	unsigned int port = ETH_FLASH_PORT;
+	int opt;
+
+	saved_argc = argc;
+	saved_argv = argv;
+
+	while ((opt = getopt(argc, argv, "nuNg:d:e:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			host_button_held = false;
+			break;
+		case 'u':
+			host_scratch = 0;
+			break;
+		case 'g':
+			driver = optarg;
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		case 'N':
+			usb = false;
+			break;
+		case 'e':
+			port = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	if (!w25q_open(argv[optind]))
+		return 1;
+
+	if (usb && !dcd_rawgadget_open(driver, device))
+		return 1;
+
+	if (!host_udp_open(port))
+		return 1;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	host_cpu_init();
+	return firmware_main(0, NULL);
+}
@@ -0,0 +1,10 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef __CRC_H
+#define __CRC_H
+
+/* Same CRC-32 as LiteX libbase, implemented in libbase.c */
+unsigned int crc32(const unsigned char *buffer, unsigned int len);
+
+#endif /* __CRC_H */
@@ -0,0 +1,79 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef __GENERATED_CSR_H
+#define __GENERATED_CSR_H
+
+#include <stdint.h>
+
+#include <generated/soc.h>
+
+/* Host build stand-in for the LiteX generated csr.h. Only the registers the
+ * firmware touches exist, implemented by the models in firmware/host.
+ */
+
+/* Cycle counter (cpu.c), runs at CONFIG_CLOCK_FREQUENCY from process start */
+uint32_t cycles_low_read(void);
+uint32_t cycles_high_read(void);
+
+/* timer0 (cpu.c), one-shot down counter */
+void timer0_load_write(uint32_t v);
+void timer0_reload_write(uint32_t v);
+void timer0_en_write(uint32_t v);
+uint32_t timer0_ev_pending_read(void);
+void timer0_ev_pending_write(uint32_t v);
+void timer0_ev_enable_write(uint32_t v);
+
+/* SPI flash master (w25q128.c) */
+void spiflash_core_master_cs_write(uint32_t v);
+void spiflash_core_master_phyconfig_len_write(uint32_t v);
+void spiflash_core_master_phyconfig_width_write(uint32_t v);
+void spiflash_core_master_phyconfig_mask_write(uint32_t v);
+uint32_t spiflash_core_master_status_tx_ready_read(void);
+uint32_t spiflash_core_master_status_rx_ready_read(void);
+void spiflash_core_master_rxtx_write(uint32_t v);
+uint32_t spiflash_core_master_rxtx_read(void);
+
+/* Ethernet MAC (udp.c), libliteeth does the rest */
+void ethmac_sram_writer_ev_enable_write(uint32_t v);
+
+/* Board (host.c) */
+uint32_t button_in_read(void);
+uint32_t ctrl_scratch_read(void);
+void ctrl_scratch_write(uint32_t v);
+void ctrl_reset_write(uint32_t v);
+void reset_out_write(uint32_t v);
+
+/* No LEDs or IO banks on the host */
+static inline void leds_park_write(uint32_t v) { (void)v; }
+static inline void leds_pattern_mode_write(uint32_t v) { (void)v; }
+static inline void leds_pattern_step_write(uint32_t v) { (void)v; }
+static inline void leds_pattern_mask_write(uint32_t v) { (void)v; }
+static inline void leds_pattern_phase_write(uint64_t v) { (void)v; }
+static inline void leds_pattern_colour0_write(uint32_t v) { (void)v; }
+static inline void leds_pattern_colour1_write(uint32_t v) { (void)v; }
+static inline void leds_pattern_palette_write(uint32_t v) { (void)v; }
+static inline void vccio_ch0_write(uint32_t v) { (void)v; }
+static inline void vccio_ch1_write(uint32_t v) { (void)v; }
+static inline void vccio_ch2_write(uint32_t v) { (void)v; }
+static inline void vccio_enable_write(uint32_t v) { (void)v; }
+
+/* Boot stamps (cpu.c), plain storage like the bootprof CSRs */
+void bootprof_stamp0_write(uint32_t v);
+uint32_t bootprof_stamp0_read(void);
+void bootprof_stamp1_write(uint32_t v);
+uint32_t bootprof_stamp1_read(void);
+void bootprof_stamp2_write(uint32_t v);
+uint32_t bootprof_stamp2_read(void);
+void bootprof_stamp3_write(uint32_t v);
+uint32_t bootprof_stamp3_read(void);
+void bootprof_stamp4_write(uint32_t v);
+uint32_t bootprof_stamp4_read(void);
+void bootprof_stamp5_write(uint32_t v);
+uint32_t bootprof_stamp5_read(void);
+void bootprof_stamp6_write(uint32_t v);
+uint32_t bootprof_stamp6_read(void);
+void bootprof_stamp7_write(uint32_t v);
+uint32_t bootprof_stamp7_read(void);
+
+#endif /* __GENERATED_CSR_H */
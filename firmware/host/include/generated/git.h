@@ -0,0 +1,9 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef __GENERATED_GIT_H
+#define __GENERATED_GIT_H
+
+/* Host build, nothing to record */
+
+#endif /* __GENERATED_GIT_H */
@@ -0,0 +1,36 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef __GENERATED_LUNA_USB_H
+#define __GENERATED_LUNA_USB_H
+
+#include <stdint.h>
+
+/* Host build: the eptri registers main.c touches directly. A PHY reset drops
+ * PHY_READY for one status read, and the raw gadget is only bound (dcd_init)
+ * or dropped (exit).
+ */
+
+#define USB_STATUS_PHY_READY_BIT (1u << 14)
+
+static uint32_t usb_phy_resetting;
+
+static inline void usb_device_controller_reset_write(uint32_t v)
+{
+	if (v)
+		usb_phy_resetting = 1;
+}
+
+static inline void usb_device_controller_connect_write(uint32_t v) { (void)v; }
+
+static inline uint32_t usb_status_events_read(void)
+{
+	if (usb_phy_resetting)
+	{
+		usb_phy_resetting--;
+		return 0;
+	}
+	return USB_STATUS_PHY_READY_BIT;
+}
+
+#endif /* __GENERATED_LUNA_USB_H */
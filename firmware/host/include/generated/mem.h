@@ -0,0 +1,15 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef __GENERATED_MEM_H
+#define __GENERATED_MEM_H
+
+#include <stdint.h>
+
+/* The memory mapped flash window is the mmap'd image file (w25q128.c) */
+extern uint8_t *w25q_array;
+
+#define SPIFLASH_BASE ((uintptr_t)w25q_array)
+#define SPIFLASH_SIZE 0x01000000
+
+#endif /* __GENERATED_MEM_H */
@@ -0,0 +1,31 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef __GENERATED_SOC_H
+#define __GENERATED_SOC_H
+
+/* Host build stand-in for the LiteX generated soc.h. None of the optional
+ * gateware features (--usb-bench, --xip, --trace, ...) exist on the host,
+ * except --eth-flash on a loopback socket (udp.c).
+ */
+
+#define HOST_BUILD
+
+#define CONFIG_CLOCK_FREQUENCY 60000000
+#define CONFIG_REPO_GIT_DESC "host"
+
+#define UART_INTERRUPT 0
+#define TIMER0_INTERRUPT 1
+#define USB_DEVICE_CONTROLLER_INTERRUPT 2
+#define USB_SETUP_INTERRUPT 3
+#define USB_IN_EP_INTERRUPT 4
+#define USB_OUT_EP_INTERRUPT 5
+#define USB_STATUS_INTERRUPT 6
+#define ETHMAC_INTERRUPT 7
+
+#define ETH_FLASH
+#define ETH_IP 2130706433 /* 127.0.0.1 */
+#define ETH_NETMASK 4294967295
+#define ETH_FLASH_PORT 6565
+
+#endif /* __GENERATED_SOC_H */
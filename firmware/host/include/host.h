@@ -0,0 +1,49 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef HOST_H_
+#define HOST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Host build: the firmware runs as a Linux process.
+ *
+ * The main thread is the CPU. irq_setie(0) takes the CPU lock and
+ * irq_setie(1) drops it, so code that runs with interrupts off is never
+ * preempted by an ISR. A separate thread delivers interrupts: once one is
+ * pending, unmasked and the CPU has interrupts enabled, it takes the lock
+ * and calls app_isr().
+ *
+ * Peripheral models (raw gadget DCD, timer) update their state and raise
+ * interrupts under the same lock through host_bus_lock().
+ */
+
+void host_cpu_init(void);
+
+/* Estimated cost of one CSR access from the CPU, through the wishbone to CSR bridge */
+#define HOST_CSR_CYCLES 8
+
+/* Time a peripheral access takes. The host program runs on the wall clock
+ * and ignores it, the flash bench advances its virtual cycle counter.
+ */
+void host_elapse(uint32_t cycles);
+
+/* Current SoC cycle count for peripheral models, reading it costs nothing */
+uint64_t host_cycles(void);
+
+/* Safe from any thread, and with the lock already held (returns false then) */
+bool host_bus_lock(void);
+void host_bus_unlock(bool locked);
+
+/* Call with the bus lock held */
+void host_irq_set(unsigned int irq);
+void host_irq_clear(unsigned int irq);
+
+/* Raw gadget setup, the UDC is bound from dcd_init() */
+bool dcd_rawgadget_open(const char *driver, const char *device);
+
+/* eth_flash.c's socket on 127.0.0.1 (udp.c), the receive thread starts from eth_init() */
+bool host_udp_open(uint16_t port);
+
+#endif /* HOST_H_ */
@@ -0,0 +1,18 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef __IRQ_H
+#define __IRQ_H
+
+/* Host build stand-in for the LiteX irq.h, the interrupt model is in cpu.c */
+
+unsigned int irq_getie(void);
+void irq_setie(unsigned int ie);
+unsigned int irq_getmask(void);
+void irq_setmask(unsigned int mask);
+unsigned int irq_pending(void);
+
+/* Stands in for wfi, call with interrupts disabled */
+void host_wfi(void);
+
+#endif /* __IRQ_H */
@@ -0,0 +1,22 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef __LIBLITEETH_UDP_H
+#define __LIBLITEETH_UDP_H
+
+/* Host build stand-in for the LiteX libliteeth UDP stack, over a socket on
+ * the loopback interface (udp.c). Addresses and ports are in host order.
+ */
+
+typedef void (*udp_callback)(unsigned int src_ip, unsigned short src_port, unsigned short dst_port, void *data, unsigned int length);
+
+void eth_init(void);
+void udp_start(const unsigned char *macaddr, unsigned int ip);
+void udp_set_callback(udp_callback callback);
+void udp_service(void);
+
+int udp_arp_resolve(unsigned int ip);
+void *udp_get_tx_buffer(void);
+int udp_send(unsigned short src_port, unsigned short dst_port, unsigned int length);
+
+#endif /* __LIBLITEETH_UDP_H */
@@ -0,0 +1,12 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef __SPIFLASH_H
+#define __SPIFLASH_H
+
+/* Host build stand-in for the LiteX spiflash.h, W25Q128JV geometry */
+
+#define SPIFLASH_MODULE_PAGE_SIZE 256
+#define SPIFLASH_MODULE_TOTAL_SIZE 0x01000000
+
+#endif /* __SPIFLASH_H */
@@ -0,0 +1,12 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef __SYSTEM_H
+#define __SYSTEM_H
+
+/* Host build: the flash window is the mmap'd image, always coherent */
+
+static inline void flush_cpu_icache(void) {}
+static inline void flush_cpu_dcache(void) {}
+
+#endif /* __SYSTEM_H */
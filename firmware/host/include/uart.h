@@ -0,0 +1,12 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef __UART_H
+#define __UART_H
+
+/* Host build: printf goes straight to stdout, there is no UART to service */
+
+static inline void uart_init(void) {}
+static inline void uart_isr(void) {}
+
+#endif /* __UART_H */
@@ -0,0 +1,64 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef W25Q128_H_
+#define W25Q128_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* W25Q128JV model behind the spiflash_core_master registers.
+ *
+ * The 16MB array is an mmap'd image file, which also serves as the memory
+ * mapped flash window (SPIFLASH_BASE). Status registers, the unique id and
+ * the three security registers are non-volatile too, they live in a small
+ * sidecar file next to the image (<image>.nv).
+ *
+ * Commands take effect when CS goes high, as on the real part. Block
+ * protection (BP/TB/SEC/CMP), WEL, QE, security register lock bits and deep
+ * power-down are modelled. While powered down the window is unmapped, so a
+ * stray read faults instead of passing silently.
+ *
+ * Program, erase and status writes hold BUSY for tPP/tSE/tBE/tW against the
+ * SoC cycle counter, and the part ignores everything but status reads until
+ * it clears. Each register access and SPI clock is charged to host_elapse(),
+ * which is how the flash bench (bench.c) gets its cycle estimates.
+ */
+
+#define W25Q_SIZE 0x01000000
+#define W25Q_PAGE_SIZE 256
+#define W25Q_SECURITY_PAGES 3
+
+typedef struct
+{
+	uint32_t magic;
+	uint8_t status[3];
+	uint8_t uid[8];
+	uint8_t security[W25Q_SECURITY_PAGES][W25Q_PAGE_SIZE];
+} w25q_nv_t;
+
+typedef enum
+{
+	W25Q_TIMING_NONE,	 /* BUSY is never seen */
+	W25Q_TIMING_TYPICAL, /* datasheet typical, the default */
+	W25Q_TIMING_MAX,	 /* datasheet maximum */
+} w25q_timing_t;
+
+typedef struct
+{
+	uint64_t csr_accesses;
+	uint64_t spi_clocks;
+	uint32_t commands;
+	uint32_t busy_polls; /* status reads that found BUSY set */
+	uint32_t ignored;	 /* commands the part dropped: busy, no WEL, protected, QE clear, wrong bus width */
+} w25q_stats_t;
+
+extern uint8_t *w25q_array;
+extern w25q_stats_t w25q_stats;
+
+bool w25q_open(const char *path);
+void w25q_close(void);
+void w25q_set_timing(w25q_timing_t timing);
+const w25q_nv_t *w25q_state(void);
+
+#endif /* W25Q128_H_ */
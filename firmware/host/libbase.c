@@ -0,0 +1,20 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+
+#include <crc.h>
+
+/* Reflected CRC-32 (0xEDB88320), the same as LiteX libbase and zlib */
+unsigned int crc32(const unsigned char *buffer, unsigned int len)
+{
+	unsigned int crc = 0xFFFFFFFF;
+
+	while (len--)
+	{
+		crc ^= *buffer++;
+		for (int i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
@@ -0,0 +1,172 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ *
+ * libliteeth UDP stand-in for the host build: the board's address is a
+ * socket on 127.0.0.1, so extra/eth_flash.py can push images to eth_flash.c
+ * without an Ethernet MAC. Several instances take one port each (-e).
+ *
+ * Like the ethmac, a received datagram stays pending, and raises
+ * ETHMAC_INTERRUPT while the event is enabled, until udp_service() takes it.
+ * There is no ARP, udp_arp_resolve() only records the destination.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <generated/csr.h>
+#include <libliteeth/udp.h>
+
+#include "host.h"
+
+/* Largest Ethernet payload, as in the ethmac SRAM slots */
+#define UDP_BUFFER_SIZE 1500
+
+static int fd = -1;
+
+static udp_callback rx_callback;
+static uint8_t rx_buffer[UDP_BUFFER_SIZE];
+static uint8_t tx_buffer[UDP_BUFFER_SIZE];
+static uint32_t tx_ip;
+
+// Under the bus lock
+static bool ev_enabled;
+static bool rx_ready;
+
+/* Posted once udp_service() has taken the datagram rx_ready announced */
+static sem_t rx_taken;
+
+static void irq_update(void)
+{
+	if (ev_enabled && rx_ready)
+		host_irq_set(ETHMAC_INTERRUPT);
+	else
+		host_irq_clear(ETHMAC_INTERRUPT);
+}
+
+static void *rx_thread(void *arg)
+{
+	(void)arg;
+	struct pollfd p = {.fd = fd, .events = POLLIN};
+
+	while (1)
+	{
+		if (poll(&p, 1, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("udp: poll");
+			return NULL;
+		}
+
+		bool locked = host_bus_lock();
+		rx_ready = true;
+		irq_update();
+		host_bus_unlock(locked);
+
+		sem_wait(&rx_taken);
+	}
+}
+
+bool host_udp_open(uint16_t port)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		perror("udp: bind");
+		return false;
+	}
+
+	printf("host: eth_flash on 127.0.0.1:%u\n", port);
+	return true;
+}
+
+void ethmac_sram_writer_ev_enable_write(uint32_t v)
+{
+	bool locked = host_bus_lock();
+	ev_enabled = v & 1;
+	irq_update();
+	host_bus_unlock(locked);
+}
+
+void eth_init(void)
+{
+	pthread_t thread;
+
+	sem_init(&rx_taken, 0, 0);
+	pthread_create(&thread, NULL, rx_thread, NULL);
+}
+
+void udp_start(const unsigned char *macaddr, unsigned int ip)
+{
+	(void)macaddr;
+	(void)ip;
+}
+
+void udp_set_callback(udp_callback callback)
+{
+	rx_callback = callback;
+}
+
+void udp_service(void)
+{
+	struct sockaddr_in src;
+	socklen_t src_len = sizeof(src);
+
+	ssize_t length = recvfrom(fd, rx_buffer, sizeof(rx_buffer), MSG_DONTWAIT, (struct sockaddr *)&src, &src_len);
+
+	bool locked = host_bus_lock();
+	bool taken = rx_ready;
+	rx_ready = false;
+	irq_update();
+	host_bus_unlock(locked);
+
+	if (taken)
+		sem_post(&rx_taken);
+
+	if (length >= 0 && rx_callback)
+		rx_callback(ntohl(src.sin_addr.s_addr), ntohs(src.sin_port), ETH_FLASH_PORT, rx_buffer, length);
+}
+
+int udp_arp_resolve(unsigned int ip)
+{
+	tx_ip = ip;
+	return 1;
+}
+
+void *udp_get_tx_buffer(void)
+{
+	return tx_buffer;
+}
+
+int udp_send(unsigned short src_port, unsigned short dst_port, unsigned int length)
+{
+	(void)src_port;
+	struct sockaddr_in dst = {
+		.sin_family = AF_INET,
+		.sin_port = htons(dst_port),
+		.sin_addr.s_addr = htonl(tx_ip),
+	};
+
+	if (sendto(fd, tx_buffer, length, 0, (struct sockaddr *)&dst, sizeof(dst)) < 0)
+	{
+		perror("udp: sendto");
+		return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,642 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+
+#include <generated/csr.h>
+#include <generated/soc.h>
+
+#include "host.h"
+#include "w25q128.h"
+
+#define NV_MAGIC 0x564e3532 /* "25NV" */
+
+#define SR1_BUSY (1 << 0)
+#define SR1_WEL (1 << 1)
+#define SR1_BP_SHIFT 2
+#define SR1_TB (1 << 5)
+#define SR1_SEC (1 << 6)
+#define SR2_QE (1 << 1)
+#define SR2_LB_SHIFT 3
+#define SR2_CMP (1 << 6)
+
+/* SoC cycles per SPI clock, add_spi_flash() runs the flash at 20MHz by default */
+#define SPI_CLOCK_DIV (CONFIG_CLOCK_FREQUENCY / 20000000)
+
+/* tRES1, Release Power-down to the next command */
+#define WAKE_US 3
+
+enum
+{
+	OP_PROGRAM,
+	OP_ERASE_4K,
+	OP_ERASE_32K,
+	OP_ERASE_64K,
+	OP_ERASE_CHIP,
+	OP_STATUS,
+	OP_COUNT,
+};
+
+/* W25Q128JV datasheet AC characteristics, typical and maximum in us:
+   tPP, tSE, tBE1, tBE2, tCE and tW. Security registers program and erase like a page and a sector. */
+static const uint32_t op_us[OP_COUNT][2] = {
+	[OP_PROGRAM] = {400, 3000},
+	[OP_ERASE_4K] = {45000, 400000},
+	[OP_ERASE_32K] = {120000, 1600000},
+	[OP_ERASE_64K] = {150000, 2000000},
+	[OP_ERASE_CHIP] = {40000000, 200000000},
+	[OP_STATUS] = {10000, 15000},
+};
+
+/* Bits a status register write can change, LB1-3 are one time programmable */
+static const uint8_t sr_writable[3] = {0xFC, 0x43, 0x64};
+
+uint8_t *w25q_array;
+w25q_stats_t w25q_stats;
+static w25q_nv_t *nv;
+
+/* One SPI transaction, from CS low to CS high */
+static struct
+{
+	bool selected;
+	uint8_t cmd;
+	uint32_t count; /* bytes clocked, including the opcode */
+	uint32_t address;
+	uint8_t out;
+	uint8_t data[W25Q_PAGE_SIZE]; /* program data or new status, latched until CS high */
+	uint32_t length;
+	uint32_t width; /* bus width set in phyconfig */
+	bool ignored;	/* the part won't act on this command */
+} spi = {.width = 1};
+
+static bool powered_down;
+static w25q_timing_t timing = W25Q_TIMING_TYPICAL;
+static uint64_t busy_until;
+static uint64_t awake_at;
+
+//--------------------------------------------------------------------+
+// Image files
+//--------------------------------------------------------------------+
+
+/* Opens (creating if needed) a file of at least size bytes, new space reads as fill */
+static void *map_file(const char *path, size_t size, uint8_t fill, bool *created)
+{
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		perror(path);
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size > size)
+	{
+		fprintf(stderr, "%s: expected at most %zu bytes\n", path, size);
+		close(fd);
+		return NULL;
+	}
+
+	*created = st.st_size == 0;
+
+	if ((size_t)st.st_size < size)
+	{
+		uint8_t block[4096];
+		memset(block, fill, sizeof(block));
+		lseek(fd, st.st_size, SEEK_SET);
+		for (size_t left = size - st.st_size; left > 0;)
+		{
+			size_t n = left < sizeof(block) ? left : sizeof(block);
+			if (write(fd, block, n) != (ssize_t)n)
+			{
+				perror(path);
+				close(fd);
+				return NULL;
+			}
+			left -= n;
+		}
+	}
+
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (p == MAP_FAILED)
+	{
+		perror(path);
+		return NULL;
+	}
+	return p;
+}
+
+bool w25q_open(const char *path)
+{
+	bool created;
+
+	w25q_array = map_file(path, W25Q_SIZE, 0xFF, &created);
+	if (w25q_array == NULL)
+		return false;
+
+	char nv_path[4096];
+	snprintf(nv_path, sizeof(nv_path), "%s.nv", path);
+
+	nv = map_file(nv_path, sizeof(w25q_nv_t), 0xFF, &created);
+	if (nv == NULL)
+		return false;
+
+	if (created || nv->magic != NV_MAGIC)
+	{
+		/* Factory state: unprotected, QE set, security registers erased */
+		nv->magic = NV_MAGIC;
+		nv->status[0] = 0x00;
+		nv->status[1] = 0x02;
+		nv->status[2] = 0x60;
+		if (getrandom(nv->uid, sizeof(nv->uid), 0) != sizeof(nv->uid))
+			memset(nv->uid, 0x5A, sizeof(nv->uid));
+		memset(nv->security, 0xFF, sizeof(nv->security));
+	}
+
+	/* WEL and BUSY are volatile, a power cycle clears them */
+	nv->status[0] &= ~(SR1_WEL | SR1_BUSY);
+
+	return true;
+}
+
+void w25q_set_timing(w25q_timing_t t)
+{
+	timing = t;
+}
+
+const w25q_nv_t *w25q_state(void)
+{
+	return nv;
+}
+
+void w25q_close(void)
+{
+	if (w25q_array)
+		munmap(w25q_array, W25Q_SIZE);
+	if (nv)
+		munmap(nv, sizeof(w25q_nv_t));
+	w25q_array = NULL;
+	nv = NULL;
+}
+
+//--------------------------------------------------------------------+
+// Array operations, applied when CS goes high
+//--------------------------------------------------------------------+
+
+static bool is_protected(uint32_t addr)
+{
+	uint8_t sr1 = nv->status[0];
+	uint32_t bp = (sr1 >> SR1_BP_SHIFT) & 7;
+	uint32_t size;
+
+	if (bp == 0)
+		size = 0;
+	else if (bp >= 6)
+		size = W25Q_SIZE;
+	else if (sr1 & SR1_SEC)
+		size = (4 * 1024) << (bp > 4 ? 3 : bp - 1);
+	else
+		size = (256 * 1024) << (bp - 1);
+
+	bool in = (sr1 & SR1_TB) ? (addr < size) : (addr >= W25Q_SIZE - size);
+	return (nv->status[1] & SR2_CMP) ? !in : in;
+}
+
+/* The protected area always starts at one end, so checking both ends of a range is enough */
+static bool range_protected(uint32_t addr, uint32_t len)
+{
+	return is_protected(addr) || is_protected(addr + len - 1);
+}
+
+static bool erase(uint32_t size)
+{
+	uint32_t addr = spi.address & ~(size - 1) & (W25Q_SIZE - 1);
+
+	if (spi.count < 4 || range_protected(addr, size))
+		return false;
+
+	memset(w25q_array + addr, 0xFF, size);
+	return true;
+}
+
+static bool page_program(void)
+{
+	uint32_t page = spi.address & ~(W25Q_PAGE_SIZE - 1) & (W25Q_SIZE - 1);
+
+	if (spi.length == 0 || range_protected(page, W25Q_PAGE_SIZE))
+		return false;
+
+	/* Bits only ever go from 1 to 0, untouched bytes are latched as 0xFF */
+	for (uint32_t i = 0; i < W25Q_PAGE_SIZE; i++)
+		w25q_array[page + i] &= spi.data[i];
+	return true;
+}
+
+/* Security registers are addressed as page << 12, pages 1 to 3 */
+static int security_page(void)
+{
+	int page = (spi.address >> 12) & 0xF;
+	return (page >= 1 && page <= W25Q_SECURITY_PAGES) ? page - 1 : -1;
+}
+
+static bool security_locked(int page)
+{
+	return nv->status[1] & (1 << (SR2_LB_SHIFT + page));
+}
+
+static void status_write(int first)
+{
+	for (uint32_t i = 0; i < spi.length && first + i < 3; i++)
+	{
+		uint8_t mask = sr_writable[first + i];
+		uint8_t value = (nv->status[first + i] & ~mask) | (spi.data[i] & mask);
+
+		/* Lock bits can't be cleared once set */
+		if (first + i == 1)
+			value |= nv->status[1] & (7 << SR2_LB_SHIFT);
+
+		nv->status[first + i] = value;
+	}
+}
+
+static void power_down(bool down)
+{
+	if (down == powered_down)
+		return;
+
+	powered_down = down;
+	mprotect(w25q_array, W25Q_SIZE, down ? PROT_NONE : PROT_READ | PROT_WRITE);
+
+	if (!down && timing != W25Q_TIMING_NONE)
+		awake_at = host_cycles() + (uint64_t)WAKE_US * (CONFIG_CLOCK_FREQUENCY / 1000000);
+}
+
+/* The array changes straight away, BUSY (and WEL with it) clears once the operation has had its time */
+static void start_busy(int op)
+{
+	if (timing == W25Q_TIMING_NONE)
+	{
+		nv->status[0] &= ~SR1_WEL;
+		return;
+	}
+
+	uint32_t us = op_us[op][timing == W25Q_TIMING_MAX];
+	busy_until = host_cycles() + (uint64_t)us * (CONFIG_CLOCK_FREQUENCY / 1000000);
+	nv->status[0] |= SR1_BUSY;
+}
+
+static bool busy(void)
+{
+	if ((nv->status[0] & SR1_BUSY) && host_cycles() >= busy_until)
+		nv->status[0] &= ~(SR1_BUSY | SR1_WEL);
+
+	return nv->status[0] & SR1_BUSY;
+}
+
+/* Whether the part acts on an opcode at all */
+static bool accepts(uint8_t cmd)
+{
+	/* While busy only the status registers can be read */
+	if (busy())
+		return cmd == 0x05 || cmd == 0x35 || cmd == 0x15;
+
+	if (host_cycles() < awake_at)
+		return false;
+
+	/* With QE clear IO2 and IO3 are /WP and /HOLD */
+	if ((cmd == 0x32 || cmd == 0x6B) && !(nv->status[1] & SR2_QE))
+		return false;
+
+	return true;
+}
+
+/* CS high, commands that change the array or the status registers run here */
+static void execute(void)
+{
+	bool wel = nv->status[0] & SR1_WEL;
+	int op = -1;
+
+	w25q_stats.commands++;
+
+	if (powered_down)
+	{
+		if (spi.cmd == 0xAB)
+			power_down(false);
+		return;
+	}
+
+	if (spi.ignored)
+	{
+		w25q_stats.ignored++;
+		return;
+	}
+
+	switch (spi.cmd)
+	{
+	case 0x06:
+		nv->status[0] |= SR1_WEL;
+		return;
+	case 0x04:
+		nv->status[0] &= ~SR1_WEL;
+		return;
+	case 0xB9:
+		power_down(true);
+		return;
+	case 0x02:
+	case 0x32:
+		if (wel && page_program())
+			op = OP_PROGRAM;
+		break;
+	case 0x20:
+		if (wel && erase(4 * 1024))
+			op = OP_ERASE_4K;
+		break;
+	case 0x52:
+		if (wel && erase(32 * 1024))
+			op = OP_ERASE_32K;
+		break;
+	case 0xD8:
+		if (wel && erase(64 * 1024))
+			op = OP_ERASE_64K;
+		break;
+	case 0x60:
+	case 0xC7:
+		if (wel && !range_protected(0, W25Q_SIZE))
+		{
+			memset(w25q_array, 0xFF, W25Q_SIZE);
+			op = OP_ERASE_CHIP;
+		}
+		break;
+	case 0x01:
+	case 0x31:
+	case 0x11:
+		if (wel)
+		{
+			status_write(spi.cmd == 0x01 ? 0 : spi.cmd == 0x31 ? 1 : 2);
+			op = OP_STATUS;
+		}
+		break;
+	case 0x42:
+	{
+		int page = security_page();
+		if (wel && page >= 0 && !security_locked(page))
+		{
+			for (uint32_t i = 0; i < W25Q_PAGE_SIZE; i++)
+				nv->security[page][i] &= spi.data[i];
+			op = OP_PROGRAM;
+		}
+	}
+	break;
+	case 0x44:
+	{
+		int page = security_page();
+		if (wel && page >= 0 && !security_locked(page))
+		{
+			memset(nv->security[page], 0xFF, W25Q_PAGE_SIZE);
+			op = OP_ERASE_4K;
+		}
+	}
+	break;
+	default:
+		/* Reads and anything unknown leave WEL alone */
+		return;
+	}
+
+	if (op >= 0)
+	{
+		start_busy(op);
+		return;
+	}
+
+	/* A write or erase that didn't run still ends with WEL cleared */
+	w25q_stats.ignored++;
+	nv->status[0] &= ~SR1_WEL;
+}
+
+//--------------------------------------------------------------------+
+// Byte level protocol
+//--------------------------------------------------------------------+
+
+/* Bytes of address that follow the opcode, dummy bytes after them, and the bus width of the data */
+static void command_format(uint8_t cmd, uint32_t *addr_bytes, uint32_t *dummy_bytes, uint32_t *data_width)
+{
+	*addr_bytes = 0;
+	*dummy_bytes = 0;
+	*data_width = 1;
+
+	switch (cmd)
+	{
+	case 0x32:
+		*addr_bytes = 3;
+		*data_width = 4;
+		break;
+	case 0x03:
+	case 0x02:
+	case 0x20:
+	case 0x52:
+	case 0xD8:
+	case 0x42:
+	case 0x44:
+	case 0x90:
+		*addr_bytes = 3;
+		break;
+	case 0x3B:
+		*addr_bytes = 3;
+		*dummy_bytes = 1;
+		*data_width = 2;
+		break;
+	case 0x6B:
+		*addr_bytes = 3;
+		*dummy_bytes = 1;
+		*data_width = 4;
+		break;
+	case 0x0B:
+	case 0x48:
+		*addr_bytes = 3;
+		*dummy_bytes = 1;
+		break;
+	case 0x4B:
+		*dummy_bytes = 4;
+		break;
+	case 0xAB:
+		*dummy_bytes = 3;
+		break;
+	default:
+		break;
+	}
+}
+
+static uint8_t clock_byte(uint8_t in)
+{
+	uint32_t n = spi.count++;
+
+	uint32_t addr_bytes, dummy_bytes, data_width;
+	command_format(n == 0 ? in : spi.cmd, &addr_bytes, &dummy_bytes, &data_width);
+
+	/* Opcode, address and dummy bytes all go out on one line */
+	if (spi.width != (n > addr_bytes + dummy_bytes ? data_width : 1))
+		spi.ignored = true;
+
+	if (n == 0)
+	{
+		spi.cmd = in;
+		spi.address = 0;
+		spi.length = 0;
+		spi.ignored |= !powered_down && !accepts(in);
+		if (in == 0x05 && (nv->status[0] & SR1_BUSY))
+			w25q_stats.busy_polls++;
+		memset(spi.data, 0xFF, sizeof(spi.data));
+		return 0xFF;
+	}
+
+	/* Asleep, only Release Power-down gets through */
+	if ((powered_down && spi.cmd != 0xAB) || spi.ignored)
+		return 0xFF;
+
+	if (n <= addr_bytes)
+	{
+		spi.address = (spi.address << 8) | in;
+		return 0xFF;
+	}
+	if (n <= addr_bytes + dummy_bytes)
+		return 0xFF;
+
+	/* Data phase, i counts bytes from its start */
+	uint32_t i = n - addr_bytes - dummy_bytes - 1;
+
+	switch (spi.cmd)
+	{
+	case 0x05:
+		return nv->status[0];
+	case 0x35:
+		return nv->status[1];
+	case 0x15:
+		return nv->status[2];
+	case 0x9F:
+		return (const uint8_t[]){0xEF, 0x40, 0x18}[i % 3];
+	case 0x90:
+		return (i & 1) ? 0x17 : 0xEF;
+	case 0xAB:
+		return 0x17;
+	case 0x4B:
+		return i < sizeof(nv->uid) ? nv->uid[i] : 0xFF;
+
+	case 0x03:
+	case 0x0B:
+	case 0x3B:
+	case 0x6B:
+		return w25q_array[(spi.address + i) & (W25Q_SIZE - 1)];
+
+	case 0x48:
+	{
+		int page = security_page();
+		return page >= 0 ? nv->security[page][(spi.address + i) & 0xFF] : 0xFF;
+	}
+
+	/* Page buffer wraps, the last 256 bytes sent are the ones programmed */
+	case 0x02:
+	case 0x32:
+	case 0x42:
+		spi.data[(spi.address + i) & 0xFF] = in;
+		spi.length++;
+		return 0xFF;
+
+	case 0x01:
+	case 0x31:
+	case 0x11:
+		if (i < sizeof(spi.data))
+			spi.data[i] = in;
+		spi.length++;
+		return 0xFF;
+
+	default:
+		return 0xFF;
+	}
+}
+
+//--------------------------------------------------------------------+
+// spiflash_core_master registers
+//--------------------------------------------------------------------+
+
+static void csr_access(void)
+{
+	w25q_stats.csr_accesses++;
+	host_elapse(HOST_CSR_CYCLES);
+}
+
+void spiflash_core_master_cs_write(uint32_t v)
+{
+	bool select = v & 1;
+
+	csr_access();
+
+	if (select && !spi.selected)
+	{
+		spi.count = 0;
+		spi.ignored = false;
+	}
+	else if (!select && spi.selected && spi.count > 0)
+		execute();
+
+	spi.selected = select;
+}
+
+/* Transfers are always a byte, the output enable mask follows the width */
+void spiflash_core_master_phyconfig_len_write(uint32_t v)
+{
+	(void)v;
+	csr_access();
+}
+
+void spiflash_core_master_phyconfig_width_write(uint32_t v)
+{
+	csr_access();
+	spi.width = v;
+}
+
+void spiflash_core_master_phyconfig_mask_write(uint32_t v)
+{
+	(void)v;
+	csr_access();
+}
+
+/* The shift time is charged when the byte is written, so the master is always ready */
+uint32_t spiflash_core_master_status_tx_ready_read(void)
+{
+	csr_access();
+	return 1;
+}
+
+uint32_t spiflash_core_master_status_rx_ready_read(void)
+{
+	csr_access();
+	return 1;
+}
+
+void spiflash_core_master_rxtx_write(uint32_t v)
+{
+	uint32_t clocks = 8 / (spi.width ? spi.width : 1);
+
+	csr_access();
+	w25q_stats.spi_clocks += clocks;
+	host_elapse(clocks * SPI_CLOCK_DIV);
+
+	spi.out = spi.selected ? clock_byte(v) : 0xFF;
+}
+
+uint32_t spiflash_core_master_rxtx_read(void)
+{
+	csr_access();
+	return spi.out;
+}
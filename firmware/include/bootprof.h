@@ -0,0 +1,57 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef BOOTPROF_H_
+#define BOOTPROF_H_
+
+#include <stdint.h>
+
+#include <generated/csr.h>
+
+#include <timing.h>
+
+/* Boot phase timestamps, in cycles since configuration, kept in the bootprof
+ * CSR block (gateware/rtl/bootprof.py). Read back with vendor request 7
+ * (extra/perf.py --boot). The layout is shared with the host script.
+ */
+enum
+{
+	BOOT_STAMP_START,		/* main() entered */
+	BOOT_STAMP_DECIDED,		/* button and magic checked */
+	BOOT_STAMP_VCCIO,		/* IO banks powered */
+	BOOT_STAMP_USB_RESET,	/* ULPI PHY out of reset */
+	BOOT_STAMP_USB_READY,	/* tinyusb initialised, pullup on */
+	BOOT_STAMP_BUS_RESET,	/* most recent bus reset, MOUNTED - BUS_RESET is the enumeration time */
+	BOOT_STAMP_MOUNTED,		/* host configured the device */
+	BOOT_STAMP_EXIT,		/* about to reconfigure into the user image */
+	BOOT_STAMP_COUNT,
+};
+
+typedef struct
+{
+	uint32_t clock_hz;
+	uint32_t stamp[BOOT_STAMP_COUNT];
+} bootprof_snapshot_t;
+
+const bootprof_snapshot_t *bootprof_snapshot(void);
+
+/* Through the generated accessors, the phase is a constant so this folds to one write */
+static inline void boot_stamp(unsigned phase, uint32_t cycles)
+{
+	switch (phase)
+	{
+	case 0: bootprof_stamp0_write(cycles); break;
+	case 1: bootprof_stamp1_write(cycles); break;
+	case 2: bootprof_stamp2_write(cycles); break;
+	case 3: bootprof_stamp3_write(cycles); break;
+	case 4: bootprof_stamp4_write(cycles); break;
+	case 5: bootprof_stamp5_write(cycles); break;
+	case 6: bootprof_stamp6_write(cycles); break;
+	case 7: bootprof_stamp7_write(cycles); break;
+	default: break;
+	}
+}
+
+#define BOOT_STAMP(phase) boot_stamp((phase), timing_cycles32())
+
+#endif /* BOOTPROF_H_ */
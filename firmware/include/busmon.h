@@ -0,0 +1,48 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef BUSMON_H_
+#define BUSMON_H_
+
+#include <stdint.h>
+
+#include <generated/soc.h>
+
+/* Wishbone bus counters (gateware/rtl/busmon.py), only built with --bus-stats.
+ *
+ * Per tap: acknowledged cycles and wait states, their sum is the time that
+ * bus was busy. The csr_bank tap is set to the SPI flash master's CSR bank by
+ * busmon_init(). Read back with vendor request 5 (extra/perf.py --bus). The
+ * layout is shared with the host script, only ever append.
+ */
+
+enum
+{
+	BUSMON_CPU_IBUS,
+	BUSMON_CPU_DBUS,
+	BUSMON_CSR,
+	BUSMON_CSR_BANK,
+	BUSMON_USB,
+	BUSMON_SPIFLASH,
+	BUSMON_TAP_COUNT,
+};
+
+typedef struct
+{
+	uint32_t cycles;
+	struct
+	{
+		uint32_t transactions;
+		uint32_t waits;
+	} tap[BUSMON_TAP_COUNT];
+} busmon_snapshot_t;
+
+#ifdef BUS_STATS
+
+void busmon_init(void);
+const busmon_snapshot_t *busmon_snapshot(void);
+void busmon_clear(void);
+
+#endif
+
+#endif /* BUSMON_H_ */
@@ -0,0 +1,59 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef DLOG_H_
+#define DLOG_H_
+
+#include <stdint.h>
+
+#include <generated/soc.h>
+
+/* Deferred binary logging, only built with --dlog.
+ *
+ * A call site records the id of its format string, a cycle stamp and its raw
+ * arguments into a ring, nothing is formatted on the CPU. The UART interrupt
+ * drains the ring, extra/dlog.py rebuilds the messages using the ELF.
+ *
+ * DLOG() format strings live in the .dlog section, which the linker keeps in
+ * the ELF but not in the image, so their id is an offset into it. tinyusb's
+ * TU_LOG goes through dlog_printf(), whose ids are .rodata addresses.
+ * Arguments are 32 bit words, cast pointers. A %s argument is resolved by the
+ * decoder, so it must point at a string constant.
+ *
+ * Record, little endian words:
+ *   0xA5 | flags << 8 | seq << 16, flags = nargs | DLOG_FMT_RODATA
+ *   format id
+ *   cycle stamp (low 32 bits)
+ *   nargs argument words
+ * seq counts every record, including dropped ones, so gaps are visible.
+ */
+
+#define DLOG_SYNC 0xA5
+#define DLOG_FMT_RODATA 0x80
+#define DLOG_MAX_ARGS 15
+
+#ifndef DLOG_BUFFER_SIZE
+#define DLOG_BUFFER_SIZE 2048 /* power of two */
+#endif
+
+#ifdef DEFERRED_LOG
+
+void dlog_write(uint32_t flags, uint32_t fmt, const uint32_t *args);
+int dlog_printf(const char *fmt, ...);
+void dlog_uart_isr(void);
+
+#define DLOG(fmt, ...)                                                                      \
+	do                                                                                      \
+	{                                                                                       \
+		static const char _dlog_fmt[] __attribute__((section(".dlog"), used)) = fmt;      \
+		const uint32_t _dlog_args[] = {0, ##__VA_ARGS__};                                   \
+		dlog_write(sizeof(_dlog_args) / sizeof(uint32_t) - 1, (uint32_t)_dlog_fmt, &_dlog_args[1]); \
+	} while (0)
+
+#else
+
+#define DLOG(fmt, ...)
+
+#endif
+
+#endif /* DLOG_H_ */
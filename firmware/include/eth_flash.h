@@ -0,0 +1,97 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef ETH_FLASH_H_
+#define ETH_FLASH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <generated/soc.h>
+
+#include "sched.h"
+
+/* Image push over UDP through the RGMII PHY, only built with --eth-flash.
+ * Blocks go through the same partitions and flash job as DFU. Whichever
+ * path starts a download first owns the flash, the other is refused until
+ * it ends. An Ethernet download also gives it up after ETH_FLASH_TIMEOUT_MS
+ * without a request.
+ *
+ * Every request gets exactly one reply, echoing its header, all fields are
+ * little endian. A download is START, DATA blocks 0..n-1, then END with seq
+ * set to n. DATA is go-back-N: the board holds ETH_FLASH_WINDOW blocks that
+ * are received but not yet programmed, accepts only the block it expects
+ * next and reports, in every reply, the next block it wants and how many are
+ * programmed and verified. END is answered BUSY until every block is.
+ *
+ * The address is ETH_IP, or with a netmask other than /32 the network part
+ * of ETH_IP and the host part from crc32() of the flash UUID, so one
+ * bitstream serves a whole rack. extra/eth_flash.py works it out from the
+ * USB serial number.
+ */
+
+#define ETH_FLASH_MAGIC 0x4642 /* "BF" */
+#define ETH_FLASH_BLOCK_SIZE 1024
+#define ETH_FLASH_WINDOW 2
+#define ETH_FLASH_TIMEOUT_MS 5000
+
+enum
+{
+	ETH_FLASH_OP_INFO,   /* serial number, no state change */
+	ETH_FLASH_OP_START,  /* begin a download to partition alt */
+	ETH_FLASH_OP_DATA,   /* block seq, followed by up to ETH_FLASH_BLOCK_SIZE bytes */
+	ETH_FLASH_OP_END,    /* seq blocks were sent, manifest once they are programmed */
+	ETH_FLASH_OP_REBOOT, /* hand over to the user bitstream */
+};
+
+enum
+{
+	ETH_FLASH_OK,
+	ETH_FLASH_BUSY,		   /* flash is busy, the window is full or DFU owns the flash, retry */
+	ETH_FLASH_ERR_ADDRESS, /* unknown partition, or the image is too large for it */
+	ETH_FLASH_ERR_VERIFY,  /* a block read back wrong, START again */
+	ETH_FLASH_ERR_STATE,   /* DATA or END without a START */
+};
+
+typedef struct __attribute__((packed))
+{
+	uint16_t magic;
+	uint8_t op;
+	uint8_t alt;
+	uint32_t seq;
+} eth_flash_header_t;
+
+typedef struct __attribute__((packed))
+{
+	eth_flash_header_t header;
+	uint8_t status;
+	uint8_t reserved[3];
+	uint32_t next;		/* next DATA block accepted */
+	uint32_t committed; /* blocks programmed and verified */
+	char serial[20];	/* flash UUID, formatted like the USB serial number */
+} eth_flash_reply_t;
+
+/* Provided by main.c, shared with the DFU callbacks */
+enum
+{
+	DOWNLOAD_NONE,
+	DOWNLOAD_DFU,
+	DOWNLOAD_ETH,
+};
+
+bool download_claim(uint8_t owner);
+void download_release(uint8_t owner);
+bool partition_write_address(uint8_t alt, uint32_t offset, uint32_t *address);
+void partition_manifest(uint8_t alt);
+
+#ifdef ETH_FLASH
+
+extern sched_task_t eth_flash_task;
+
+/* Before timer_init(), eth_init() busy waits for the PHY reset */
+void eth_flash_init(void);
+void eth_flash_isr(void);
+
+#endif
+
+#endif /* ETH_FLASH_H_ */
@@ -11,13 +11,23 @@ void spi_read_uuid(uint8_t* uuid);
 uint32_t spiId(uint8_t*);
 
 
+uint32_t spiflash_read_status_register(void);
+uint32_t spiflash_read_status2_register(void);
+void spiflash_write_enable(void);
+void spiflash_page_program(uint32_t addr, const uint8_t *data, int len);
+void spiflash_sector_erase(uint32_t addr);
+
 int spiflash_write_stream(uint32_t addr, uint8_t *stream, int len);
 void spiflash_read_uuid(uint8_t* uuid);
 bool spiflash_protection_read(void);
 void spiflash_protection_write(bool lock);
+void spiflash_quad_enable(void);
 void spiflash_read_security_register(uint8_t security_page, uint8_t* buff);
+void spiflash_read_security_register_len(uint8_t security_page, uint8_t* buff, int len);
 void spiflash_write_security_register(uint8_t security_page, uint8_t* buff);
 void spiflash_erase_security_register(uint8_t security_page);
+void spiflash_power_down(void);
+void spiflash_release_power_down(void);
 
 
 #define FLASH_64K_BLOCK_ERASE_SIZE (64*1024)
@@ -0,0 +1,45 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef FLASH_JOB_H_
+#define FLASH_JOB_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sched.h"
+
+/* Resumable flash write: erase (when the block starts a 64K sector), program,
+ * then verify against the source buffer. Runs as a scheduler task one SPI
+ * operation at a time, so USB keeps being serviced while the flash is busy.
+ * XIP builds are the exception, code can't be fetched from a busy flash so
+ * erase and program only return once it is idle again. They poll with
+ * interrupts enabled, so USB events are still taken and queued.
+ */
+
+enum
+{
+	FLASH_JOB_OK = 0,
+	FLASH_JOB_ERR_VERIFY,
+};
+
+typedef struct
+{
+	uint32_t address;
+	const uint8_t *data;
+	uint32_t length;
+
+	/* Invoked from task context once the job has finished */
+	void (*done)(int status);
+
+	/* Private */
+	uint8_t state;
+	uint32_t offset;
+} flash_job_t;
+
+extern sched_task_t flash_job_task;
+
+void flash_job_start(flash_job_t *job);
+bool flash_job_busy(void);
+
+#endif /* FLASH_JOB_H_ */
@@ -0,0 +1,61 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef GW_SLOTS_H_
+#define GW_SLOTS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <generated/soc.h>
+
+/* A/B gateware slots, only built with --ab-slots.
+ *
+ * The bootloader bitstream hands over to 0x200000 (ecppack --bootaddr). With
+ * slots enabled that sector holds a jump stub, the same JUMP command ecppack
+ * emits for --bootaddr, pointing at slot A or B. Switching slots rewrites the
+ * stub only, so rollback is a single sector erase and a 20 byte program.
+ *
+ * The boot record lives in security register 2:
+ *   active : slot known to boot, GW_SLOT_NONE before the first confirm
+ *   trial  : freshly written slot the stub points at, GW_SLOT_NONE otherwise
+ *   boots  : bootloader passes since the trial slot was selected
+ *
+ * A trial slot is confirmed by the host (vendor request) once the new image
+ * is known to work. After GW_SLOT_MAX_TRIAL_BOOTS unconfirmed boots the stub
+ * is pointed back at the active slot.
+ */
+
+#define GW_SLOT_STUB_ADDRESS 0x200000
+#define GW_SLOT_A_ADDRESS 0x210000
+#define GW_SLOT_B_ADDRESS 0x500000
+#define GW_SLOT_LENGTH 0x2F0000
+
+#define GW_SLOT_A 0
+#define GW_SLOT_B 1
+#define GW_SLOT_NONE 0xFF
+
+#define GW_SLOT_MAX_TRIAL_BOOTS 3
+
+typedef struct
+{
+	uint32_t magic;
+	uint8_t active;
+	uint8_t trial;
+	uint8_t boots;
+	uint8_t reserved;
+} gw_slot_record_t;
+
+#ifdef GATEWARE_AB_SLOTS
+
+void gw_slots_init(void);
+uint32_t gw_slots_download_address(void);
+void gw_slots_set_trial(void);
+bool gw_slots_confirm(void);
+void gw_slots_rollback(void);
+void gw_slots_boot(void);
+const gw_slot_record_t *gw_slots_record(void);
+
+#endif
+
+#endif /* GW_SLOTS_H_ */
@@ -0,0 +1,62 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef IRQ_STATS_H_
+#define IRQ_STATS_H_
+
+#include <stdint.h>
+
+#include <generated/soc.h>
+
+/* Per source interrupt latency and handler duration, in sys clock cycles.
+ *
+ * Latency runs from the gateware timestamp of the interrupt being raised to
+ * the start of that source's handler, so it includes the trap entry and any
+ * handler dispatched ahead of it. Histograms use power of two buckets, the
+ * last bucket collects everything above it. Only built with --irq-stats.
+ * Read back and reset with vendor request 6 (extra/perf.py --irq). The layout
+ * is shared with the host script, only ever append sources.
+ */
+
+enum
+{
+	IRQ_SRC_USB,
+	IRQ_SRC_TIMER,
+	IRQ_SRC_UART,
+	IRQ_SRC_COUNT,
+};
+
+#define IRQ_STATS_BUCKETS 16
+
+typedef struct
+{
+	uint32_t count;
+	uint32_t latency_max;
+	uint32_t duration_max;
+	uint32_t latency_hist[IRQ_STATS_BUCKETS];
+	uint32_t duration_hist[IRQ_STATS_BUCKETS];
+} irq_source_stats_t;
+
+#ifdef IRQ_STATS
+
+#include <timing.h>
+
+extern irq_source_stats_t irq_stats[IRQ_SRC_COUNT];
+
+void irq_stats_record(unsigned src, uint32_t latency, uint32_t duration);
+const irq_source_stats_t *irq_stats_snapshot(void);
+void irq_stats_reset(void);
+
+#define IRQ_STATS_ENTRY() uint32_t _irq_stamp = cycles_irq_stamp_read(), _irq_start
+#define IRQ_STATS_BEGIN() _irq_start = timing_cycles32()
+#define IRQ_STATS_END(src) irq_stats_record((src), _irq_start - _irq_stamp, timing_cycles32() - _irq_start)
+
+#else
+
+#define IRQ_STATS_ENTRY()
+#define IRQ_STATS_BEGIN()
+#define IRQ_STATS_END(src)
+
+#endif
+
+#endif /* IRQ_STATS_H_ */
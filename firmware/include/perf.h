@@ -0,0 +1,39 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef PERF_H_
+#define PERF_H_
+
+#include <stdint.h>
+
+/* Update path counters, always built so production boards can report them.
+ *
+ * Counts and cycle totals accumulate until reset. Cycles are sys clock cycles
+ * measured with the gateware cycle counter, an erase or program is timed from
+ * its command to the status poll that sees WIP clear. Read back and reset with
+ * vendor request 3 (extra/perf.py). The layout is shared with the host script,
+ * only ever append fields.
+ */
+
+typedef struct
+{
+	uint32_t clock_hz;        /* filled in by perf_snapshot() */
+	uint32_t usb_rx_bytes;    /* completed OUT transfers, all endpoints */
+	uint32_t dnload_count;    /* DFU_DNLOAD blocks handed to the flash job */
+	uint32_t getstatus_count; /* DFU_GETSTATUS SETUP packets */
+	uint32_t erase_count;
+	uint32_t program_count;
+	uint32_t poll_count;      /* status register reads waiting on WIP */
+	uint32_t reserved;
+	uint64_t erase_cycles;
+	uint64_t program_cycles;
+	uint64_t verify_cycles;   /* read back compare */
+	uint64_t uptime_cycles;   /* filled in by perf_snapshot() */
+} perf_counters_t;
+
+extern perf_counters_t perf;
+
+const perf_counters_t *perf_snapshot(void);
+void perf_reset(void);
+
+#endif /* PERF_H_ */
@@ -0,0 +1,45 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Cooperative run-to-completion scheduler.
+ *
+ * Tasks are kept sorted by priority (0 runs first). Every pass of the scheduler
+ * walks the list once and runs each task whose deadline has passed, so a task
+ * registered at priority 0 with no period (USB) runs between every step of any
+ * lower priority work. Long running work must be split into short steps that
+ * keep their state between calls.
+ *
+ * Tasks with a period of SCHED_EVENT only run after sched_wake(), which is
+ * safe to call from an ISR. When a pass finds nothing due the scheduler calls
+ * board_idle() so the board can sleep until the next deadline or interrupt.
+ */
+
+#define SCHED_EVENT 0xFFFFFFFF
+
+typedef struct sched_task
+{
+	void (*run)(struct sched_task *task);
+	uint8_t priority;
+	uint32_t period_ms; /* 0: run on every pass */
+	volatile uint32_t next_ms; /* deadline of the next run */
+	volatile bool parked;	   /* SCHED_EVENT task waiting for sched_wake() */
+	struct sched_task *next;
+} sched_task_t;
+
+#define SCHED_TASK(_run, _priority, _period_ms) \
+	{.run = (_run), .priority = (_priority), .period_ms = (_period_ms)}
+
+void sched_add(sched_task_t *task);
+void sched_delay(sched_task_t *task, uint32_t ms);
+void sched_wake(sched_task_t *task);
+uint32_t sched_idle_ms(void);
+void sched_run(void);
+void sched_stop(void);
+
+#endif /* SCHED_H_ */
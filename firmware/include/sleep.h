@@ -7,5 +7,6 @@
 #define SLEEP_H__
 
 void msleep(int ms);
+void udelay(int us);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,71 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef TIMING_H_
+#define TIMING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <generated/csr.h>
+
+/* Time keeping on top of the free running 64-bit cycle counter in the SoC.
+ * Nothing here touches timer0.
+ */
+
+#define TIMING_CYCLES_PER_US (CONFIG_CLOCK_FREQUENCY / 1000000)
+#define TIMING_CYCLES_PER_MS (CONFIG_CLOCK_FREQUENCY / 1000)
+
+/* Low 32 bits only, wraps every ~71s at 60MHz. Good for short intervals. */
+static inline uint32_t timing_cycles32(void)
+{
+	return cycles_low_read();
+}
+
+static inline uint64_t timing_cycles(void)
+{
+	uint32_t hi, lo;
+
+	/* Retry if the low word wrapped between the reads */
+	do
+	{
+		hi = cycles_high_read();
+		lo = cycles_low_read();
+	} while (hi != cycles_high_read());
+
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t timing_us(void)
+{
+	return timing_cycles() / TIMING_CYCLES_PER_US;
+}
+
+static inline uint64_t timing_deadline_us(uint32_t us)
+{
+	return timing_cycles() + (uint64_t)us * TIMING_CYCLES_PER_US;
+}
+
+static inline uint64_t timing_deadline_ms(uint32_t ms)
+{
+	return timing_cycles() + (uint64_t)ms * TIMING_CYCLES_PER_MS;
+}
+
+static inline bool timing_expired(uint64_t deadline)
+{
+	return timing_cycles() >= deadline;
+}
+
+static inline uint32_t timing_elapsed_cycles(uint64_t start)
+{
+	return (uint32_t)(timing_cycles() - start);
+}
+
+static inline uint32_t timing_elapsed_us(uint64_t start)
+{
+	return (uint32_t)((timing_cycles() - start) / TIMING_CYCLES_PER_US);
+}
+
+void timing_wait_until(uint64_t deadline);
+
+#endif /* TIMING_H_ */
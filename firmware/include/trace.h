@@ -0,0 +1,77 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+#include <generated/soc.h>
+
+/* Binary event trace, only built with --trace.
+ *
+ * Each event is 8 bytes: the low 32 bits of the cycle counter, then the event
+ * id in the top byte and a 24 bit argument (flash address, length, request)
+ * below it. Events go into a ring in SRAM and are drained by the host with
+ * vendor request 4 (extra/trace.py). A full ring drops new events and counts
+ * them, so what the host sees is always a contiguous prefix.
+ *
+ * The event ids are shared with extra/trace.py, only ever append.
+ */
+
+enum
+{
+	TRACE_SETUP,		 /* bmRequestType << 8 | bRequest */
+	TRACE_XFER_OUT,		 /* ep << 16 | bytes */
+	TRACE_XFER_IN,		 /* ep << 16 | bytes */
+	TRACE_BUS_RESET,
+	TRACE_SUSPEND,
+	TRACE_RESUME,
+	TRACE_DNLOAD,		 /* block number */
+	TRACE_DNLOAD_DONE,	 /* DFU status */
+	TRACE_ERASE_START,	 /* flash address */
+	TRACE_ERASE_END,	 /* flash address */
+	TRACE_PROGRAM_START, /* flash address */
+	TRACE_PROGRAM_END,	 /* flash address after the page */
+	TRACE_VERIFY_START,	 /* flash address */
+	TRACE_VERIFY_END,	 /* flash address */
+	TRACE_IDLE,			 /* ms until the next deadline, 0xFFFFFF for none */
+	TRACE_WAKE,
+};
+
+typedef struct
+{
+	uint32_t stamp;
+	uint32_t event; /* id << 24 | argument */
+} trace_event_t;
+
+/* Returned by wValue 0 of the vendor request */
+typedef struct
+{
+	uint32_t clock_hz;
+	uint32_t capacity;
+	uint32_t count;
+	uint32_t dropped;
+} trace_info_t;
+
+#ifndef TRACE_ENTRIES
+#define TRACE_ENTRIES 512
+#endif
+
+#ifdef EVENT_TRACE
+
+void trace_emit(uint32_t event);
+const trace_info_t *trace_info(void);
+const trace_event_t *trace_peek(uint32_t max, uint32_t *count);
+void trace_consume(uint32_t count);
+void trace_clear(void);
+
+#define TRACE(id, arg) trace_emit(((uint32_t)(id) << 24) | ((uint32_t)(arg) & 0xFFFFFF))
+
+#else
+
+#define TRACE(id, arg)
+
+#endif
+
+#endif /* TRACE_H_ */
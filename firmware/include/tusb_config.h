@@ -53,6 +53,12 @@
 // CFG_TUSB_DEBUG is defined by compiler in DEBUG build
 // #define CFG_TUSB_DEBUG           0
 
+// --dlog builds hand TU_LOG to the deferred logger instead of printf
+#include <generated/soc.h>
+#ifdef DEFERRED_LOG
+#define CFG_TUSB_DEBUG_PRINTF     dlog_printf
+#endif
+
 /* USB DMA on some MCUs can only access a specific SRAM region with restriction on alignment.
  * Tinyusb use follows macros to declare transferring memory so that they can be put
  * into those specific section.
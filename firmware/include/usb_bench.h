@@ -0,0 +1,35 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef USB_BENCH_H_
+#define USB_BENCH_H_
+
+/* Gadget-zero style vendor interface used to benchmark the raw USB path.
+ * Only built when the gateware is generated with --usb-bench.
+ *
+ * EP1 IN  : source, endless stream of a counting pattern
+ * EP1 OUT : sink, data is discarded
+ * EP2 OUT : loopback, each transfer is echoed back on EP2 IN. A transfer ends
+ *           on a short packet (or ZLP) or after 1024 bytes, the host has to
+ *           follow a write that ends on a full packet below that with a ZLP.
+ */
+
+#define USB_BENCH_EP_SOURCE    0x81
+#define USB_BENCH_EP_SINK      0x01
+#define USB_BENCH_EP_LOOP_OUT  0x02
+#define USB_BENCH_EP_LOOP_IN   0x82
+
+#define TUD_BENCH_DESC_LEN    (9 + 4*7)
+
+// Interface number, string index, bulk endpoint size
+#define TUD_BENCH_DESCRIPTOR(_itfnum, _stridx, _epsize) \
+  /* Interface */\
+  9, TUSB_DESC_INTERFACE, _itfnum, 0, 4, TUSB_CLASS_VENDOR_SPECIFIC, 0x00, 0x00, _stridx,\
+  /* Source / sink */\
+  7, TUSB_DESC_ENDPOINT, USB_BENCH_EP_SOURCE, TUSB_XFER_BULK, U16_TO_U8S_LE(_epsize), 0,\
+  7, TUSB_DESC_ENDPOINT, USB_BENCH_EP_SINK, TUSB_XFER_BULK, U16_TO_U8S_LE(_epsize), 0,\
+  /* Loopback */\
+  7, TUSB_DESC_ENDPOINT, USB_BENCH_EP_LOOP_OUT, TUSB_XFER_BULK, U16_TO_U8S_LE(_epsize), 0,\
+  7, TUSB_DESC_ENDPOINT, USB_BENCH_EP_LOOP_IN, TUSB_XFER_BULK, U16_TO_U8S_LE(_epsize), 0
+
+#endif /* USB_BENCH_H_ */
@@ -0,0 +1,12 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef USB_DESCRIPTORS_H_
+#define USB_DESCRIPTORS_H_
+
+/* Builds the UTF-16 string descriptors, reading the flash UUID for the
+ * serial number. Call once before tusb_init().
+ */
+void usb_descriptors_init(void);
+
+#endif /* USB_DESCRIPTORS_H_ */
@@ -0,0 +1,43 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+#ifndef XIP_H_
+#define XIP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <generated/soc.h>
+
+/* Execute-in-place firmware, only built with --xip.
+ *
+ * The integrated ROM keeps crt0, main (interrupt, scheduler glue and boot
+ * decision), the DCD, tinyusb's event queue and everything that drives the
+ * flash. The rest of the USB stack and the descriptors are linked into the
+ * xip region at the top of the bootloader partition (linker-xip.ld) and run
+ * from the memory mapped flash through the CPU instruction cache.
+ *
+ * Bootloader partition:
+ *   0x000000 : bootloader bitstream
+ *   FIRMWARE_XIP_STAGING_OFFSET : XIP image as downloaded with the bitstream
+ *   FIRMWARE_XIP_OFFSET : XIP image the code runs from
+ *
+ * DFU never writes the active copy. xip_prepare() checks it against the build
+ * id of this ROM and its CRC, and copies the staging area over it after an
+ * update. The fast boot path never touches XIP code.
+ */
+
+#define XIP_MAGIC 0x50495846 /* "FXIP" */
+
+/* Leads the image, after the length and CRC words written by mkmscimg --fbi */
+typedef struct
+{
+	uint32_t magic;
+	uint32_t build_id;
+} xip_header_t;
+
+#ifdef FIRMWARE_XIP
+bool xip_prepare(void);
+#endif
+
+#endif /* XIP_H_ */
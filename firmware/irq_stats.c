@@ -0,0 +1,57 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <irq.h>
+
+#include "irq_stats.h"
+
+#ifdef IRQ_STATS
+
+irq_source_stats_t irq_stats[IRQ_SRC_COUNT];
+
+/* The control transfer goes out over several packets, while app_isr keeps recording */
+static irq_source_stats_t snapshot[IRQ_SRC_COUNT];
+
+static inline unsigned bucket(uint32_t cycles)
+{
+	unsigned b = 31 - __builtin_clz(cycles | 1);
+	return b < IRQ_STATS_BUCKETS ? b : IRQ_STATS_BUCKETS - 1;
+}
+
+/* Called from app_isr, keep it short */
+void irq_stats_record(unsigned src, uint32_t latency, uint32_t duration)
+{
+	irq_source_stats_t *s = &irq_stats[src];
+
+	s->count++;
+	s->latency_hist[bucket(latency)]++;
+	s->duration_hist[bucket(duration)]++;
+
+	if (latency > s->latency_max)
+		s->latency_max = latency;
+	if (duration > s->duration_max)
+		s->duration_max = duration;
+}
+
+const irq_source_stats_t *irq_stats_snapshot(void)
+{
+	unsigned int ie = irq_getie();
+	irq_setie(0);
+	memcpy(snapshot, irq_stats, sizeof(snapshot));
+	irq_setie(ie);
+	return snapshot;
+}
+
+void irq_stats_reset(void)
+{
+	unsigned int ie = irq_getie();
+	irq_setie(0);
+	memset(irq_stats, 0, sizeof(irq_stats));
+	irq_setie(ie);
+}
+
+#endif
@@ -34,25 +34,49 @@
 #include "device/dcd.h"
 #include "dcd_eptri.h"
 #include "generated/luna_usb.h"
+#include "generated/soc.h"
+#include "perf.h"
+#include "trace.h"
 
 //--------------------------------------------------------------------+
 // SIE Command
 //--------------------------------------------------------------------+
 
-#define EP_SIZE 64
+// Largest packet the gateware FIFOs can hold.
+#ifndef USB_MAX_PACKET_SIZE
+#define USB_MAX_PACKET_SIZE 64
+#endif
 #define EP_COUNT 16
 
-
-uint16_t volatile rx_buffer_offset[EP_COUNT];
-uint8_t* volatile rx_buffer[EP_COUNT];
-uint16_t volatile rx_buffer_max[EP_COUNT];
-
-volatile uint8_t tx_ep;
-volatile bool tx_active;
-volatile uint16_t tx_buffer_offset[EP_COUNT];
-uint8_t* volatile tx_buffer[EP_COUNT];
-volatile uint16_t tx_buffer_max[EP_COUNT];
-volatile uint8_t reset_count;
+// usb_status_events layout, one read gives us everything the ISR dispatches on.
+#define USB_STATUS_RESET        (1u << 0)
+#define USB_STATUS_SETUP        (1u << 1)
+#define USB_STATUS_IN           (1u << 2)
+#define USB_STATUS_OUT          (1u << 3)
+#define USB_STATUS_POWER        (1u << 4)
+#define USB_STATUS_OUT_EP(s)    (((s) >> 8) & 0xf)
+#define USB_STATUS_OUT_READY    (1u << 12)
+#define USB_STATUS_SUSPENDED    (1u << 13)
+#define USB_STATUS_OUT_COUNT(s) ((s) >> 16)
+
+// wMaxPacketSize of each endpoint, as opened by tinyusb.
+static uint16_t rx_max_packet[EP_COUNT];
+static uint16_t tx_max_packet[EP_COUNT];
+
+static uint16_t volatile rx_buffer_offset[EP_COUNT];
+static uint8_t* volatile rx_buffer[EP_COUNT];
+static uint16_t volatile rx_buffer_max[EP_COUNT];
+
+static volatile uint8_t tx_ep;
+static volatile bool tx_active;
+
+// Address from SET_ADDRESS, applied once its status stage has been sent.
+static volatile uint8_t pending_address;
+#define PENDING_ADDRESS_VALID 0x80
+static volatile uint16_t tx_buffer_offset[EP_COUNT];
+static uint8_t* volatile tx_buffer[EP_COUNT];
+static volatile uint16_t tx_buffer_max[EP_COUNT];
+static volatile uint8_t reset_count;
 
 //--------------------------------------------------------------------+
 // PIPE HELPER
@@ -73,8 +97,9 @@ static bool advance_tx_ep(void) {
 
 static void tx_more_data(void) {
 	// Send more data
-	uint8_t added_bytes;
-	for (added_bytes = 0; (added_bytes < EP_SIZE) && (tx_buffer_offset[tx_ep] < tx_buffer_max[tx_ep]); added_bytes++) {
+	uint16_t added_bytes;
+	uint16_t max_packet = tx_max_packet[tx_ep];
+	for (added_bytes = 0; (added_bytes < max_packet) && (tx_buffer_offset[tx_ep] < tx_buffer_max[tx_ep]); added_bytes++) {
 		usb_in_ep_data_write(tx_buffer[tx_ep][tx_buffer_offset[tx_ep]++]);
 	}
 
@@ -100,6 +125,14 @@ static void process_tx(void) {
 
 		if (!advance_tx_ep())
 			tx_active = false;
+
+		// The status stage of SET_ADDRESS went out, switch over now.
+		if (xferred_ep == 0 && (pending_address & PENDING_ADDRESS_VALID)) {
+			usb_setup_address_write(pending_address & 0x7f);
+			pending_address = 0;
+		}
+
+		TRACE(TRACE_XFER_IN, (xferred_ep << 16) | xferred_bytes);
 		dcd_event_xfer_complete(0, tu_edpt_addr(xferred_ep, TUSB_DIR_IN), xferred_bytes, XFER_RESULT_SUCCESS, true);
 		if (!tx_active)
 			return;
@@ -109,8 +142,84 @@ static void process_tx(void) {
 	return;
 }
 
+#ifdef USB_OUT_EP_DOUBLE_BUFFERED
+
+// Copy the packet at the head of the hardware buffer queue into its transfer
+// buffer. Returns false if no transfer is queued on that endpoint yet, in which
+// case the packet stays parked in hardware until dcd_edpt_xfer() asks for it.
+//
+// Both hardware buffers are shared by every OUT endpoint, so a parked packet
+// holds up all the others, EP0 included. dcd_edpt_xfer() primes an endpoint
+// for exactly the packets its transfer can take and a short packet unprimes
+// it, so the gateware NAKs anything else. What can still park is a packet
+// the host sent in the few cycles between a short packet and its unprime.
+static bool rx_one_packet(uint32_t status) {
+	uint8_t rx_ep = USB_STATUS_OUT_EP(status);
+
+	if (rx_buffer[rx_ep] == NULL)
+		return false;
+
+	uint16_t packet_len = USB_STATUS_OUT_COUNT(status);
+	uint32_t current_offset = rx_buffer_offset[rx_ep];
+	for (uint16_t i = 0; i < packet_len; i++) {
+		uint8_t c = usb_out_ep_data_read();
+		if (current_offset < rx_buffer_max[rx_ep]) {
+			if (rx_buffer[rx_ep] != (volatile uint8_t *)0xffffffff)
+				rx_buffer[rx_ep][current_offset++] = c;
+		}
+	}
+
+	// Hand the buffer back, the receiver may already be filling the other one.
+	usb_out_ep_release_write(1);
+
+	rx_buffer_offset[rx_ep] += packet_len;
+	if (rx_buffer_offset[rx_ep] > rx_buffer_max[rx_ep])
+		rx_buffer_offset[rx_ep] = rx_buffer_max[rx_ep];
+
+	// Complete on a full buffer, or on any short packet (including a ZLP).
+	if ((rx_buffer_max[rx_ep] == rx_buffer_offset[rx_ep]) || (packet_len < rx_max_packet[rx_ep])) {
+		rx_buffer[rx_ep] = NULL;
+
+		// Give back the packets a short transfer didn't use.
+		usb_out_ep_epno_write(rx_ep);
+		usb_out_ep_prime_write(0);
+		uint16_t len = rx_buffer_offset[rx_ep];
+
+		perf.usb_rx_bytes += len;
+		TRACE(TRACE_XFER_OUT, (rx_ep << 16) | len);
+		dcd_event_xfer_complete(0, tu_edpt_addr(rx_ep, TUSB_DIR_OUT), len, XFER_RESULT_SUCCESS, true);
+	}
+
+	return true;
+}
+
 static void process_rx(void) {
-	uint8_t rx_ep = usb_out_ep_data_ep_read();
+	// Clear the pending IRQ before draining; a packet that lands in the other
+	// buffer while we work will raise it again.
+	usb_out_ep_ev_pending_write(usb_out_ep_ev_pending_read());
+
+	uint32_t status;
+	while ((status = usb_status_events_read()) & USB_STATUS_OUT_READY) {
+		if (!rx_one_packet(status))
+			return;
+	}
+}
+
+#else
+
+static void process_rx(uint32_t status) {
+	uint8_t rx_ep = USB_STATUS_OUT_EP(status);
+	uint16_t max_packet = rx_max_packet[rx_ep];
+
+	// Never opened, so there is nowhere to put it: drop the packet rather
+	// than divide by zero below, and let the other endpoints carry on.
+	if (max_packet == 0) {
+		while (usb_out_ep_have_read())
+			usb_out_ep_data_read();
+		usb_out_ep_enable_write(1);
+		usb_out_ep_ev_pending_write(usb_out_ep_ev_pending_read());
+		return;
+	}
 
 	// Drain the FIFO into the destination buffer
 	uint32_t total_read = 0;
@@ -132,14 +241,16 @@ static void process_rx(void) {
 	// If there's no more data, complete the transfer to tinyusb
 	if ((rx_buffer_max[rx_ep] == rx_buffer_offset[rx_ep])
 	// ZLP with less than the total amount of data
-	|| ((total_read == 0) && ((rx_buffer_offset[rx_ep] & 63) == 0))
+	|| ((total_read == 0) && ((rx_buffer_offset[rx_ep] % max_packet) == 0))
 	// Short read, but not a full packet
-	|| (((rx_buffer_offset[rx_ep] & 63) != 0) && (total_read < 66))) {
+	|| (((rx_buffer_offset[rx_ep] % max_packet) != 0) && (total_read < (max_packet + 2u)))) {
 
 		// Free up this buffer.
 		rx_buffer[rx_ep] = NULL;
 		uint16_t len = rx_buffer_offset[rx_ep];
 
+		perf.usb_rx_bytes += len;
+		TRACE(TRACE_XFER_OUT, (rx_ep << 16) | len);
 		dcd_event_xfer_complete(0, tu_edpt_addr(rx_ep, TUSB_DIR_OUT), len, XFER_RESULT_SUCCESS, true);
 	}
 	else {
@@ -151,6 +262,8 @@ static void process_rx(void) {
 	usb_out_ep_ev_pending_write(usb_out_ep_ev_pending_read());
 }
 
+#endif
+
 //--------------------------------------------------------------------+
 // CONTROLLER API
 //--------------------------------------------------------------------+
@@ -163,6 +276,7 @@ static void dcd_reset(void)
 	usb_out_ep_ev_enable_write(0);
 
 	// Reset the device address to 0.
+	pending_address = 0;
 	usb_setup_address_write(0);
 
 	// Reset all three FIFO handlers
@@ -180,6 +294,9 @@ static void dcd_reset(void)
 	tx_ep = 0;
 	tx_active = false;
 
+	rx_max_packet[0] = CFG_TUD_ENDPOINT0_SIZE;
+	tx_max_packet[0] = CFG_TUD_ENDPOINT0_SIZE;
+
 	// Enable all event handlers and clear their contents
 	usb_device_controller_ev_pending_write(0xff);
 	usb_setup_ev_pending_write(usb_setup_ev_pending_read());
@@ -206,6 +323,10 @@ static void clear_endpoints(void)
 		rx_buffer[i] = NULL;
 		tx_buffer[i] = NULL;
 	}
+
+	// The control endpoint is never opened through dcd_edpt_open().
+	rx_max_packet[0] = CFG_TUD_ENDPOINT0_SIZE;
+	tx_max_packet[0] = CFG_TUD_ENDPOINT0_SIZE;
 }
 
 
@@ -232,6 +353,10 @@ void dcd_init(uint8_t rhport)
 	usb_out_ep_ev_enable_write(1);
 	usb_setup_ev_enable_write(1);
 
+	// Suspend and resume events
+	usb_status_ev_pending_write(usb_status_ev_pending_read());
+	usb_status_ev_enable_write(3);
+
 	// Turn on the external pullup
 	usb_device_controller_connect_write(1);
 }
@@ -246,6 +371,8 @@ void dcd_int_enable(uint8_t rhport)
 	usb_setup_interrupt_enable();
 	usb_in_ep_interrupt_enable();
 	usb_out_ep_interrupt_enable();
+	// Suspend and resume, nothing else puts this line in the CPU mask.
+	usb_status_interrupt_enable();
 }
 
 void dcd_int_disable(uint8_t rhport)
@@ -255,19 +382,17 @@ void dcd_int_disable(uint8_t rhport)
 	usb_setup_interrupt_disable();
 	usb_in_ep_interrupt_disable();
 	usb_out_ep_interrupt_disable();
+	usb_status_interrupt_disable();
 }
 
 // Called when the device is given a new bus address.
 void dcd_set_address(uint8_t rhport, uint8_t dev_addr)
 {
-	// Respond with ACK status first before changing device address
+	// Respond with ACK status first before changing device address. The new
+	// address is activated from the IN completion of that status packet, so
+	// there's no need to spin here until it has gone out.
+	pending_address = dev_addr | PENDING_ADDRESS_VALID;
 	dcd_edpt_xfer(rhport, tu_edpt_addr(0, TUSB_DIR_IN), NULL, 0);
-
-	// Wait for the response packet to get sent
-	while (tx_active);
-
-	// Activate the new address
-	usb_setup_address_write(dev_addr);
 }
 
 // Called to remote wake up host when suspended (e.g hid keyboard)
@@ -298,16 +423,23 @@ bool dcd_edpt_open(uint8_t rhport, tusb_desc_endpoint_t const * p_endpoint_desc)
 	uint8_t ep_num = tu_edpt_number(p_endpoint_desc->bEndpointAddress);
 	uint8_t ep_dir = tu_edpt_dir(p_endpoint_desc->bEndpointAddress);
 
+	uint16_t max_packet = tu_edpt_packet_size(p_endpoint_desc);
+
 	if (p_endpoint_desc->bmAttributes.xfer == TUSB_XFER_ISOCHRONOUS)
 		return false; // Not supported
 
+	if ((max_packet == 0) || (max_packet > USB_MAX_PACKET_SIZE))
+		return false; // Won't fit in the gateware FIFOs
+
 	if (ep_dir == TUSB_DIR_OUT) {
+		rx_max_packet[ep_num] = max_packet;
 		rx_buffer_offset[ep_num] = 0;
 		rx_buffer_max[ep_num] = 0;
 		rx_buffer[ep_num] = NULL;
 	}
 
 	else if (ep_dir == TUSB_DIR_IN) {
+		tx_max_packet[ep_num] = max_packet;
 		tx_buffer_offset[ep_num] = 0;
 		tx_buffer_max[ep_num] = 0;
 		tx_buffer[ep_num] = NULL;
@@ -413,9 +545,25 @@ bool dcd_edpt_xfer (uint8_t rhport, uint8_t ep_addr, uint8_t* buffer, uint16_t t
 
 		// Enable receiving on this particular endpoint, if it hasn't been already.
 		usb_out_ep_epno_write(ep_num);
+#ifdef USB_OUT_EP_DOUBLE_BUFFERED
+		// Only as many packets as the transfer takes, at least one for a ZLP.
+		uint16_t max_packet = rx_max_packet[ep_num];
+		uint16_t packets = 1;
+		if (max_packet && total_bytes)
+			packets = (total_bytes + max_packet - 1) / max_packet;
+		usb_out_ep_prime_write(packets);
+#else
 		usb_out_ep_prime_write(1);
+#endif
 		usb_out_ep_enable_write(1);
 
+#ifdef USB_OUT_EP_DOUBLE_BUFFERED
+		// A packet for this endpoint may have arrived before the transfer was queued.
+		uint32_t status = usb_status_events_read();
+		if ((status & USB_STATUS_OUT_READY) && (USB_STATUS_OUT_EP(status) == ep_num))
+			process_rx();
+#endif
+
 		dcd_int_enable(0);
 	}
 	return true;
@@ -425,11 +573,16 @@ bool dcd_edpt_xfer (uint8_t rhport, uint8_t ep_addr, uint8_t* buffer, uint16_t t
 // ISR
 //--------------------------------------------------------------------+
 
-static void handle_out(void)
+static void handle_out(uint32_t status)
 {
 	// An "OUT" transaction just completed so we have new data.
 	// (But only if we can accept the data)
+#ifdef USB_OUT_EP_DOUBLE_BUFFERED
+	(void)status;
 	process_rx();
+#else
+	process_rx(status);
+#endif
 }
 
 static void handle_in(void)
@@ -444,9 +597,24 @@ static void handle_reset(void)
 
 	// This event means a bus reset occurred.  Reset everything, and
 	// abandon any further processing.
+	TRACE(TRACE_BUS_RESET, 0);
 	dcd_reset();
 }
 
+static void handle_power(uint32_t status)
+{
+	usb_status_ev_pending_write(usb_status_ev_pending_read());
+
+	// Report the current state, a quick suspend/resume pair collapses into one.
+	if (status & USB_STATUS_SUSPENDED) {
+		TRACE(TRACE_SUSPEND, 0);
+		dcd_event_bus_signal(0, DCD_EVENT_SUSPEND, true);
+	} else {
+		TRACE(TRACE_RESUME, 0);
+		dcd_event_bus_signal(0, DCD_EVENT_RESUME, true);
+	}
+}
+
 static void handle_setup(void)
 {
 	uint8_t setup_packet_bfr[8];
@@ -466,6 +634,10 @@ static void handle_setup(void)
 	// If we have 8 bytes, that's a full SETUP packet
 	// Otherwise, it was an RX error.
 	if (setup_length == 8) {
+		TRACE(TRACE_SETUP, (setup_packet_bfr[0] << 8) | setup_packet_bfr[1]);
+		// Class IN request to an interface with bRequest 3 is DFU_GETSTATUS
+		if (setup_packet_bfr[0] == 0xA1 && setup_packet_bfr[1] == 3)
+			perf.getstatus_count++;
 		dcd_event_setup_received(0, setup_packet_bfr, true);
 	}
 
@@ -478,22 +650,26 @@ void dcd_int_handler(uint8_t rhport)
 
 	// Handle USB interrupts for as long as any are pending.
 	while(1) {
-		if (usb_device_controller_ev_pending_read()) {
+		uint32_t status = usb_status_events_read();
+
+		if (status & USB_STATUS_RESET) {
 			handle_reset();
 		}
-		else if (usb_setup_ev_pending_read()) {
+		else if (status & USB_STATUS_SETUP) {
 			handle_setup();
 		}
-		else if (usb_in_ep_ev_pending_read()) {
+		else if (status & USB_STATUS_IN) {
 			handle_in();
-		} 
-		else if (usb_out_ep_ev_pending_read()) {
-			handle_out();
-		} 
+		}
+		else if (status & USB_STATUS_OUT) {
+			handle_out(status);
+		}
+		else if (status & USB_STATUS_POWER) {
+			handle_power(status);
+		}
 		else {
 			// No interrupts are pending -- we're done!
 			return;
-			
 		}
 	}
 }
@@ -16,7 +16,20 @@
 #include <uart.h>
 
 #include <sleep.h>
+#include <timing.h>
 #include <flash.h>
+#include <sched.h>
+#include <flash_job.h>
+#include <irq_stats.h>
+#include <bootprof.h>
+#include <usb_descriptors.h>
+#include <gw_slots.h>
+#include <xip.h>
+#include <perf.h>
+#include <trace.h>
+#include <dlog.h>
+#include <busmon.h>
+#include <eth_flash.h>
 
 #include "tusb.h"
 
@@ -33,10 +46,13 @@ memory_offest const alt_offsets[] = {
 	{.address = 0x200000, .length = 0x600000}, /* Main Gateware */
 	{.address = 0x800000, .length = 0x400000}, /* Main Firmawre */
 	{.address = 0xC00000, .length = 0x400000}, /* Extra */
+#ifdef FIRMWARE_XIP
+	{.address = 0x000000, .length = FIRMWARE_XIP_OFFSET}  /* Bootloader, up to the active XIP image */
+#else
 	{.address = 0x000000, .length = 0x200000}  /* Bootloader */
+#endif
 };
 
-static int complete_timeout;
 static bool flash_command_seen = false;
 static bool bus_reset_received = false;
 static bool bl_upgrade = false;
@@ -54,16 +70,42 @@ enum
 	BLINK_DFU_DOWNLOAD,
 	BLINK_DFU_ERROR,
 	BLINK_DFU_SLEEP,
+	BLINK_DFU_COUNT,
 };
 
-static uint32_t blink_interval_ms = BLINK_DFU_IDLE;
+static uint32_t blink_mode = BLINK_DFU_COUNT;
+
+static uint32_t button_count;
+static flash_job_t dfu_job;
+
+static void led_blink_set(uint32_t blink);
 
-// Current system tick timer.
-volatile uint32_t system_ticks = 0;
+static sched_task_t usb_task;
+static sched_task_t reboot_task;
+
+// Millisecond time base, derived from the cycle counter so no periodic tick is needed.
+// sched_wake() calls this from interrupt context, so instead of a 64-bit divide of the
+// whole count it carries a millisecond count forward from the low 32 bits. The button
+// task runs every 10ms, far inside the ~71s the low word takes to wrap.
 #if CFG_TUSB_OS == OPT_OS_NONE
+static uint32_t millis;
+static uint32_t millis_cycles;
+
 uint32_t board_millis(void)
 {
-	return system_ticks;
+	unsigned int ie = irq_getie();
+	irq_setie(0);
+
+	uint32_t elapsed = timing_cycles32() - millis_cycles;
+	if (elapsed >= TIMING_CYCLES_PER_MS)
+	{
+		uint32_t ms = elapsed / TIMING_CYCLES_PER_MS;
+		millis += ms;
+		millis_cycles += ms * TIMING_CYCLES_PER_MS;
+	}
+
+	irq_setie(ie);
+	return millis;
 }
 #endif
 
@@ -73,9 +115,10 @@ uint32_t board_millis(void)
 
 static void timer_init(void)
 {
-	// Set up our timer to generate an interrupt every millisecond.
-	timer0_reload_write(60 * 1000);
-	timer0_en_write(1);
+	// Timer is used one-shot, armed by board_idle() for the next scheduler deadline.
+	timer0_en_write(0);
+	timer0_reload_write(0);
+	timer0_ev_pending_write(timer0_ev_pending_read());
 	timer0_ev_enable_write(1);
 
 	// Enable our timer's interrupt.
@@ -83,10 +126,111 @@ static void timer_init(void)
 	irq_setmask((1 << TIMER0_INTERRUPT) | irq_getmask());
 }
 
-static void timer_isr(void)
+/* Longest one-shot the 32-bit timer can hold */
+#define TIMER_MAX_MS (UINT32_MAX / TIMING_CYCLES_PER_MS)
+
+static void timer_arm(uint32_t ms)
+{
+	if (ms > TIMER_MAX_MS)
+		ms = TIMER_MAX_MS;
+
+	timer0_en_write(0);
+	timer0_load_write(ms * TIMING_CYCLES_PER_MS);
+	timer0_en_write(1);
+}
+
+/* Called by the scheduler when no task is due. Sleeps until the next
+ * deadline or any interrupt. Interrupts are masked while deciding, a pending
+ * interrupt still ends the wfi and is serviced once they are unmasked.
+ */
+void board_idle(void)
 {
-	// Increment our total millisecond count.
-	++system_ticks;
+	irq_setie(0);
+
+	uint32_t ms = sched_idle_ms();
+	if (ms > 0)
+	{
+		if (ms != UINT32_MAX)
+			timer_arm(ms);
+
+		TRACE(TRACE_IDLE, ms);
+#ifdef HOST_BUILD
+		host_wfi();
+#else
+		__asm__ volatile("wfi");
+#endif
+		TRACE(TRACE_WAKE, 0);
+	}
+
+	irq_setie(1);
+}
+
+#define USB_IRQ_MASK ((1 << USB_DEVICE_CONTROLLER_INTERRUPT) | (1 << USB_IN_EP_INTERRUPT) | \
+					  (1 << USB_OUT_EP_INTERRUPT) | (1 << USB_SETUP_INTERRUPT) | (1 << USB_STATUS_INTERRUPT))
+
+/* usb_status_events bit, see gateware/rtl/amaranth_rtl/eptri_status.py */
+#define USB_STATUS_PHY_READY (1u << 14)
+
+/* The PHY reset sequence (10ms reset, 200us stop) runs in gateware, follow it
+ * instead of sleeping for a fixed time. PHY_READY from before the reset is
+ * still visible until the request crosses into the usb domain, so wait for it
+ * to drop before waiting for it to come back.
+ */
+static bool usb_phy_reset(uint32_t timeout_ms)
+{
+	uint64_t deadline = timing_deadline_ms(timeout_ms);
+
+	usb_device_controller_reset_write(1);
+	usb_device_controller_reset_write(0);
+
+	while (usb_status_events_read() & USB_STATUS_PHY_READY)
+	{
+		if (timing_expired(deadline))
+			return false;
+	}
+
+	while (!(usb_status_events_read() & USB_STATUS_PHY_READY))
+	{
+		if (timing_expired(deadline))
+			return false;
+	}
+	return true;
+}
+
+#define USB_PHY_RESET_TRIES 3
+
+static bool flash_asleep = false;
+
+/* USB suspend: park the LED multiplexer and put the flash into deep power-down.
+ * The CPU already sleeps in wfi between events. The usb domain is clocked from
+ * sys, so the clocks themselves have to keep running.
+ */
+static void board_power_suspend(void)
+{
+	leds_park_write(1);
+
+#ifndef FIRMWARE_XIP
+	/* A write in progress keeps the flash awake until the next suspend.
+	 * XIP builds execute from it, so it always stays awake there.
+	 */
+	if (!flash_job_busy())
+	{
+		spiflash_power_down();
+		flash_asleep = true;
+	}
+#endif
+}
+
+/* Must run before anything reads the flash again, including a reconfiguration */
+static void board_power_resume(void)
+{
+	if (flash_asleep)
+	{
+		spiflash_release_power_down();
+		flash_asleep = false;
+	}
+
+	leds_park_write(0);
 }
 
 void app_isr(void)
@@ -94,78 +238,146 @@ void app_isr(void)
 	unsigned int irqs;
 	irqs = irq_pending() & irq_getmask();
 
+	IRQ_STATS_ENTRY();
 
-	// Dispatch USB events.
-	if (irqs & (1 << USB_DEVICE_CONTROLLER_INTERRUPT | 1 << USB_IN_EP_INTERRUPT | 1 << USB_OUT_EP_INTERRUPT | 1 << USB_SETUP_INTERRUPT))
+	// Dispatch USB events first, they are the only ones with a response deadline.
+	if (irqs & USB_IRQ_MASK)
 	{
+		IRQ_STATS_BEGIN();
+
+		/* Monitor bus resets */
+		if (irqs & (1 << USB_DEVICE_CONTROLLER_INTERRUPT))
+		{
+			bus_reset_received = true;
+			BOOT_STAMP(BOOT_STAMP_BUS_RESET);
+			sched_wake(&reboot_task);
+		}
+
 		tud_int_handler(0);
+		sched_wake(&usb_task);
+		IRQ_STATS_END(IRQ_SRC_USB);
+
+		// Fast path, nothing else pending.
+		if ((irqs & ~USB_IRQ_MASK) == 0)
+			return;
 	}
 
-	/* Monitor bus resets */
-	if(irqs & (1 << USB_DEVICE_CONTROLLER_INTERRUPT))
+	// Timer only exists to end a wfi, the scheduler picks up the deadline.
+	if (irqs & (1 << TIMER0_INTERRUPT))
 	{
-		bus_reset_received = true;
+		IRQ_STATS_BEGIN();
+		timer0_en_write(0);
+		timer0_ev_pending_write(1); // zero is the only timer event
+		IRQ_STATS_END(IRQ_SRC_TIMER);
 	}
 
-	// Dispatch timer events.
-	if (irqs & (1 << TIMER0_INTERRUPT))
+#ifdef ETH_FLASH
+	if (irqs & (1 << ETHMAC_INTERRUPT))
 	{
-		timer0_ev_pending_write(timer0_ev_pending_read());
-		timer_isr();
+		eth_flash_isr();
 	}
+#endif
 
 	// Dispatch UART events.
 	if (irqs & (1 << UART_INTERRUPT))
 	{
+		IRQ_STATS_BEGIN();
 		uart_isr();
+#ifdef DEFERRED_LOG
+		dlog_uart_isr();
+#endif
+		IRQ_STATS_END(IRQ_SRC_UART);
 	}
 }
 
-int main(int i, char **c)
+//--------------------------------------------------------------------+
+// Tasks
+//--------------------------------------------------------------------+
+
+static void usb_task_run(sched_task_t *task)
 {
+	(void)task;
+	tud_task(); // tinyusb device task
+}
 
-	/* Setup IRQ, needed for UART */
-	irq_setmask(0);
-	irq_setie(1);
-	uart_init();
+/* Holding the button for 5s reboots into the bootloader with the bootloader partition unlocked */
+static void button_task_run(sched_task_t *task)
+{
+	(void)task;
 
-	/* Enable VccIo
-	 * Specifically we need ch2 enabled for the USB ULPI.
-	 * But the hardware requires that we configure them all
-	 */
-	vccio_ch0_write(45000); // 1v8
-	vccio_ch1_write(45000); // 1v8
-	vccio_ch2_write(45000); // 1v8
-	msleep(10);
-	vccio_enable_write(1);
+	if ((button_in_read() == 0))
+	{
+		if ((board_millis() - button_count) > 5000)
+		{
+			board_power_resume();
+			ctrl_scratch_write(0);
 
-	usb_device_controller_reset_write(1);
-	msleep(20);
-	usb_device_controller_reset_write(0);
-	msleep(20);
+			irq_setie(0);
+			usb_device_controller_connect_write(0);
+			msleep(20);
 
-	/* Handle soft-reset to unlock bootloader partition */
-	if (ctrl_scratch_read() == 0)
+			ctrl_reset_write(1);
+		}
+	}
+	else
 	{
-		enable_bootloader_alt();
-		bl_upgrade = true;
-		spiflash_protection_write(false);
+		button_count = board_millis();
 	}
-	else if (spiflash_protection_read() == false)
+}
+
+/* A bus reset after a download hands over to the user bitstream */
+static void reboot_task_run(sched_task_t *task)
+{
+	if (!bus_reset_received)
+		return;
+
+	/* Nothing downloaded yet, just the host enumerating us */
+	if (!flash_command_seen)
 	{
-		spiflash_protection_write(true);
+		bus_reset_received = false;
+		return;
+	}
+
+	/* Hold on to the reset until the last block is in flash */
+	if (flash_job_busy())
+	{
+		sched_delay(task, 10);
+		return;
 	}
 
-	uint8_t last_button = button_in_read();
-	uint32_t button_count = board_millis();
+	bus_reset_received = false;
+	sched_stop();
+}
+
+/* USB is woken by its interrupts and serviced ahead of every other task */
+static sched_task_t usb_task = SCHED_TASK(usb_task_run, 0, SCHED_EVENT);
+static sched_task_t button_task = SCHED_TASK(button_task_run, 3, 10);
+static sched_task_t reboot_task = SCHED_TASK(reboot_task_run, 3, SCHED_EVENT);
+
+int main(int i, char **c)
+{
 
-	/* Check for magic bytes in the Security page3 */
+	/* Setup IRQ, needed for UART */
+	irq_setmask(0);
+	irq_setie(1);
+	uart_init();
+
+	BOOT_STAMP(BOOT_STAMP_START);
+
+#ifdef BUS_STATS
+	busmon_init();
+#endif
+
+	/* Decide first, only bring up VccIo and USB if we stay in the bootloader.
+	 * Check for magic bytes in the Security page3, only the header is needed.
+	 */
 	const uint32_t BL_MAGIC0 = 0x021b3bcd;
 	const uint32_t BL_MAGIC1 = 0xc4f86d8a;
 
-	uint8_t buf[256];
+	uint8_t buf[4];
 	bool stay_in_bootloader = false;
-	spiflash_read_security_register(3, buf);
+	bool clear_magic = false;
+	spiflash_read_security_register_len(3, buf, sizeof(buf));
 
 	if ((buf[0] == ((BL_MAGIC0 >> 0) & 0xFF)) &&
 		(buf[1] == ((BL_MAGIC0 >> 8) & 0xFF)) &&
@@ -174,8 +386,7 @@ int main(int i, char **c)
 	{
 		/* Found BL_MAGIC0, stay in bootolader, but clear this flag */
 		stay_in_bootloader = true;
-		spiflash_write_enable();
-		spiflash_erase_security_register(3);
+		clear_magic = true;
 	}
 	else if ((buf[0] == ((BL_MAGIC1 >> 0) & 0xFF)) &&
 			 (buf[1] == ((BL_MAGIC1 >> 8) & 0xFF)) &&
@@ -186,213 +397,169 @@ int main(int i, char **c)
 		stay_in_bootloader = true;
 	}
 
-
-
-	if (((button_in_read() & 1) == 0) || stay_in_bootloader)
+	if ((button_in_read() & 1) == 0)
 	{
-
-		timer_init();
-		tusb_init();
-
-		while (1)
-		{
-			tud_task(); // tinyusb device task
-			led_blinking_task();
-
-			if ((button_in_read() == 0))
-			{
-
-				if ((board_millis() - button_count) > 5000)
-				{
-
-					ctrl_scratch_write(0);
-
-					irq_setie(0);
-					usb_device_controller_connect_write(0);
-					msleep(20);
-
-					ctrl_reset_write(1);
-				}
-			}
-			else
-			{
-				button_count = board_millis();
-			}
-
-			if (bus_reset_received)
-			{
-				bus_reset_received = false;
-				if(flash_command_seen)
-				{
-					break;
-				}
-			}
-		}
+		stay_in_bootloader = true;
 	}
 
-	/* Reboot to our user bitstream */
-	irq_setie(0);
-	usb_device_controller_connect_write(0);
-
-	if (spiflash_protection_read() == false)
+	/* Handle soft-reset to unlock bootloader partition */
+	if (ctrl_scratch_read() == 0)
 	{
-		spiflash_protection_write(true);
+		enable_bootloader_alt();
+		bl_upgrade = true;
+		spiflash_protection_write(false);
 	}
-
-	msleep(50);
-	
-	while (1)
+	else if (spiflash_protection_read() == false)
 	{
-		reset_out_write(1);
+		spiflash_protection_write(true);
 	}
 
-	return 0;
-}
-
-const uint32_t idle_rainbow[] = {
-	0x2aaffc00,
-	0x38000000,
-	0x2aaffc00,
-	0x2aaffc00,
-	0x38000000,
-	0x2aaffc00,
-	0x2aaffc00,
-	0x2aaffc00,
-	0x2aaffc00,
-	0x38000000,
-	0x38000000,
-	0x2aaffc00,
-	0x2aaffc00,
-	0x38000000,
-	0x2aaffc00,
-	0x38000000,
-	0x2aaffc00,
-	0x38000000,
-	0x38000000,
-	0x38000000,
-	0x38000000,
-	0x2aaffc00,
-	0x2aaffc00,
-	0x38000000,
-	0x2aaffc00,
-	0x2aaffc00,
-	0x38000000,
-	0x2aaffc00,
-	0x2aaffc00,
-	0x2aaffc00,
-	0x2aaffc00,
-	0x38000000,
-};
-
-const uint16_t sine_falloff_fade[] = {0x3ff, 0x3f8, 0x3ea, 0x3cf, 0x3ae, 0x387, 0x354, 0x31b, 0x2df, 0x29f, 0x256, 0x210, 0x1c5, 0x17e, 0x138, 0x0f4, 0x0b8, 0x07f, 0x04d, 0x028, 0x00c, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000};
-const uint16_t sine_pulse_fade[] = {0x000, 0x000, 0x000, 0x017, 0x04d, 0x09a, 0x0f4, 0x15a, 0x1c5, 0x235, 0x29f, 0x2fd, 0x354, 0x39a, 0x3cf, 0x3f1, 0x3ff, 0x3f1, 0x3cf, 0x39a, 0x354, 0x2fd, 0x29f, 0x235, 0x1c5, 0x15a, 0x0f4, 0x09a, 0x04d, 0x017, 0x000, 0x000};
+#ifdef GATEWARE_AB_SLOTS
+	gw_slots_init();
+#endif
 
-void led_blinking_task(void)
-{
-	static uint32_t start_ms = 0;
-	static int count;
+#ifdef FIRMWARE_XIP
+	/* The USB stack runs from flash, without a matching image there is no bootloader to stay in */
+	if (stay_in_bootloader && !xip_prepare())
+		stay_in_bootloader = false;
+#endif
 
-	// Blink every interval ms
-	if ((board_millis() - start_ms) < 40)
-		return; // not enough time
-	start_ms += 40;
-	count++;
+	BOOT_STAMP(BOOT_STAMP_DECIDED);
 
-	volatile uint32_t *p = (uint32_t *)CSR_LEDS_OUT0_ADDR;
-	switch (blink_interval_ms)
+	if (stay_in_bootloader)
 	{
-	case BLINK_DFU_IDLE:
-	{
-		if (bl_upgrade)
+		if (clear_magic)
 		{
-			blink_interval_ms = BLINK_DFU_IDLE_BOOTLOADER;
-			break;
+			spiflash_write_enable();
+			spiflash_erase_security_register(3);
 		}
 
-		/* Pick colour from idle_rainbow. Then interger multiply it with a sine_falloff_fade */
-		int colour = (((count + 10) / 32)) % 32;
+		/* Enable VccIo
+		 * Specifically we need ch2 enabled for the USB ULPI.
+		 * But the hardware requires that we configure them all
+		 */
+		vccio_ch0_write(45000); // 1v8
+		vccio_ch1_write(45000); // 1v8
+		vccio_ch2_write(45000); // 1v8
+		msleep(10);
+		vccio_enable_write(1);
+		BOOT_STAMP(BOOT_STAMP_VCCIO);
+
+		bool usb_ready = false;
+		for (int n = 0; n < USB_PHY_RESET_TRIES && !usb_ready; n++)
+			usb_ready = usb_phy_reset(50);
+		BOOT_STAMP(BOOT_STAMP_USB_RESET);
+
+		button_count = board_millis();
+
+		usb_descriptors_init();
+#ifdef ETH_FLASH
+		eth_flash_init();
+#endif
+		timer_init();
+		tusb_init();
 
-		for (int i = 0; i < 4; i++)
-		{
-			int c = (count + i * 2);
-			int g = (((idle_rainbow[colour] >> 20) & 0x3FF) * sine_falloff_fade[c % 32]) >> 10;
-			int b = (((idle_rainbow[colour] >> 10) & 0x3FF) * sine_falloff_fade[c % 32]) >> 10;
-			int r = (((idle_rainbow[colour] >> 0) & 0x3FF) * sine_falloff_fade[c % 32]) >> 10;
-			p[i] = (g << 20) | (b << 10) | (r);
-		}
-		for (int i = 0; i < 3; i++)
-		{
-			int c = (count - (i - 2) * 2);
+		/* Without a PHY there is no USB, the button still gets out of here */
+		led_blink_set(usb_ready ? BLINK_DFU_IDLE : BLINK_DFU_ERROR);
+		BOOT_STAMP(BOOT_STAMP_USB_READY);
 
-			int g = (((idle_rainbow[colour] >> 20) & 0x3FF) * sine_falloff_fade[c % 32]) >> 10;
-			int b = (((idle_rainbow[colour] >> 10) & 0x3FF) * sine_falloff_fade[c % 32]) >> 10;
-			int r = (((idle_rainbow[colour] >> 0) & 0x3FF) * sine_falloff_fade[c % 32]) >> 10;
-			p[4 + i] = (g << 20) | (b << 10) | (r);
+		sched_add(&usb_task);
+		sched_add(&flash_job_task);
+		sched_add(&button_task);
+		sched_add(&reboot_task);
+#ifdef ETH_FLASH
+		sched_add(&eth_flash_task);
+#endif
 
-			//p[4 + i] = (uint32_t)sine_falloff_fade[c % 32] << colour; /* BLUE */
-		}
-	}
-	break;
+		/* Returns once the host has reset us after a download */
+		sched_run();
 
-	default:
-	{
-		for (int i = 0; i < 4; i++)
-		{
-			p[i] = idle_rainbow[(count + i) % 32];
-		}
-		for (int i = 0; i < 3; i++)
-		{
-			p[4 + i] = idle_rainbow[(count + 2 - i) % 32];
-		}
+		/* Give the host time to see us go */
+		irq_setie(0);
+		usb_device_controller_connect_write(0);
+		msleep(50);
 	}
-	break;
 
-	case BLINK_DFU_DOWNLOAD:
-	{
-		for (int i = 0; i < 7; i++)
-		{
-			p[i] = (uint32_t)sine_falloff_fade[((count << 1) + i * 4) % 32] << 20; /* GREEN*/
-		}
-	}
-	break;
+	/* Reboot to our user bitstream */
+	irq_setie(0);
+	board_power_resume();
 
-	case BLINK_DFU_IDLE_BOOTLOADER:
+	if (spiflash_protection_read() == false)
 	{
-		for (int i = 0; i < 7; i++)
-		{
-			p[i] = (uint32_t)sine_pulse_fade[(count + i * 5) % 32] << 0; // RED
-		}
+		spiflash_protection_write(true);
 	}
-	break;
 
-	case BLINK_DFU_ERROR:
-	{
-		for (int i = 0; i < 4; i++)
-		{
-			int c = ((count << 2) + i * 2);
-			int r = sine_falloff_fade[c % 32];
-			p[i] = (r);
-		}
-		for (int i = 0; i < 3; i++)
-		{
-			int c = ((count << 2) - (i - 2) * 2);
+#ifdef GATEWARE_AB_SLOTS
+	/* Count trial boots, falls back to the known good slot when they run out */
+	gw_slots_boot();
+#endif
 
-			int r = sine_falloff_fade[c % 32];
-			p[4 + i] = (r);
-		}
-	}
-	break;
+	/* Quad mode configuration needs QE, and the flash idle */
+	spiflash_quad_enable();
 
-	case BLINK_DFU_SLEEP:
+	BOOT_STAMP(BOOT_STAMP_EXIT);
+
+	while (1)
 	{
-		for (int i = 1; i < 7; i++)
-		{
-			p[i] = 0;
-		}
-		p[0] = ((uint32_t)sine_pulse_fade[(count) % 32] / 4) << 20; // GREEN
-	}
-	break;
+		reset_out_write(1);
 	}
+
+	return 0;
+}
+
+/* Pattern engine settings per blink mode, animation runs in gateware (rtl/rgb.py) */
+typedef struct
+{
+	uint8_t mode;
+	uint8_t step;
+	uint8_t mask;
+	uint64_t phase;
+	uint32_t colour0;
+	uint32_t colour1;
+	uint32_t palette;
+} led_pattern_t;
+
+#define LED_WAVE_FALLOFF 1
+#define LED_WAVE_PULSE 2
+
+#define LED_PHASE(a, b, c, d, e, f, g)                                        \
+	(((uint64_t)(a) << 0) | ((uint64_t)(b) << 5) | ((uint64_t)(c) << 10) |    \
+	 ((uint64_t)(d) << 15) | ((uint64_t)(e) << 20) | ((uint64_t)(f) << 25) | \
+	 ((uint64_t)(g) << 30))
+
+#define LED_GREEN(v) ((uint32_t)(v) << 20)
+#define LED_RED(v) ((uint32_t)(v) << 0)
+
+static const led_pattern_t led_patterns[] = {
+	/* Falloff sweeping out from the centre, alternating between two colours */
+	[BLINK_DFU_IDLE] = {LED_WAVE_FALLOFF, 1, 0x7f, LED_PHASE(0, 2, 4, 6, 4, 2, 0), 0x2aaffc00, 0x38000000, 0x849ea612},
+	[BLINK_DFU_IDLE_BOOTLOADER] = {LED_WAVE_PULSE, 1, 0x7f, LED_PHASE(0, 5, 10, 15, 20, 25, 30), LED_RED(0x3ff), 0, 0},
+	[BLINK_DFU_DOWNLOAD] = {LED_WAVE_FALLOFF, 2, 0x7f, LED_PHASE(0, 4, 8, 12, 16, 20, 24), LED_GREEN(0x3ff), 0, 0},
+	[BLINK_DFU_ERROR] = {LED_WAVE_FALLOFF, 4, 0x7f, LED_PHASE(0, 2, 4, 6, 4, 2, 0), LED_RED(0x3ff), 0, 0},
+	/* Dim green heartbeat on a single LED */
+	[BLINK_DFU_SLEEP] = {LED_WAVE_PULSE, 1, 0x01, 0, LED_GREEN(0x100), 0, 0},
+};
+
+static void led_blink_set(uint32_t blink)
+{
+	if (blink == BLINK_DFU_IDLE && bl_upgrade)
+		blink = BLINK_DFU_IDLE_BOOTLOADER;
+
+	if (blink == blink_mode)
+		return;
+	blink_mode = blink;
+
+	const led_pattern_t *p = &led_patterns[blink];
+
+	/* Stop the engine while it is reconfigured, it restarts from the first step */
+	leds_pattern_mode_write(0);
+	leds_pattern_step_write(p->step);
+	leds_pattern_mask_write(p->mask);
+	leds_pattern_phase_write(p->phase);
+	leds_pattern_colour0_write(p->colour0);
+	leds_pattern_colour1_write(p->colour1);
+	leds_pattern_palette_write(p->palette);
+	leds_pattern_mode_write(p->mode);
 }
 
 //--------------------------------------------------------------------+
@@ -402,13 +569,16 @@ void led_blinking_task(void)
 // Invoked when device is mounted
 void tud_mount_cb(void)
 {
-	blink_interval_ms = BLINK_DFU_IDLE;
+	BOOT_STAMP(BOOT_STAMP_MOUNTED);
+	led_blink_set(BLINK_DFU_IDLE);
 }
 
 // Invoked when device is unmounted
 void tud_umount_cb(void)
 {
-	blink_interval_ms = BLINK_DFU_IDLE;
+	/* A DFU download can't resume without the host, let Ethernet have the flash */
+	download_release(DOWNLOAD_DFU);
+	led_blink_set(BLINK_DFU_IDLE);
 }
 
 // Invoked when usb bus is suspended
@@ -417,13 +587,94 @@ void tud_umount_cb(void)
 void tud_suspend_cb(bool remote_wakeup_en)
 {
 	(void)remote_wakeup_en;
-	blink_interval_ms = BLINK_DFU_SLEEP;
+	board_power_suspend();
 }
 
 // Invoked when usb bus is resumed
 void tud_resume_cb(void)
 {
-	blink_interval_ms = BLINK_DFU_IDLE;
+	board_power_resume();
+	led_blink_set(BLINK_DFU_IDLE);
+}
+
+//--------------------------------------------------------------------+
+// Partitions, shared by DFU and the Ethernet download (eth_flash.c)
+//--------------------------------------------------------------------+
+
+static uint8_t download_owner = DOWNLOAD_NONE;
+
+/* Only one path writes the partitions at a time, an owner can claim again */
+bool download_claim(uint8_t owner)
+{
+	if (download_owner != DOWNLOAD_NONE && download_owner != owner)
+		return false;
+
+	download_owner = owner;
+	return true;
+}
+
+void download_release(uint8_t owner)
+{
+	if (download_owner == owner)
+		download_owner = DOWNLOAD_NONE;
+}
+
+/* Flash address of offset into partition alt, false past the end of it.
+ * The bootloader partition only exists once unlocked. Wakes the flash, a
+ * write is expected to follow.
+ */
+bool partition_write_address(uint8_t alt, uint32_t offset, uint32_t *address)
+{
+	uint8_t count = sizeof(alt_offsets) / sizeof(alt_offsets[0]);
+	if (!bl_upgrade)
+		count--;
+
+	led_blink_set(BLINK_DFU_DOWNLOAD);
+	flash_command_seen = true;
+
+	if (alt >= count)
+	{
+		led_blink_set(BLINK_DFU_ERROR);
+		return false;
+	}
+
+	uint32_t base = alt_offsets[alt].address;
+	uint32_t limit = alt_offsets[alt].length;
+
+#ifdef GATEWARE_AB_SLOTS
+	/* Gateware always goes into the inactive slot */
+	if (alt == 0)
+	{
+		base = gw_slots_download_address();
+		limit = GW_SLOT_LENGTH;
+	}
+#endif
+
+	if (offset >= limit)
+	{
+		led_blink_set(BLINK_DFU_ERROR);
+		return false;
+	}
+
+	*address = base + offset;
+	board_power_resume();
+	return true;
+}
+
+/* Every block of the image is programmed and verified */
+void partition_manifest(uint8_t alt)
+{
+	led_blink_set(BLINK_DFU_DOWNLOAD);
+
+#ifdef GATEWARE_AB_SLOTS
+	/* Boot the new image on trial, it has to be confirmed by the host */
+	if (alt == 0)
+	{
+		gw_slots_set_trial();
+	}
+#else
+	(void)alt;
+#endif
 }
 
 //--------------------------------------------------------------------+
@@ -449,62 +700,56 @@ uint32_t tud_dfu_get_timeout_cb(uint8_t alt, uint8_t state)
 	return 0;
 }
 
+static void dfu_job_done(int status)
+{
+	/* Status goes out on the next DFU_GETSTATUS, make sure tinyusb runs */
+	sched_wake(&usb_task);
+	TRACE(TRACE_DNLOAD_DONE, status);
+
+	if (status != FLASH_JOB_OK)
+	{
+		download_release(DOWNLOAD_DFU);
+		led_blink_set(BLINK_DFU_ERROR);
+		tud_dfu_finish_flashing(DFU_STATUS_ERR_VERIFY);
+		return;
+	}
+
+	// flashing op for download complete without error
+	tud_dfu_finish_flashing(DFU_STATUS_OK);
+}
+
 // Invoked when received DFU_DNLOAD (wLength>0) following by DFU_GETSTATUS (state=DFU_DNBUSY) requests
 // This callback could be returned before flashing op is complete (async).
 // Once finished flashing, application must call tud_dfu_finish_flashing()
 void tud_dfu_download_cb(uint8_t alt, uint16_t block_num, uint8_t const *data, uint16_t length)
 {
-	(void)alt;
-	(void)block_num;
-
-	blink_interval_ms = BLINK_DFU_DOWNLOAD;
-	flash_command_seen = true;
+	uint32_t address;
 
-	if ((block_num * CFG_TUD_DFU_XFER_BUFSIZE) >= alt_offsets[alt].length)
+	/* An Ethernet download owns the flash until it ends or times out */
+	if (flash_job_busy() || !download_claim(DOWNLOAD_DFU))
 	{
-		// flashing op for download length error
-		tud_dfu_finish_flashing(DFU_STATUS_ERR_ADDRESS);
-
-		blink_interval_ms = BLINK_DFU_ERROR;
-
+		tud_dfu_finish_flashing(DFU_STATUS_ERR_WRITE);
 		return;
 	}
 
-	uint32_t flash_address = alt_offsets[alt].address + block_num * CFG_TUD_DFU_XFER_BUFSIZE;
-
-	/* First block in 64K erase block */
-	if ((flash_address & (FLASH_64K_BLOCK_ERASE_SIZE - 1)) == 0)
+	if (!partition_write_address(alt, block_num * CFG_TUD_DFU_XFER_BUFSIZE, &address))
 	{
-
-		spiflash_write_enable();
-		spiflash_sector_erase(flash_address);
-
-		/* While FLASH erase is in progress update LEDs */
-		while (spiflash_read_status_register() & 1)
-		{
-			led_blinking_task();
-		};
+		// flashing op for download length error
+		download_release(DOWNLOAD_DFU);
+		tud_dfu_finish_flashing(DFU_STATUS_ERR_ADDRESS);
+		return;
 	}
 
-	//printf("tud_dfu_download_cb(), alt=%u, block=%u, flash_address=%08x\n", alt, block_num, flash_address);
-
-	for (int i = 0; i < CFG_TUD_DFU_XFER_BUFSIZE / 256; i++)
-	{
-
-		spiflash_write_enable();
-		spiflash_page_program(flash_address, data, 256);
-		flash_address += 256;
-		data += 256;
-
-		/* While FLASH erase is in progress update LEDs */
-		while (spiflash_read_status_register() & 1)
-		{
-			led_blinking_task();
-		};
-	}
+	DLOG("tud_dfu_download_cb(), alt=%u, block=%u\n", alt, block_num);
 
-	// flashing op for download complete without error
-	tud_dfu_finish_flashing(DFU_STATUS_OK);
+	/* Erase/program/verify runs in the background, tud_dfu_finish_flashing() is called from dfu_job_done() */
+	dfu_job.address = address;
+	dfu_job.data = data;
+	dfu_job.length = length;
+	dfu_job.done = dfu_job_done;
+	perf.dnload_count++;
+	TRACE(TRACE_DNLOAD, block_num);
+	flash_job_start(&dfu_job);
 }
 
 // Invoked when download process is complete, received DFU_DNLOAD (wLength=0) following by DFU_GETSTATUS (state=Manifest)
@@ -512,8 +757,8 @@ void tud_dfu_download_cb(uint8_t alt, uint16_t block_num, uint8_t const *data, u
 // Once finished flashing, application must call tud_dfu_finish_flashing()
 void tud_dfu_manifest_cb(uint8_t alt)
 {
-	(void)alt;
-	blink_interval_ms = BLINK_DFU_DOWNLOAD;
+	partition_manifest(alt);
+	download_release(DOWNLOAD_DFU);
 
 	// flashing op for manifest is complete without error
 	// Application can perform checksum, should it fail, use appropriate status such as errVERIFY.
@@ -524,11 +769,12 @@ void tud_dfu_manifest_cb(uint8_t alt)
 void tud_dfu_abort_cb(uint8_t alt)
 {
 	(void)alt;
-	blink_interval_ms = BLINK_DFU_ERROR;
+	download_release(DOWNLOAD_DFU);
+	led_blink_set(BLINK_DFU_ERROR);
 }
 
 // Invoked when a DFU_DETACH request is received
 void tud_dfu_detach_cb(void)
 {
-	blink_interval_ms = BLINK_DFU_SLEEP;
+	led_blink_set(BLINK_DFU_SLEEP);
 }
\ No newline at end of file
@@ -0,0 +1,33 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <generated/soc.h>
+#include <irq.h>
+
+#include "timing.h"
+#include "perf.h"
+
+perf_counters_t perf;
+
+/* The control transfer goes out over several packets, while the counters keep moving */
+static perf_counters_t snapshot;
+
+const perf_counters_t *perf_snapshot(void)
+{
+	unsigned int ie = irq_getie();
+	irq_setie(0);
+	memcpy(&snapshot, &perf, sizeof(snapshot));
+	irq_setie(ie);
+	snapshot.clock_hz = CONFIG_CLOCK_FREQUENCY;
+	snapshot.uptime_cycles = timing_cycles();
+	return &snapshot;
+}
+
+void perf_reset(void)
+{
+	memset(&perf, 0, sizeof(perf));
+}
@@ -0,0 +1,104 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "sched.h"
+
+/* Millisecond time base and idle hook, provided by main.c */
+uint32_t board_millis(void);
+void board_idle(void);
+
+static sched_task_t *task_list;
+static volatile bool running;
+
+void sched_add(sched_task_t *task)
+{
+	sched_task_t **p = &task_list;
+
+	/* Keep the list sorted, tasks of equal priority run in the order added */
+	while (*p && (*p)->priority <= task->priority)
+		p = &(*p)->next;
+
+	task->next = *p;
+	task->next_ms = board_millis();
+	task->parked = false;
+	*p = task;
+}
+
+/* Push the next run of a task out by ms, overriding its period once */
+void sched_delay(sched_task_t *task, uint32_t ms)
+{
+	task->next_ms = board_millis() + ms;
+	task->parked = false;
+}
+
+/* Make a task due now, callable from interrupt context */
+void sched_wake(sched_task_t *task)
+{
+	task->next_ms = board_millis();
+	task->parked = false;
+}
+
+/* Time until the earliest deadline, UINT32_MAX if every task is parked.
+ * Call with interrupts disabled so a wake can't slip in after the check.
+ */
+uint32_t sched_idle_ms(void)
+{
+	uint32_t now = board_millis();
+	uint32_t idle = UINT32_MAX;
+
+	for (sched_task_t *t = task_list; t != NULL; t = t->next)
+	{
+		if (t->parked)
+			continue;
+
+		int32_t remaining = (int32_t)(t->next_ms - now);
+		if (remaining <= 0)
+			return 0;
+
+		if ((uint32_t)remaining < idle)
+			idle = remaining;
+	}
+
+	return idle;
+}
+
+void sched_run(void)
+{
+	running = true;
+
+	while (running)
+	{
+		bool ran = false;
+
+		for (sched_task_t *t = task_list; t != NULL && running; t = t->next)
+		{
+			uint32_t now = board_millis();
+
+			if (t->parked || (int32_t)(now - t->next_ms) < 0)
+				continue;
+
+			/* Park before running, a wake raised while it runs is kept */
+			if (t->period_ms == SCHED_EVENT)
+				t->parked = true;
+			else
+				t->next_ms = now + t->period_ms;
+
+			t->run(t);
+			ran = true;
+		}
+
+		if (!ran && running)
+			board_idle();
+	}
+}
+
+/* Makes sched_run() return at the end of the current task */
+void sched_stop(void)
+{
+	running = false;
+}
@@ -5,12 +5,21 @@
 
 #include <generated/csr.h>
 
+#include <sleep.h>
+#include <timing.h>
+
+void timing_wait_until(uint64_t deadline)
+{
+    while (!timing_expired(deadline))
+        ;
+}
+
+void udelay(int us)
+{
+    timing_wait_until(timing_deadline_us(us));
+}
+
 void msleep(int ms)
 {
-    timer0_en_write(0);
-    timer0_reload_write(0);
-    timer0_load_write(CONFIG_CLOCK_FREQUENCY/1000*ms);
-    timer0_en_write(1);
-    timer0_update_value_write(1);
-    while(timer0_value_read()) timer0_update_value_write(1);
-}
\ No newline at end of file
+    timing_wait_until(timing_deadline_ms(ms));
+}
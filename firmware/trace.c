@@ -0,0 +1,87 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+
+#include <stdint.h>
+
+#include <irq.h>
+
+#include "timing.h"
+#include "trace.h"
+
+#ifdef EVENT_TRACE
+
+static trace_event_t ring[TRACE_ENTRIES];
+static volatile uint32_t head;
+static volatile uint32_t tail;
+static uint32_t dropped;
+static trace_info_t info;
+
+/* Called from the ISR and from tasks, interrupts are held off for the few
+ * instructions it takes to claim a slot.
+ */
+void trace_emit(uint32_t event)
+{
+	unsigned int ie = irq_getie();
+	irq_setie(0);
+
+	uint32_t h = head;
+	if (h - tail < TRACE_ENTRIES)
+	{
+		trace_event_t *e = &ring[h % TRACE_ENTRIES];
+		e->stamp = timing_cycles32();
+		e->event = event;
+		head = h + 1;
+	}
+	else
+	{
+		dropped++;
+	}
+
+	irq_setie(ie);
+}
+
+const trace_info_t *trace_info(void)
+{
+	info.clock_hz = CONFIG_CLOCK_FREQUENCY;
+	info.capacity = TRACE_ENTRIES;
+	info.count = head - tail;
+	info.dropped = dropped;
+	return &info;
+}
+
+/* Oldest events, up to max and without wrapping. They stay in place until
+ * trace_consume(), the ring only writes into free slots.
+ */
+const trace_event_t *trace_peek(uint32_t max, uint32_t *count)
+{
+	uint32_t t = tail;
+	uint32_t n = head - t;
+	uint32_t contiguous = TRACE_ENTRIES - (t % TRACE_ENTRIES);
+
+	if (n > contiguous)
+		n = contiguous;
+	if (n > max)
+		n = max;
+
+	*count = n;
+	return &ring[t % TRACE_ENTRIES];
+}
+
+void trace_consume(uint32_t count)
+{
+	tail += count;
+}
+
+void trace_clear(void)
+{
+	unsigned int ie = irq_getie();
+	irq_setie(0);
+
+	tail = head;
+	dropped = 0;
+
+	irq_setie(ie);
+}
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ *
+ * Vendor bulk source/sink/loopback interface, registered with tinyusb as an
+ * application class driver. Lets the host measure the USB path on its own,
+ * without DFU or flash in the way.
+ */
+
+#include <generated/soc.h>
+
+#include "tusb.h"
+#include "device/usbd_pvt.h"
+
+#include "usb_bench.h"
+
+#ifdef USB_BENCH
+
+#define BENCH_BUFSIZE 1024
+
+static uint8_t _itf_num;
+
+CFG_TUSB_MEM_ALIGN static uint8_t source_buf[BENCH_BUFSIZE];
+CFG_TUSB_MEM_ALIGN static uint8_t sink_buf[BENCH_BUFSIZE];
+CFG_TUSB_MEM_ALIGN static uint8_t loop_buf[BENCH_BUFSIZE];
+
+static void bench_init(void)
+{
+  // Source pattern, the host checks it to catch dropped or reordered packets.
+  for (int i = 0; i < BENCH_BUFSIZE; i++)
+  {
+    source_buf[i] = (uint8_t) i;
+  }
+}
+
+static void bench_reset(uint8_t rhport)
+{
+  (void) rhport;
+  _itf_num = 0xff;
+}
+
+static uint16_t bench_open(uint8_t rhport, tusb_desc_interface_t const * itf_desc, uint16_t max_len)
+{
+  TU_VERIFY(TUSB_CLASS_VENDOR_SPECIFIC == itf_desc->bInterfaceClass, 0);
+  TU_VERIFY(itf_desc->bNumEndpoints == 4, 0);
+
+  uint16_t const drv_len = TUD_BENCH_DESC_LEN;
+  TU_VERIFY(max_len >= drv_len, 0);
+
+  uint8_t const * p_desc = tu_desc_next(itf_desc);
+  uint8_t ep_out, ep_in;
+
+  TU_ASSERT(usbd_open_edpt_pair(rhport, p_desc, 2, TUSB_XFER_BULK, &ep_out, &ep_in), 0);
+  p_desc += 2 * sizeof(tusb_desc_endpoint_t);
+  TU_ASSERT(usbd_open_edpt_pair(rhport, p_desc, 2, TUSB_XFER_BULK, &ep_out, &ep_in), 0);
+
+  _itf_num = itf_desc->bInterfaceNumber;
+
+  // Everything free-runs from here, each completion requeues its endpoint.
+  TU_ASSERT(usbd_edpt_xfer(rhport, USB_BENCH_EP_SOURCE, source_buf, BENCH_BUFSIZE), 0);
+  TU_ASSERT(usbd_edpt_xfer(rhport, USB_BENCH_EP_SINK, sink_buf, BENCH_BUFSIZE), 0);
+  TU_ASSERT(usbd_edpt_xfer(rhport, USB_BENCH_EP_LOOP_OUT, loop_buf, BENCH_BUFSIZE), 0);
+
+  return drv_len;
+}
+
+static bool bench_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t const * request)
+{
+  (void) rhport;
+  (void) stage;
+  (void) request;
+
+  // No class requests
+  return false;
+}
+
+static bool bench_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes)
+{
+  (void) result;
+
+  switch (ep_addr)
+  {
+    case USB_BENCH_EP_SOURCE:
+      return usbd_edpt_xfer(rhport, USB_BENCH_EP_SOURCE, source_buf, BENCH_BUFSIZE);
+
+    case USB_BENCH_EP_SINK:
+      return usbd_edpt_xfer(rhport, USB_BENCH_EP_SINK, sink_buf, BENCH_BUFSIZE);
+
+    case USB_BENCH_EP_LOOP_OUT:
+      return usbd_edpt_xfer(rhport, USB_BENCH_EP_LOOP_IN, loop_buf, (uint16_t) xferred_bytes);
+
+    case USB_BENCH_EP_LOOP_IN:
+      return usbd_edpt_xfer(rhport, USB_BENCH_EP_LOOP_OUT, loop_buf, BENCH_BUFSIZE);
+
+    default: break;
+  }
+
+  return false;
+}
+
+static usbd_class_driver_t const _bench_driver =
+{
+#if CFG_TUSB_DEBUG >= 2
+  .name             = "BENCH",
+#endif
+  .init             = bench_init,
+  .reset            = bench_reset,
+  .open             = bench_open,
+  .control_xfer_cb  = bench_control_xfer_cb,
+  .xfer_cb          = bench_xfer_cb,
+  .sof              = NULL
+};
+
+// Invoked by tinyusb to pick up application class drivers
+usbd_class_driver_t const* usbd_app_driver_get_cb(uint8_t* driver_count)
+{
+  *driver_count = 1;
+  return &_bench_driver;
+}
+
+#endif
@@ -27,6 +27,14 @@
 #include "class/dfu/dfu_device.h"
 #include <generated/soc.h>
 #include "flash.h"
+#include "usb_bench.h"
+#include "usb_descriptors.h"
+#include "gw_slots.h"
+#include "perf.h"
+#include "trace.h"
+#include "busmon.h"
+#include "irq_stats.h"
+#include "bootprof.h"
 
 //--------------------------------------------------------------------+
 // Device Descriptors
@@ -71,10 +79,22 @@ uint8_t const * tud_descriptor_device_cb(void)
 enum
 {
   ITF_NUM_DFU_MODE,
+#ifdef USB_BENCH
+  ITF_NUM_BENCH,
+#endif
   ITF_NUM_TOTAL
 };
 
-#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN + TUD_DFU_DESC_LEN(ALT_COUNT))
+// Optional raw throughput benchmark interface, see usb_bench.c
+#ifdef USB_BENCH
+#define BENCH_DESC_LEN              TUD_BENCH_DESC_LEN
+#define BENCH_INTERFACE(_epsize)    , TUD_BENCH_DESCRIPTOR(ITF_NUM_BENCH, 8, _epsize)
+#else
+#define BENCH_DESC_LEN              0
+#define BENCH_INTERFACE(_epsize)
+#endif
+
+#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN + TUD_DFU_DESC_LEN(ALT_COUNT) + BENCH_DESC_LEN)
 
 
 #define FUNC_ATTRS (DFU_ATTR_CAN_DOWNLOAD | DFU_ATTR_MANIFESTATION_TOLERANT)
@@ -85,7 +105,8 @@ uint8_t const desc_configuration[] =
   TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, 0x00, 200),
 
   // Interface number, Alternate count, starting string index, attributes, detach timeout, transfer size
-  TUD_DFU_DESCRIPTOR(ITF_NUM_DFU_MODE, 3, 4, FUNC_ATTRS, 50, CFG_TUD_DFU_XFER_BUFSIZE),
+  TUD_DFU_DESCRIPTOR(ITF_NUM_DFU_MODE, 3, 4, FUNC_ATTRS, 50, CFG_TUD_DFU_XFER_BUFSIZE)
+  BENCH_INTERFACE(512)
 };
 
 uint8_t const desc_configuration_upgrade[] =
@@ -94,9 +115,27 @@ uint8_t const desc_configuration_upgrade[] =
   TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN + 9, 0x00, 200),
 
   // Interface number, Alternate count, starting string index, attributes, detach timeout, transfer size
-  TUD_DFU_DESCRIPTOR(ITF_NUM_DFU_MODE, 4, 4, FUNC_ATTRS, 50, CFG_TUD_DFU_XFER_BUFSIZE),
+  TUD_DFU_DESCRIPTOR(ITF_NUM_DFU_MODE, 4, 4, FUNC_ATTRS, 50, CFG_TUD_DFU_XFER_BUFSIZE)
+  BENCH_INTERFACE(512)
+};
+
+#ifdef USB_BENCH
+// Bulk endpoints are limited to 64 bytes when we enumerate at full speed
+uint8_t const desc_configuration_fs[] =
+{
+  TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, 0x00, 200),
+  TUD_DFU_DESCRIPTOR(ITF_NUM_DFU_MODE, 3, 4, FUNC_ATTRS, 50, CFG_TUD_DFU_XFER_BUFSIZE)
+  BENCH_INTERFACE(64)
 };
 
+uint8_t const desc_configuration_upgrade_fs[] =
+{
+  TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN + 9, 0x00, 200),
+  TUD_DFU_DESCRIPTOR(ITF_NUM_DFU_MODE, 4, 4, FUNC_ATTRS, 50, CFG_TUD_DFU_XFER_BUFSIZE)
+  BENCH_INTERFACE(64)
+};
+#endif
+
 static bool bl_upgrade_alt = false;
 
 void enable_bootloader_alt(void){
@@ -109,6 +148,11 @@ void enable_bootloader_alt(void){
 uint8_t const * tud_descriptor_configuration_cb(uint8_t index)
 {
   (void) index; // for multiple configurations
+#ifdef USB_BENCH
+  if(tud_speed_get() != TUSB_SPEED_HIGH){
+    return bl_upgrade_alt ? desc_configuration_upgrade_fs : desc_configuration_fs;
+  }
+#endif
   if(bl_upgrade_alt){
     return desc_configuration_upgrade;
   }
@@ -126,10 +170,15 @@ char const* string_desc_arr [] =
   "Good Stuff Department",                      // 1: Manufacturer
   "butterstick (dfu " CONFIG_REPO_GIT_DESC ")", // 2: Product
   "",                                           // 3: Serial, derived from FLASH UUID
+#ifdef GATEWARE_AB_SLOTS
+  "flash gateware (inactive A/B slot)",         // 4: DFU alt0 name
+#else
   "flash @0x200000 (gateware)",                 // 4: DFU alt0 name
+#endif
   "flash @0x400000 (firmware)",                 // 5: DFU alt1 name
   "flash @0x800000 (extra)",                    // 6: DFU alt2 name
   "flash @0x000000 (bootloader)",               // 7: DFU alt3 name
+  "usb bench (source/sink/loopback)",           // 8: Benchmark interface
 };
 
 //--------------------------------------------------------------------+
@@ -155,6 +204,12 @@ https://developers.google.com/web/fundamentals/native-hardware/build-for-webusb/
 enum
 {
   VENDOR_REQUEST_MICROSOFT = 1,
+  VENDOR_REQUEST_SLOTS = 2,
+  VENDOR_REQUEST_PERF = 3,
+  VENDOR_REQUEST_TRACE = 4,
+  VENDOR_REQUEST_BUS = 5,
+  VENDOR_REQUEST_IRQ = 6,
+  VENDOR_REQUEST_BOOT = 7,
 };
 
 // BOS Descriptor is required for webUSB
@@ -200,8 +255,23 @@ TU_VERIFY_STATIC(sizeof(desc_ms_os_20) == MS_OS_20_DESC_LEN, "Incorrect size");
 //--------------------------------------------------------------------+
 // BOS/WCID vendor class
 //--------------------------------------------------------------------+
+#ifdef EVENT_TRACE
+// Events handed to the current drain, released once the host has them
+static uint32_t trace_pending;
+#endif
+
 bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t const * request)
 {
+#ifdef EVENT_TRACE
+  if (stage == CONTROL_STAGE_ACK && request->bmRequestType_bit.type == TUSB_REQ_TYPE_VENDOR &&
+      request->bRequest == VENDOR_REQUEST_TRACE && request->wValue == 1)
+  {
+    trace_consume(trace_pending);
+    trace_pending = 0;
+    return true;
+  }
+#endif
+
   // nothing to with DATA & ACK stage
   if (stage != CONTROL_STAGE_SETUP) return true;
 
@@ -223,6 +293,91 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_requ
             return false;
           }
 
+#ifdef GATEWARE_AB_SLOTS
+        // wValue 0: read the boot record, 1: confirm the trial slot, 2: roll back
+        case VENDOR_REQUEST_SLOTS:
+          switch (request->wValue)
+          {
+            case 0:
+              return tud_control_xfer(rhport, request, (void*)(uintptr_t) gw_slots_record(), sizeof(gw_slot_record_t));
+            case 1:
+              if (!gw_slots_confirm()) return false;
+              return tud_control_status(rhport, request);
+            case 2:
+              gw_slots_rollback();
+              return tud_control_status(rhport, request);
+            default:
+              return false;
+          }
+#endif
+
+        // Boot phase stamps, reset to enumeration is MOUNTED - BUS_RESET
+        case VENDOR_REQUEST_BOOT:
+          return tud_control_xfer(rhport, request, (void*)(uintptr_t) bootprof_snapshot(), sizeof(bootprof_snapshot_t));
+
+        // wValue 0: read the update counters, 1: reset them
+        case VENDOR_REQUEST_PERF:
+          switch (request->wValue)
+          {
+            case 0:
+              return tud_control_xfer(rhport, request, (void*)(uintptr_t) perf_snapshot(), sizeof(perf_counters_t));
+            case 1:
+              perf_reset();
+              return tud_control_status(rhport, request);
+            default:
+              return false;
+          }
+
+#ifdef EVENT_TRACE
+        // wValue 0: ring info, 1: drain the oldest events (up to wLength), 2: clear
+        case VENDOR_REQUEST_TRACE:
+          switch (request->wValue)
+          {
+            case 0:
+              return tud_control_xfer(rhport, request, (void*)(uintptr_t) trace_info(), sizeof(trace_info_t));
+            case 1:
+            {
+              const trace_event_t* events = trace_peek(request->wLength / sizeof(trace_event_t), &trace_pending);
+              return tud_control_xfer(rhport, request, (void*)(uintptr_t) events, trace_pending * sizeof(trace_event_t));
+            }
+            case 2:
+              trace_clear();
+              return tud_control_status(rhport, request);
+            default:
+              return false;
+          }
+#endif
+
+#ifdef BUS_STATS
+        // wValue 0: read the bus counters, 1: clear them
+        case VENDOR_REQUEST_BUS:
+          switch (request->wValue)
+          {
+            case 0:
+              return tud_control_xfer(rhport, request, (void*)(uintptr_t) busmon_snapshot(), sizeof(busmon_snapshot_t));
+            case 1:
+              busmon_clear();
+              return tud_control_status(rhport, request);
+            default:
+              return false;
+          }
+#endif
+
+#ifdef IRQ_STATS
+        // wValue 0: read the interrupt histograms, 1: reset them
+        case VENDOR_REQUEST_IRQ:
+          switch (request->wValue)
+          {
+            case 0:
+              return tud_control_xfer(rhport, request, (void*)(uintptr_t) irq_stats_snapshot(), sizeof(irq_stats));
+            case 1:
+              irq_stats_reset();
+              return tud_control_status(rhport, request);
+            default:
+              return false;
+          }
+#endif
+
         default: break;
       }
     break;
@@ -234,7 +389,11 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_requ
   return false;
 }
 
-static uint16_t _desc_str[40];
+#define STRING_COUNT (sizeof(string_desc_arr)/sizeof(string_desc_arr[0]))
+#define STRING_MAX_CHARS 39
+
+// All string descriptors, built once in UTF-16 so enumeration only hands out pointers
+static uint16_t _desc_str[STRING_COUNT][STRING_MAX_CHARS + 1];
 
 char hex(uint8_t d){
   if(d <= 0x9)
@@ -242,60 +401,64 @@ char hex(uint8_t d){
   return d - 10 + 'a';
 }
 
-// Invoked when received GET STRING DESCRIPTOR request
-// Application return pointer to descriptor, whose contents must exist long enough for transfer to complete
-uint16_t const* tud_descriptor_string_cb(uint8_t index, uint16_t langid)
+void usb_descriptors_init(void)
 {
-  (void) langid;
+  for (uint8_t index = 0; index < STRING_COUNT; index++)
+  {
+    uint16_t* s = &_desc_str[index][1];
+    size_t chr_count;
 
-  size_t chr_count;
+    if ( index == 0)
+    {
+      memcpy(s, string_desc_arr[0], 2);
+      chr_count = 1;
+    }
+    else if(index == 3){
+      uint8_t uuid[8];
 
-  if ( index == 0)
-  {
-    memcpy(&_desc_str[1], string_desc_arr[0], 2);
-    chr_count = 1;
-  }
-  else if(index == 3){
-    uint8_t uuid[8];
+      spiflash_read_uuid(uuid);
+      chr_count = 19;
 
-    spiflash_read_uuid(uuid);
-    chr_count = 19;
+      for(uint8_t i=0; i<8; i++)
+      {
+        /* Add dashes every 2 bytes */
+        if(i && !(i & 1)){
+          *s++ = '-';
+        }
 
-    uint16_t* s = &_desc_str[1];
-    // Convert ASCII string into UTF-16
-    for(uint8_t i=0; i<8; i++)
-    {
-      /* Add dashes every 2 bytes */
-      if(i && !(i & 1)){
-        *s++ = '-';
+        *s++ = hex(uuid[i] >> 4);
+        *s++ = hex(uuid[i] & 0xF);
       }
-
-      *s++ = hex(uuid[i] >> 4);
-      *s++ = hex(uuid[i] & 0xF);
     }
-  }
-  else
-  {
-    
-    if ( !(index < sizeof(string_desc_arr)/sizeof(string_desc_arr[0])) ) return NULL;
+    else
+    {
+      const char* str = string_desc_arr[index];
 
-    const char* str = string_desc_arr[index];
+      // Cap at max char
+      chr_count = strlen(str);
+      if ( chr_count > STRING_MAX_CHARS ) {
+        chr_count = STRING_MAX_CHARS;
+      }
 
-    // Cap at max char
-    chr_count = strlen(str);
-    if ( chr_count > 39 ) {
-      chr_count = 39;
+      // Convert ASCII string into UTF-16
+      for(uint8_t i=0; i<chr_count; i++)
+      {
+        s[i] = str[i];
+      }
     }
 
-    // Convert ASCII string into UTF-16
-    for(uint8_t i=0; i<chr_count; i++)
-    {
-      _desc_str[1+i] = str[i];
-    }
+    // first byte is length (including header), second byte is string type
+    _desc_str[index][0] = (uint16_t)((((uint16_t)TUSB_DESC_STRING) << 8 ) | (2u*chr_count + 2u));
   }
+}
+
+// Invoked when received GET STRING DESCRIPTOR request
+// Application return pointer to descriptor, whose contents must exist long enough for transfer to complete
+uint16_t const* tud_descriptor_string_cb(uint8_t index, uint16_t langid)
+{
+  (void) langid;
 
-  // first byte is length (including header), second byte is string type
-  _desc_str[0] = (uint16_t)((((uint16_t)TUSB_DESC_STRING) << 8 ) | (2u*chr_count + 2u));
+  if ( !(index < STRING_COUNT) ) return NULL;
 
-  return _desc_str;
+  return _desc_str[index];
 }
@@ -0,0 +1,97 @@
+/*
+ *  Copyright 2021 Gregory Davill <greg.davill@gmail.com>
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <generated/mem.h>
+#include <system.h>
+#include <crc.h>
+
+#include "flash.h"
+#include "xip.h"
+
+#ifdef FIRMWARE_XIP
+
+/* Placed at the start of the xip region by linker-xip.ld */
+__attribute__((section(".xip.header"), used))
+const xip_header_t xip_header = {
+	.magic = XIP_MAGIC,
+	.build_id = FIRMWARE_XIP_BUILD_ID,
+};
+
+/* Bounds of the linked image, header included */
+extern const uint8_t _fxip[];
+extern const uint8_t _exip[];
+
+static bool image_valid(uint32_t offset)
+{
+	const uint32_t *fbi = (const uint32_t *)(SPIFLASH_BASE + offset);
+	const xip_header_t *header = (const xip_header_t *)&fbi[2];
+	uint32_t length = _exip - _fxip;
+
+	flush_cpu_dcache();
+
+	if (fbi[0] != length)
+		return false;
+
+	if (header->magic != XIP_MAGIC || header->build_id != FIRMWARE_XIP_BUILD_ID)
+		return false;
+
+	return crc32((const unsigned char *)header, length) == fbi[1];
+}
+
+/* Runs entirely from ROM, the master can't program from the memory mapped window
+ * so every page goes through a buffer.
+ */
+static void image_copy(void)
+{
+	uint8_t page[256];
+	uint32_t length = 8 + (_exip - _fxip);
+
+	for (uint32_t offset = 0; offset < FIRMWARE_XIP_SIZE; offset += FLASH_64K_BLOCK_ERASE_SIZE)
+	{
+		spiflash_write_enable();
+		spiflash_sector_erase(FIRMWARE_XIP_OFFSET + offset);
+	}
+
+	for (uint32_t offset = 0; offset < length; offset += sizeof(page))
+	{
+		flush_cpu_dcache();
+		memcpy(page, (const void *)(SPIFLASH_BASE + FIRMWARE_XIP_STAGING_OFFSET + offset), sizeof(page));
+
+		spiflash_write_enable();
+		spiflash_page_program(FIRMWARE_XIP_OFFSET + offset, page, sizeof(page));
+	}
+
+	flush_cpu_dcache();
+	flush_cpu_icache();
+}
+
+/* Called before the first call into XIP code. CRCs the active copy on every
+ * bootloader entry (tens of ms), only the fast boot path skips it.
+ */
+bool xip_prepare(void)
+{
+	if (image_valid(FIRMWARE_XIP_OFFSET))
+		return true;
+
+	if (!image_valid(FIRMWARE_XIP_STAGING_OFFSET))
+		return false;
+
+	/* The bootloader partition is normally locked */
+	bool locked = spiflash_protection_read();
+	if (locked)
+		spiflash_protection_write(false);
+
+	image_copy();
+
+	if (locked)
+		spiflash_protection_write(true);
+
+	return image_valid(FIRMWARE_XIP_OFFSET);
+}
+
+#endif
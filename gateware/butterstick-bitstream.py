@@ -16,8 +16,10 @@ import lxbuildenv
 
 
 import os
+import random
 import shutil
 import argparse
+import ipaddress
 import subprocess
 
 
@@ -40,6 +42,9 @@ from rtl.platform import butterstick_r1d0
 from rtl.eptri import LunaEpTriWrapper
 from rtl.rgb import Leds
 from rtl.vccio import VccIo
+from rtl.cycles import CycleCounter
+from rtl.bootprof import BootProfile
+from rtl.busmon import BusMonitor
 
 # CRG ---------------------------------------------------------------------------------------------
 
@@ -117,6 +122,11 @@ class CRG(Module):
     
 
 
+# Firmware XIP (--xip) at the top of the bootloader partition, see firmware/include/xip.h
+XIP_STAGING_OFFSET = 0x180000
+XIP_OFFSET         = 0x1C0000
+XIP_SIZE           = 0x40000
+
 # BaseSoC ------------------------------------------------------------------------------------------
 
 class BaseSoC(SoCCore):
@@ -124,6 +134,7 @@ class BaseSoC(SoCCore):
         "rom":      0x00000000,  # (default shadow @0x80000000)
         "sram":     0x10000000,  # (default shadow @0xa0000000)
         "spiflash": 0x20000000,  # (default shadow @0xa0000000)
+        "ethmac":   0x30000000,
         "main_ram": 0x40000000,  # (default shadow @0xc0000000)
         "csr":      0xf0000000,  # (default shadow @0xe0000000)
         "usb":      0xf0010000,
@@ -136,7 +147,7 @@ class BaseSoC(SoCCore):
     }
     interrupt_map.update(SoCCore.interrupt_map)
 
-    def __init__(self, sys_clk_freq=int(60e6), toolchain="trellis", **kwargs):
+    def __init__(self, sys_clk_freq=int(60e6), toolchain="trellis", usb_double_buffer=False, usb_bench=False, irq_stats=False, ab_slots=False, xip=False, trace=False, dlog=False, bus_stats=False, eth_flash=None, eth_flash_port=6565, **kwargs):
         # Board Revision ---------------------------------------------------------------------------
         revision = kwargs.get("revision", "0.2")
         device = kwargs.get("device", "25F")
@@ -152,6 +163,18 @@ class BaseSoC(SoCCore):
         # CRG --------------------------------------------------------------------------------------
         self.submodules.crg = crg = CRG(platform, sys_clk_freq)
 
+        # Cycle counter ----------------------------------------------------------------------------
+        self.submodules.cycles = CycleCounter(irq=self.cpu.interrupt if irq_stats else None)
+        if irq_stats:
+            self.add_constant("IRQ_STATS")
+        if trace:
+            self.add_constant("EVENT_TRACE")
+        if dlog:
+            self.add_constant("DEFERRED_LOG")
+
+        # Boot Profile -----------------------------------------------------------------------------
+        self.submodules.bootprof = BootProfile()
+
         # VCCIO Control ----------------------------------------------------------------------------
         self.submodules.vccio = VccIo(platform.request("vccio_ctrl"))
 
@@ -160,6 +183,17 @@ class BaseSoC(SoCCore):
         from litespi.opcodes import SpiNorFlashOpCodes as Codes
         self.add_spi_flash(mode="4x", module=W25Q128JV(Codes.READ_1_1_4), with_master=True)
 
+        # Firmware XIP -----------------------------------------------------------------------------
+        # Linker only region inside the memory mapped flash, fetched through the VexRiscv icache.
+        # The build id ties the ROM to the XIP image it was linked against.
+        if xip:
+            self.add_memory_region("xip", self.mem_map["spiflash"] + XIP_OFFSET, XIP_SIZE, type="cached+linker")
+            self.add_constant("FIRMWARE_XIP")
+            self.add_constant("FIRMWARE_XIP_OFFSET", XIP_OFFSET)
+            self.add_constant("FIRMWARE_XIP_STAGING_OFFSET", XIP_STAGING_OFFSET)
+            self.add_constant("FIRMWARE_XIP_SIZE", XIP_SIZE)
+            self.add_constant("FIRMWARE_XIP_BUILD_ID", random.getrandbits(32))
+
 
         # Leds -------------------------------------------------------------------------------------
         led = platform.request("led_rgb_multiplex")
@@ -170,12 +204,21 @@ class BaseSoC(SoCCore):
         rst = Signal()
         self.submodules.reset = GPIOOut(rst)
         self.comb += platform.request("rst_n").eq(~rst)
+        if ab_slots:
+            self.add_constant("GATEWARE_AB_SLOTS")
 
         # Buttons ----------------------------------------------------------------------------------
         self.submodules.button = GPIOIn(platform.request("user_btn"))
 
         # USB --------------------------------------------------------------------------------------
-        self.submodules.usb = LunaEpTriWrapper(self.platform, base_addr=self.mem_map['usb'])
+        usb_max_packet_size = 512
+        self.submodules.usb = LunaEpTriWrapper(self.platform, base_addr=self.mem_map['usb'],
+            out_double_buffer=usb_double_buffer, max_packet_size=usb_max_packet_size)
+        self.add_constant("USB_MAX_PACKET_SIZE", usb_max_packet_size)
+        if usb_bench:
+            self.add_constant("USB_BENCH")
+        if usb_double_buffer:
+            self.add_constant("USB_OUT_EP_DOUBLE_BUFFERED")
         self.add_memory_region("usb", self.mem_map['usb'], 0x10000, type="");
         self.add_wb_slave(self.mem_map['usb'], self.usb.bus)
         for name, irq in self.usb.irqs.items():
@@ -190,6 +233,35 @@ class BaseSoC(SoCCore):
             setattr(self.submodules, name, DummyIRQ(irq))
             self.add_interrupt(name)
 
+        # Ethernet ---------------------------------------------------------------------------------
+        # Image push over UDP into the same flash path as DFU (firmware/eth_flash.c). With a
+        # netmask the host part of the address comes from the flash UUID, one bitstream per rack.
+        if eth_flash is not None:
+            from liteeth.phy.ecp5rgmii import LiteEthPHYRGMII
+            eth_ip = ipaddress.ip_interface(eth_flash)
+            self.submodules.ethphy = LiteEthPHYRGMII(
+                clock_pads = platform.request("eth_clk"),
+                pads       = platform.request("eth"))
+            self.add_csr("ethphy")
+            self.add_ethernet(phy=self.ethphy)
+            self.add_constant("ETH_FLASH")
+            self.add_constant("ETH_IP", int(eth_ip.ip))
+            self.add_constant("ETH_NETMASK", int(eth_ip.netmask))
+            self.add_constant("ETH_FLASH_PORT", eth_flash_port)
+
+        # Bus Monitor ------------------------------------------------------------------------------
+        if bus_stats:
+            csr_bus = self.bus.slaves["csr"]
+            self.submodules.busmon = BusMonitor([
+                ("cpu_ibus", self.cpu.ibus),
+                ("cpu_dbus", self.cpu.dbus),
+                ("csr",      csr_bus),
+                ("usb",      self.usb.bus),
+                ("spiflash", self.bus.slaves["spiflash"]),
+            ], csr_bus=csr_bus, csr_paging=self.csr.paging, csr_banks=self.csr.n_locs)
+            self.add_constant("BUS_STATS")
+            self.add_constant("BUSMON_CSR_PAGING", self.csr.paging)
+
 
         #Add GIT repo to the firmware
         git_rev_cmd = subprocess.Popen("git describe --tags --first-parent --always".split(),
@@ -241,9 +313,57 @@ def main():
         "--update-firmware", default=False, action='store_true',
         help="compile firmware and update existing gateware"
     )
+    parser.add_argument(
+        "--usb-double-buffer", default=False, action='store_true',
+        help="use ping-pong packet buffers for USB OUT endpoints"
+    )
+    parser.add_argument(
+        "--irq-stats", default=False, action='store_true',
+        help="timestamp interrupts and record per source latency histograms in firmware"
+    )
+    parser.add_argument(
+        "--bus-stats", default=False, action='store_true',
+        help="count wishbone transactions and wait states for the CPU, CSR, USB and SPI flash buses"
+    )
+    parser.add_argument(
+        "--trace", default=False, action='store_true',
+        help="record timestamped USB, DFU and flash events in a ring buffer the host can drain"
+    )
+    parser.add_argument(
+        "--dlog", default=False, action='store_true',
+        help="send firmware and tinyusb logs over the UART as deferred binary records (extra/dlog.py)"
+    )
+    parser.add_argument(
+        "--usb-bench", default=False, action='store_true',
+        help="add a vendor bulk source/sink/loopback interface for USB benchmarking"
+    )
+    parser.add_argument(
+        "--ab-slots", default=False, action='store_true',
+        help="keep two gateware slots behind a jump stub at 0x200000, with trial boots and rollback"
+    )
+    parser.add_argument(
+        "--xip", default=False, action='store_true',
+        help="run the USB stack from the bootloader flash partition, only hot code stays in ROM"
+    )
+    parser.add_argument(
+        "--eth-flash", default=None, metavar="IP[/PREFIX]",
+        help="accept image pushes over UDP on the RGMII PHY, a prefix derives the host part from the flash UUID (e.g. 10.42.0.0/16)"
+    )
+    parser.add_argument(
+        "--eth-flash-port", default=6565, type=int,
+        help="UDP port for --eth-flash (default=6565)"
+    )
+    parser.add_argument(
+        "--bitstream-spimode", default="qspi", choices=["fast-read", "dual-spi", "qspi"],
+        help="SPI mode the FPGA uses to load configuration from flash (default=qspi)"
+    )
+    parser.add_argument(
+        "--bitstream-freq", default="62.0", choices=["2.4", "4.8", "9.7", "19.4", "38.8", "62.0"],
+        help="configuration clock in MHz when loading from flash (default=62.0)"
+    )
     args = parser.parse_args()
 
-    soc = BaseSoC(**soc_core_argdict(args))
+    soc = BaseSoC(usb_double_buffer=args.usb_double_buffer, usb_bench=args.usb_bench, irq_stats=args.irq_stats, ab_slots=args.ab_slots, xip=args.xip, trace=args.trace, dlog=args.dlog, bus_stats=args.bus_stats, eth_flash=args.eth_flash, eth_flash_port=args.eth_flash_port, **soc_core_argdict(args))
     builder = Builder(soc, **builder_argdict(args))
     
 
@@ -294,11 +414,23 @@ def main():
 
     # create compressed config (ECP5 specific)
     output_bitstream = os.path.join(builder.gateware_dir, f"{soc.platform.name}.bit")
-    #os.system(f"ecppack --freq 38.8 --spimode qspi --compress --input {output_config} --bit {output_bitstream}")
-    os.system(f"ecppack --freq 38.8 --bootaddr 0x200000 --compress --input {output_config} --bit {output_bitstream}")
+    # The W25Q128JV runs quad reads well past 62MHz, firmware keeps QE set before handing over
+    os.system(f"ecppack --freq {args.bitstream_freq} --spimode {args.bitstream_spimode} --bootaddr 0x200000 --compress --input {output_config} --bit {output_bitstream}")
 
     dfu_file = os.path.join(builder.gateware_dir, f"{soc.platform.name}.dfu")
-    shutil.copyfile(output_bitstream, dfu_file)
+    if args.xip:
+        # Bootloader partition image: the bitstream, then the XIP firmware in the staging area
+        with open(output_bitstream, "rb") as f:
+            image = f.read()
+        if len(image) > XIP_STAGING_OFFSET:
+            raise SystemExit(f"Bitstream ({len(image)} bytes) overlaps the XIP staging area at 0x{XIP_STAGING_OFFSET:x}")
+        image += b"\xff" * (XIP_STAGING_OFFSET - len(image))
+        with open(os.path.join(builder.output_dir, "software", "fw", "oc-fw.xip"), "rb") as f:
+            image += f.read()
+        with open(dfu_file, "wb") as f:
+            f.write(image)
+    else:
+        shutil.copyfile(output_bitstream, dfu_file)
     os.system(f"dfu-suffix -v 1209 -p 5af1 -a {dfu_file}")
 
 
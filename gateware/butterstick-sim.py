@@ -0,0 +1,329 @@
+#!/usr/bin/env python3
+
+# This file is Copyright (c) Greg Davill <greg.davill@gmail.com>
+# License: BSD
+
+# Verilator simulation of the bootloader SoC. The VexRiscv runs oc-fw.bin from
+# the integrated ROM. A W25Q128JV model (rtl/spiflash_model.py) stands in for
+# the SPI flash PHY. The LED and VccIo blocks are included, and so is the USB
+# core with an idle ULPI PHY. Each scenario scripts the button and the flash
+# contents, then reports boot phase and flash command timings in sys cycles.
+
+
+# This variable defines all the external programs that this module
+# relies on.  lxbuildenv reads this variable in order to ensure
+# the build will finish without exiting due to missing third-party
+# programs.
+LX_DEPENDENCIES = ["riscv", "verilator"]
+
+# Import lxbuildenv to integrate the deps/ directory
+import lxbuildenv
+
+
+
+import os
+import re
+import argparse
+import subprocess
+
+
+from migen import *
+
+from litex.build.generic_platform import *
+from litex.build.sim import SimPlatform
+from litex.build.sim.config import SimConfig
+from litex.build.io import CRG
+
+from litex.soc.integration.soc_core import *
+from litex.soc.integration.builder import *
+
+from litex.soc.cores.gpio import GPIOOut, GPIOIn
+
+from rtl.eptri import LunaEpTriWrapper
+from rtl.rgb import Leds
+from rtl.vccio import VccIo
+from rtl.cycles import CycleCounter
+from rtl.bootprof import BootProfile
+from rtl.spiflash_model import W25Q128JVModel
+
+# Platform -----------------------------------------------------------------------------------------
+
+_io = [
+    ("sys_clk", 0, Pins(1)),
+    ("sys_rst", 0, Pins(1)),
+    ("serial", 0,
+        Subsignal("source_valid", Pins(1)),
+        Subsignal("source_ready", Pins(1)),
+        Subsignal("source_data",  Pins(8)),
+
+        Subsignal("sink_valid",   Pins(1)),
+        Subsignal("sink_ready",   Pins(1)),
+        Subsignal("sink_data",    Pins(8)),
+    ),
+]
+
+class SimButterStickPlatform(SimPlatform):
+    def __init__(self, name):
+        SimPlatform.__init__(self, "SIM", _io, name=name)
+
+# Scenarios ----------------------------------------------------------------------------------------
+
+# Written to security page 3 to request bootloader mode, see main.c
+BL_MAGIC0 = 0x021b3bcd
+
+SCENARIOS = {
+    # Magic from the user image: stays in the bootloader and erases the magic
+    "magic":  dict(button=False, magic=True),
+    # Button held through boot: stays in the bootloader
+    "button": dict(button=True,  magic=False),
+    # Neither: locks the flash, sets QE and hands over to the user image
+    "normal": dict(button=False, magic=False),
+}
+
+# Phases in firmware/include/bootprof.h order
+BOOT_STAMPS = ["start", "decided", "vccio", "usb_reset", "usb_ready", "bus_reset", "mounted", "exit"]
+
+FLASH_OPCODES = {
+    0x01: "write status 1",
+    0x02: "page program",
+    0x05: "read status 1",
+    0x06: "write enable",
+    0x31: "write status 2",
+    0x32: "quad page program",
+    0x35: "read status 2",
+    0x42: "security program",
+    0x44: "security erase",
+    0x48: "security read",
+    0x4b: "unique id",
+    0x6b: "quad read",
+    0xab: "release power-down",
+    0xb9: "power-down",
+    0xd8: "64K erase",
+}
+
+# SimSoC -------------------------------------------------------------------------------------------
+
+class SimSoC(SoCCore):
+    # Same map as BaseSoC in butterstick-bitstream.py, the firmware is built against it
+    mem_map = {
+        "rom":      0x00000000,
+        "sram":     0x10000000,
+        "spiflash": 0x20000000,
+        "main_ram": 0x40000000,
+        "csr":      0xf0000000,
+        "usb":      0xf0010000,
+    }
+    mem_map.update(SoCCore.mem_map)
+
+    interrupt_map = {
+        "timer0": 0,
+        "uart": 1,
+    }
+    interrupt_map.update(SoCCore.interrupt_map)
+
+    def __init__(self, scenario, sys_clk_freq=int(60e6), flash_init=b"", flash_time_scale=1.0, max_cycles=int(600e6), **kwargs):
+        platform = SimButterStickPlatform("sim_{}".format(scenario))
+        config = SCENARIOS[scenario]
+
+        # SoCCore ----------------------------------------------------------------------------------
+        SoCCore.__init__(self, platform, clk_freq=sys_clk_freq, cpu_type="vexriscv", csr_data_width=32, integrated_rom_size=32*1024, integrated_sram_size=16*1024, uart_name="sim", **kwargs)
+
+        # CRG, usb is clocked from sys as on the board ---------------------------------------------
+        self.submodules.crg = CRG(platform.request("sys_clk"))
+        self.clock_domains.cd_usb = ClockDomain()
+        self.comb += [
+            self.cd_usb.clk.eq(ClockSignal("sys")),
+            self.cd_usb.rst.eq(ResetSignal("sys")),
+        ]
+
+        # Cycle counter ----------------------------------------------------------------------------
+        self.submodules.cycles = CycleCounter()
+
+        # Boot Profile -----------------------------------------------------------------------------
+        self.submodules.bootprof = BootProfile()
+
+        # VCCIO Control ----------------------------------------------------------------------------
+        self.submodules.vccio = VccIo(Record([("pdm", 3), ("en", 1)]))
+
+        # SPI Flash --------------------------------------------------------------------------------
+        from litespi.modules import W25Q128JV
+        from litespi.opcodes import SpiNorFlashOpCodes as Codes
+        magic = BL_MAGIC0.to_bytes(4, "little") if config["magic"] else b""
+        spiflash_phy = W25Q128JVModel(sys_clk_freq, init=flash_init, security_init=[b"", b"", magic],
+            time_scale=flash_time_scale)
+        self.add_spi_flash(phy=spiflash_phy, mode="4x", module=W25Q128JV(Codes.READ_1_1_4), with_master=True)
+
+        # Leds -------------------------------------------------------------------------------------
+        self.submodules.leds = Leds(Signal(7), Signal(3))
+        self.add_csr("leds")
+
+        # Self Reset -------------------------------------------------------------------------------
+        rst = Signal()
+        self.submodules.reset = GPIOOut(rst)
+
+        # Buttons ----------------------------------------------------------------------------------
+        btn = Signal()
+        self.comb += btn.eq(0 if config["button"] else 1)
+        self.submodules.button = GPIOIn(btn)
+
+        # USB, the PHY never answers so the firmware times out waiting for it ----------------------
+        ulpi = Record([("dir", 1), ("nxt", 1), ("stp", 1)])
+        usb_max_packet_size = 512
+        self.submodules.usb = LunaEpTriWrapper(self.platform, base_addr=self.mem_map['usb'],
+            max_packet_size=usb_max_packet_size, ulpi_pads=ulpi)
+        self.comb += self.usb.ulpi_data.i.eq(0)
+        self.add_constant("USB_MAX_PACKET_SIZE", usb_max_packet_size)
+        self.add_memory_region("usb", self.mem_map['usb'], 0x10000, type="");
+        self.add_wb_slave(self.mem_map['usb'], self.usb.bus)
+        for name, irq in self.usb.irqs.items():
+            name = 'usb_{}'.format(name)
+            class DummyIRQ(Module):
+                def __init__(self, irq):
+                    class DummyEV(Module):
+                        def __init__(self, irq):
+                            self.irq = irq
+                    self.submodules.ev = DummyEV(irq)
+
+            setattr(self.submodules, name, DummyIRQ(irq))
+            self.add_interrupt(name)
+
+        self.add_constant('CONFIG_REPO_GIT_DESC', "sim")
+
+        # Simulation control -----------------------------------------------------------------------
+        # Bootloader mode idles once USB is up, a normal boot ends at the handover
+        cycles = Signal(64)
+        self.sync += cycles.eq(cycles + 1)
+        for i, phase in enumerate(BOOT_STAMPS):
+            stamp = getattr(self.bootprof, "_stamp{}".format(i))
+            self.sync += If(stamp.re, Display("boot: " + phase + " %0d", cycles))
+
+        usb_ready = getattr(self.bootprof, "_stamp{}".format(BOOT_STAMPS.index("usb_ready"))).re
+        self.sync += [
+            If(usb_ready | rst,
+                Display("sim: end %0d", cycles),
+                Finish()
+            ),
+            If(cycles == max_cycles,
+                Display("sim: timeout %0d", cycles),
+                Finish()
+            ),
+        ]
+
+    # Same as BaseSoC.PackageFirmware, the ROM is initialised with oc-fw.bin before the build
+    def PackageFirmware(self, builder):
+        self.finalize()
+
+        os.makedirs(builder.output_dir, exist_ok=True)
+
+        src_dir = os.path.abspath(os.path.join(os.path.dirname(__file__), "..", "firmware"))
+        builder.add_software_package("fw", src_dir)
+
+        builder._prepare_rom_software()
+        builder._generate_includes()
+        builder._generate_rom_software(compile_bios=False)
+
+        firmware_file = os.path.join(builder.output_dir, "software", "fw","oc-fw.bin")
+        firmware_data = get_mem_data(firmware_file, self.cpu.endianness)
+        self.initialize_rom(firmware_data)
+
+        # lock out compiling firmware during build steps
+        builder.compile_software = False
+
+# Report -------------------------------------------------------------------------------------------
+
+def parse_log(output):
+    result = dict(boot=[], flash={}, busy={}, end=None, timeout=False)
+    for line in output.splitlines():
+        m = re.match(r"boot: (\w+) (\d+)", line)
+        if m:
+            result["boot"].append((m.group(1), int(m.group(2))))
+        m = re.match(r"flash: cmd ([0-9a-f]+) start (\d+) cycles (\d+)", line)
+        if m:
+            count, total = result["flash"].get(int(m.group(1), 16), (0, 0))
+            result["flash"][int(m.group(1), 16)] = (count + 1, total + int(m.group(3)))
+        m = re.match(r"flash: busy ([0-9a-f]+) start (\d+) cycles (\d+)", line)
+        if m:
+            count, total = result["busy"].get(int(m.group(1), 16), (0, 0))
+            result["busy"][int(m.group(1), 16)] = (count + 1, total + int(m.group(3)))
+        m = re.match(r"sim: (end|timeout) (\d+)", line)
+        if m:
+            result["end"] = int(m.group(2))
+            result["timeout"] = m.group(1) == "timeout"
+    return result
+
+def print_report(name, result, sys_clk_freq):
+    us = lambda c: c * 1e6 / sys_clk_freq
+
+    print("\n{} {}".format(name, "(timed out)" if result["timeout"] else ""))
+    print("  {:<20} {:>12} {:>12} {:>12}".format("boot phase", "cycles", "delta", "us"))
+    last = 0
+    for phase, c in result["boot"]:
+        print("  {:<20} {:>12} {:>12} {:>12.1f}".format(phase, c, c - last, us(c)))
+        last = c
+
+    print("  {:<20} {:>6} {:>12} {:>12}".format("flash command", "count", "avg cycles", "total us"))
+    for op, (count, total) in sorted(result["flash"].items()):
+        label = "{:02x} {}".format(op, FLASH_OPCODES.get(op, ""))
+        print("  {:<20} {:>6} {:>12} {:>12.1f}".format(label, count, total // count, us(total)))
+    for op, (count, total) in sorted(result["busy"].items()):
+        label = "{:02x} busy".format(op)
+        print("  {:<20} {:>6} {:>12} {:>12.1f}".format(label, count, total // count, us(total)))
+
+# Build --------------------------------------------------------------------------------------------
+
+def main():
+    parser = argparse.ArgumentParser(description="LiteX simulation of the ButterStick bootloader")
+    parser.add_argument(
+        "--scenario", default="all", choices=list(SCENARIOS) + ["all"],
+        help="boot scenario to build and run (default=all)"
+    )
+    parser.add_argument(
+        "--flash-init", default=None,
+        help="flash image loaded from offset 0, the rest reads erased"
+    )
+    parser.add_argument(
+        "--flash-time-scale", default=1.0, type=float,
+        help="multiplier on the datasheet program, erase and status write times (default=1.0)"
+    )
+    parser.add_argument(
+        "--max-cycles", default=int(600e6), type=int,
+        help="end the simulation after this many sys cycles (default=600e6, 10s)"
+    )
+    parser.add_argument(
+        "--trace", default=False, action='store_true',
+        help="write a VCD of the whole SoC"
+    )
+    args = parser.parse_args()
+
+    flash_init = b""
+    if args.flash_init:
+        with open(args.flash_init, "rb") as f:
+            flash_init = f.read()
+
+    scenarios = list(SCENARIOS) if args.scenario == "all" else [args.scenario]
+    results = {}
+    for name in scenarios:
+        soc = SimSoC(name, flash_init=flash_init, flash_time_scale=args.flash_time_scale, max_cycles=args.max_cycles)
+        builder = Builder(soc, output_dir=os.path.join("build", soc.platform.name))
+
+        # Build firmware
+        soc.PackageFirmware(builder)
+
+        sim_config = SimConfig()
+        sim_config.add_clocker("sys_clk", freq_hz=soc.clk_freq)
+        sim_config.add_module("serial2console", "serial")
+        builder.build(sim_config=sim_config, trace=args.trace, run=False)
+
+        # Console output and the Display() lines both come out on stdout
+        sim = subprocess.run(["obj_dir/Vsim"], cwd=builder.gateware_dir,
+            stdin=subprocess.DEVNULL, stdout=subprocess.PIPE, universal_newlines=True)
+        with open(os.path.join(builder.output_dir, "sim.log"), "w") as f:
+            f.write(sim.stdout)
+
+        results[name] = (parse_log(sim.stdout), soc.clk_freq)
+
+    for name, (result, sys_clk_freq) in results.items():
+        print_report(name, result, sys_clk_freq)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,796 @@
+#!/usr/bin/env python3
+
+# This file is Copyright (c) 2021 Greg Davill <greg.davill@gmail.com>
+# License: BSD
+
+# Throughput bench for the eptri USB gateware, run in the Amaranth simulator.
+#
+# LunaEpTri is built on a UTMI bus instead of ULPI. A host model on that bus
+# resets the device and negotiates speed, then sends SETUP, IN or OUT traffic.
+# A wishbone bus functional model makes the same register accesses, in the same
+# order, as firmware/luna/eptri/dcd_eptri.c, with a tinyusb style event queue
+# drained outside the ISR. Instruction time is only estimated: a fixed cost per
+# interrupt and per event, plus an optional gap after each bus access.
+
+
+# This variable defines all the external programs that this module
+# relies on.  lxbuildenv reads this variable in order to ensure
+# the build will finish without exiting due to missing third-party
+# programs.
+LX_DEPENDENCIES = []
+
+# Import lxbuildenv to integrate the deps/ directory
+import lxbuildenv
+
+
+
+import argparse
+from collections import deque
+
+from amaranth.sim import Simulator, Settle, Passive
+
+from luna.gateware.interface.utmi import UTMIInterface
+
+from rtl.amaranth_rtl.eptri import LunaEpTri
+
+
+CLOCK_FREQUENCY = 60e6
+
+# Packet identifiers
+PID_OUT   = 0x1
+PID_IN    = 0x9
+PID_SOF   = 0x5
+PID_SETUP = 0xd
+PID_DATA0 = 0x3
+PID_DATA1 = 0xb
+PID_ACK   = 0x2
+PID_NAK   = 0xa
+PID_STALL = 0xe
+
+# UTMI line states
+LINE_SE0 = 0b00
+LINE_J   = 0b01
+LINE_K   = 0b10
+
+# usb_status_events layout, see eptri_status.py
+USB_STATUS_RESET     = 1 << 0
+USB_STATUS_SETUP     = 1 << 1
+USB_STATUS_IN        = 1 << 2
+USB_STATUS_OUT       = 1 << 3
+USB_STATUS_POWER     = 1 << 4
+USB_STATUS_OUT_READY = 1 << 12
+
+# CFG_TUD_ENDPOINT0_SIZE in tusb_config.h
+EP0_SIZE = 64
+
+# Vendor OUT request with no data stage, answered with a status ZLP
+SETUP_PACKET = bytes([0x40, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00])
+
+# Packet building --------------------------------------------------------------------------------
+
+def crc5(value, bits=11):
+    crc = 0x1f
+    for i in range(bits):
+        if (crc ^ (value >> i)) & 1:
+            crc = (crc >> 1) ^ 0x14
+        else:
+            crc >>= 1
+    return crc ^ 0x1f
+
+def crc16(data):
+    crc = 0xffff
+    for byte in data:
+        for i in range(8):
+            if (crc ^ (byte >> i)) & 1:
+                crc = (crc >> 1) ^ 0xa001
+            else:
+                crc >>= 1
+    return crc ^ 0xffff
+
+def pid_byte(pid):
+    return pid | ((~pid & 0xf) << 4)
+
+def token_packet(pid, value):
+    return bytes([pid_byte(pid), value & 0xff, (value >> 8) | (crc5(value) << 3)])
+
+def data_packet(pid, payload):
+    crc = crc16(payload)
+    return bytes([pid_byte(pid)]) + bytes(payload) + bytes([crc & 0xff, crc >> 8])
+
+# UTMI host model --------------------------------------------------------------------------------
+
+class UTMIHost:
+    """ Host side of a UTMI bus.
+
+    Packets are presented a byte at a time on rx_*, and the device's replies are
+    collected from tx_*. At high speed a byte moves every cycle. At full speed
+    one moves every 40 cycles, which is 12Mbit/s at 60MHz. The host sends SOF
+    on every (micro)frame and drives the line state to K while it is sending,
+    so the device sees bus activity and never suspends.
+    """
+
+    def __init__(self, utmi):
+        self.utmi = utmi
+        self.cycles = 0
+        self.set_speed(high=True)
+
+        self.next_sof = 0
+        self.frame = 0
+
+    def set_speed(self, high):
+        self.high_speed  = high
+        self.byte_cycles = 1 if high else 40
+        self.idle_line   = LINE_SE0 if high else LINE_J
+        self.frame_cycles = int(CLOCK_FREQUENCY * (125e-6 if high else 1e-3))
+        self.gap = 8 * self.byte_cycles
+        self.timeout = 1000 + 20 * self.byte_cycles
+
+    def tick(self, n=1):
+        for _ in range(n):
+            yield
+            self.cycles += 1
+
+    def send(self, packet):
+        utmi = self.utmi
+        yield utmi.line_state.eq(LINE_K)
+        yield utmi.rx_active.eq(1)
+        yield from self.tick()
+        for byte in packet:
+            yield utmi.rx_data.eq(byte)
+            yield utmi.rx_valid.eq(1)
+            yield from self.tick()
+            if self.byte_cycles > 1:
+                yield utmi.rx_valid.eq(0)
+                yield from self.tick(self.byte_cycles - 1)
+        yield utmi.rx_valid.eq(0)
+        yield utmi.rx_active.eq(0)
+        yield utmi.line_state.eq(self.idle_line)
+        yield from self.tick()
+
+    def receive(self):
+        """ Returns the device's next packet, or None if it doesn't answer in time. """
+        utmi = self.utmi
+        waited = 0
+        yield Settle()
+        while not (yield utmi.tx_valid):
+            if waited >= self.timeout:
+                return None
+            yield from self.tick()
+            yield Settle()
+            waited += 1
+
+        packet = []
+        while (yield utmi.tx_valid):
+            yield utmi.tx_ready.eq(1)
+            yield Settle()
+            packet.append((yield utmi.tx_data))
+            yield from self.tick()
+            if self.byte_cycles > 1:
+                yield utmi.tx_ready.eq(0)
+                yield from self.tick(self.byte_cycles - 1)
+            yield Settle()
+        return bytes(packet)
+
+    def bus_reset(self, high_speed):
+        """ SE0 reset with the chirp handshake, returns True if the device went high speed. """
+        utmi = self.utmi
+        yield utmi.tx_ready.eq(1)
+        yield utmi.line_state.eq(LINE_SE0)
+
+        # A high speed capable device answers a reset with a chirp K
+        waited = 0
+        yield Settle()
+        while not (yield utmi.tx_valid):
+            if waited >= CLOCK_FREQUENCY * 10e-3:
+                raise RuntimeError("device never chirped after bus reset")
+            yield from self.tick()
+            yield Settle()
+            waited += 1
+
+        yield utmi.line_state.eq(LINE_K)
+        while (yield utmi.tx_valid):
+            yield from self.tick()
+            yield Settle()
+        yield utmi.line_state.eq(LINE_SE0)
+        yield from self.tick(int(CLOCK_FREQUENCY * 10e-6))
+
+        if high_speed:
+            # Host chirp K-J pairs, until the device switches to its high speed transceiver
+            chirp = int(CLOCK_FREQUENCY * 50e-6)
+            for pair in range(32):
+                for line in (LINE_K, LINE_J):
+                    yield utmi.line_state.eq(line)
+                    yield from self.tick(chirp)
+                yield Settle()
+                if pair >= 2 and (yield utmi.xcvr_select) == 0:
+                    break
+            yield utmi.line_state.eq(LINE_SE0)
+            yield from self.tick(chirp)
+        else:
+            # No host chirp, the device gives up and stays at full speed
+            yield from self.tick(int(CLOCK_FREQUENCY * 3e-3))
+
+        yield Settle()
+        high = (yield utmi.xcvr_select) == 0
+        self.set_speed(high)
+        yield utmi.tx_ready.eq(1 if high else 0)
+        yield utmi.line_state.eq(self.idle_line)
+        yield from self.tick(self.gap)
+        self.next_sof = self.cycles
+        return high
+
+    def sof(self):
+        if self.cycles >= self.next_sof:
+            yield from self.send(token_packet(PID_SOF, self.frame & 0x7ff))
+            yield from self.tick(self.gap)
+            self.frame += 1
+            self.next_sof += self.frame_cycles
+
+    def transaction_setup(self, addr, payload):
+        yield from self.sof()
+        yield from self.send(token_packet(PID_SETUP, addr))
+        yield from self.tick(self.gap)
+        yield from self.send(data_packet(PID_DATA0, payload))
+        reply = yield from self.receive()
+        yield from self.tick(self.gap)
+        return reply[0] & 0xf if reply else None
+
+    def transaction_out(self, addr, ep, data_pid, payload):
+        yield from self.sof()
+        yield from self.send(token_packet(PID_OUT, addr | (ep << 7)))
+        yield from self.tick(self.gap)
+        yield from self.send(data_packet(data_pid, payload))
+        reply = yield from self.receive()
+        yield from self.tick(self.gap)
+        return reply[0] & 0xf if reply else None
+
+    def transaction_in(self, addr, ep):
+        """ Returns the reply PID and payload, a data packet is ACK'd. """
+        yield from self.sof()
+        yield from self.send(token_packet(PID_IN, addr | (ep << 7)))
+        reply = yield from self.receive()
+        if not reply:
+            yield from self.tick(self.gap)
+            return None, b""
+
+        pid = reply[0] & 0xf
+        payload = b""
+        if pid in (PID_DATA0, PID_DATA1):
+            payload = reply[1:-2]
+            if crc16(payload) != (reply[-2] | (reply[-1] << 8)):
+                raise RuntimeError("bad CRC16 on IN data from EP{}".format(ep))
+            yield from self.tick(self.gap)
+            yield from self.send(bytes([pid_byte(PID_ACK)]))
+        yield from self.tick(self.gap)
+        return pid, payload
+
+# dcd_eptri.c bus functional model ---------------------------------------------------------------
+
+class EpTriFirmware:
+    """ Wishbone model of dcd_eptri.c and the tinyusb task loop above it.
+
+    Each driver function makes the register accesses the C does, in the same order.
+    Transfer completions and SETUPs go onto an event queue. The queue is only drained
+    while no interrupt is pending, as tud_task() would. The application side keeps
+    the bench endpoint busy: EP1 IN and EP1 OUT transfers are requeued as soon as
+    they complete, and each SETUP is answered with a status ZLP.
+    """
+
+    def __init__(self, dut, bench, double_buffer, max_packet_size, xfer_size, isr_cycles, task_cycles, access_gap):
+        self.bus = dut.bus
+        self.irqs = [dut.usb_device_controller.irq, dut.usb_setup.irq, dut.usb_in_ep.irq, dut.usb_out_ep.irq]
+
+        # The same names as generated/luna_usb.h
+        self.regs = {}
+        for resource, address, size in dut.soc.resources():
+            name = resource.name if isinstance(resource.name, str) else "_".join(resource.name)
+            self.regs[name] = address
+
+        self.bench           = bench
+        self.double_buffer   = double_buffer
+        self.max_packet_size = max_packet_size
+        self.xfer_size       = xfer_size
+        self.isr_cycles      = isr_cycles
+        self.task_cycles     = task_cycles
+        self.access_gap      = access_gap
+
+        self.cycles     = 0
+        self.bus_cycles = 0
+        self.accesses   = 0
+        self.interrupts = 0
+
+        self.connected = False
+        self.ready     = False
+        self.events    = deque()
+
+        self.rx_max_packet = [0] * 16
+        self.tx_max_packet = [0] * 16
+        self.rx_buffer = [None] * 16
+        self.rx_offset = [0] * 16
+        self.rx_max    = [0] * 16
+        self.tx_buffer = [None] * 16
+        self.tx_offset = [0] * 16
+        self.tx_max    = [0] * 16
+        self.tx_ep     = 0
+        self.tx_active = False
+
+    def tick(self, n=1):
+        for _ in range(n):
+            yield
+            self.cycles += 1
+
+    def access(self, name, value=None):
+        bus = self.bus
+        yield bus.adr.eq(self.regs[name] >> 2)
+        yield bus.dat_w.eq(value or 0)
+        yield bus.we.eq(value is not None)
+        yield bus.sel.eq(0xf)
+        yield bus.cyc.eq(1)
+        yield bus.stb.eq(1)
+
+        cycles = 0
+        while True:
+            yield from self.tick()
+            cycles += 1
+            yield Settle()
+            if (yield bus.ack):
+                break
+        data = yield bus.dat_r
+
+        yield bus.cyc.eq(0)
+        yield bus.stb.eq(0)
+        yield bus.we.eq(0)
+        yield from self.tick(1 + self.access_gap)
+
+        self.bus_cycles += cycles
+        self.accesses += 1
+        return data
+
+    def read(self, name):
+        return (yield from self.access(name))
+
+    def write(self, name, value):
+        yield from self.access(name, value)
+
+    def clear_pending(self, name):
+        pending = yield from self.read(name + "_ev_pending")
+        yield from self.write(name + "_ev_pending", pending)
+
+    # PIPE HELPER
+
+    def advance_tx_ep(self):
+        prev_tx_ep = self.tx_ep
+        self.tx_ep = (self.tx_ep + 1) & 0xf
+        while self.tx_ep != prev_tx_ep:
+            if self.tx_buffer[self.tx_ep] is not None:
+                return True
+            self.tx_ep = (self.tx_ep + 1) & 0xf
+        return self.tx_buffer[self.tx_ep] is not None
+
+    def tx_more_data(self):
+        ep = self.tx_ep
+        added_bytes = 0
+        while added_bytes < self.tx_max_packet[ep] and self.tx_offset[ep] < self.tx_max[ep]:
+            yield from self.write("usb_in_ep_data", self.tx_buffer[ep][self.tx_offset[ep]])
+            self.tx_offset[ep] += 1
+            added_bytes += 1
+
+        # Updating the epno queues the data
+        yield from self.write("usb_in_ep_epno", ep & 0xf)
+
+    def process_tx(self):
+        if self.tx_buffer[self.tx_ep] is None:
+            if self.advance_tx_ep():
+                yield from self.tx_more_data()
+            else:
+                self.tx_active = False
+            return
+
+        if self.tx_offset[self.tx_ep] >= self.tx_max[self.tx_ep]:
+            self.tx_buffer[self.tx_ep] = None
+            xferred_bytes = self.tx_max[self.tx_ep]
+            xferred_ep = self.tx_ep
+
+            if not self.advance_tx_ep():
+                self.tx_active = False
+
+            self.events.append(("xfer", 0x80 | xferred_ep, xferred_bytes))
+            if not self.tx_active:
+                return
+
+        yield from self.tx_more_data()
+
+    def complete_rx(self, ep):
+        self.rx_buffer[ep] = None
+        self.events.append(("xfer", ep, self.rx_offset[ep]))
+
+    def rx_one_packet(self, status):
+        ep = (status >> 8) & 0xf
+        if self.rx_buffer[ep] is None:
+            return False
+
+        packet_len = status >> 16
+        for i in range(packet_len):
+            c = yield from self.read("usb_out_ep_data")
+            if self.rx_offset[ep] + i < self.rx_max[ep]:
+                self.rx_buffer[ep][self.rx_offset[ep] + i] = c
+
+        # Hand the buffer back, the receiver may already be filling the other one.
+        yield from self.write("usb_out_ep_release", 1)
+
+        self.rx_offset[ep] = min(self.rx_offset[ep] + packet_len, self.rx_max[ep])
+        if self.rx_offset[ep] == self.rx_max[ep] or packet_len < self.rx_max_packet[ep]:
+            yield from self.write("usb_out_ep_epno", ep)
+            yield from self.write("usb_out_ep_prime", 0)
+            self.complete_rx(ep)
+        return True
+
+    def process_rx(self, status):
+        if self.double_buffer:
+            yield from self.clear_pending("usb_out_ep")
+            while True:
+                status = yield from self.read("usb_status_events")
+                if not status & USB_STATUS_OUT_READY:
+                    return
+                if not (yield from self.rx_one_packet(status)):
+                    return
+
+        ep = (status >> 8) & 0xf
+        max_packet = self.rx_max_packet[ep]
+
+        # Drain the FIFO into the destination buffer
+        total_read = 0
+        while (yield from self.read("usb_out_ep_have")):
+            c = yield from self.read("usb_out_ep_data")
+            if self.rx_offset[ep] + total_read < self.rx_max[ep]:
+                self.rx_buffer[ep][self.rx_offset[ep] + total_read] = c
+            total_read += 1
+
+        self.rx_offset[ep] = min(self.rx_offset[ep] + total_read, self.rx_max[ep])
+        offset = self.rx_offset[ep]
+        if (offset == self.rx_max[ep]
+                or (total_read == 0 and offset % max_packet == 0)
+                or (offset % max_packet != 0 and total_read < max_packet + 2)):
+            self.complete_rx(ep)
+        else:
+            yield from self.write("usb_out_ep_enable", 1)
+
+        yield from self.clear_pending("usb_out_ep")
+
+    # CONTROLLER API
+
+    def dcd_reset(self):
+        yield from self.write("usb_setup_ev_enable", 0)
+        yield from self.write("usb_in_ep_ev_enable", 0)
+        yield from self.write("usb_out_ep_ev_enable", 0)
+
+        yield from self.write("usb_setup_address", 0)
+
+        yield from self.write("usb_setup_reset", 1)
+        yield from self.write("usb_in_ep_reset", 1)
+        yield from self.write("usb_out_ep_reset", 1)
+
+        self.rx_buffer = [None] * 16
+        self.rx_max    = [0] * 16
+        self.rx_offset = [0] * 16
+        self.tx_buffer = [None] * 16
+        self.tx_max    = [0] * 16
+        self.tx_offset = [0] * 16
+        self.tx_ep     = 0
+        self.tx_active = False
+
+        self.rx_max_packet[0] = EP0_SIZE
+        self.tx_max_packet[0] = EP0_SIZE
+
+        yield from self.write("usb_device_controller_ev_pending", 0xff)
+        yield from self.clear_pending("usb_setup")
+        yield from self.clear_pending("usb_in_ep")
+        yield from self.clear_pending("usb_out_ep")
+        yield from self.write("usb_in_ep_ev_enable", 1)
+        yield from self.write("usb_out_ep_ev_enable", 1)
+        yield from self.write("usb_setup_ev_enable", 1)
+        yield from self.write("usb_device_controller_ev_enable", 1)
+
+        yield from self.read("usb_device_controller_speed")
+        self.events.append(("reset",))
+
+    def dcd_init(self):
+        yield from self.write("usb_device_controller_connect", 0)
+
+        yield from self.write("usb_setup_reset", 1)
+        yield from self.write("usb_in_ep_reset", 1)
+        yield from self.write("usb_out_ep_reset", 1)
+
+        self.rx_max_packet[0] = EP0_SIZE
+        self.tx_max_packet[0] = EP0_SIZE
+
+        yield from self.clear_pending("usb_device_controller")
+        yield from self.clear_pending("usb_setup")
+        yield from self.clear_pending("usb_in_ep")
+        yield from self.clear_pending("usb_out_ep")
+        yield from self.write("usb_device_controller_ev_enable", 1)
+        yield from self.write("usb_in_ep_ev_enable", 1)
+        yield from self.write("usb_out_ep_ev_enable", 1)
+        yield from self.write("usb_setup_ev_enable", 1)
+
+        yield from self.clear_pending("usb_status")
+        yield from self.write("usb_status_ev_enable", 3)
+
+        yield from self.write("usb_device_controller_connect", 1)
+        self.connected = True
+
+    def dcd_edpt_xfer(self, ep_addr, total_bytes):
+        ep = ep_addr & 0xf
+
+        if ep_addr & 0x80:
+            self.tx_offset[ep] = 0
+            self.tx_max[ep] = total_bytes
+            self.tx_buffer[ep] = bytes((i * 13 + 7) & 0xff for i in range(total_bytes))
+
+            if not self.tx_active:
+                self.tx_ep = ep
+                self.tx_active = True
+                yield from self.tx_more_data()
+        else:
+            self.rx_buffer[ep] = bytearray(total_bytes)
+            self.rx_offset[ep] = 0
+            self.rx_max[ep] = total_bytes
+
+            yield from self.write("usb_out_ep_epno", ep)
+            if self.double_buffer:
+                # Prime for the packets this transfer takes
+                max_packet = self.rx_max_packet[ep]
+                yield from self.write("usb_out_ep_prime", max(1, -(-total_bytes // max_packet)))
+            else:
+                yield from self.write("usb_out_ep_prime", 1)
+            yield from self.write("usb_out_ep_enable", 1)
+
+            if self.double_buffer:
+                status = yield from self.read("usb_status_events")
+                if (status & USB_STATUS_OUT_READY) and ((status >> 8) & 0xf) == ep:
+                    yield from self.process_rx(status)
+
+    # ISR
+
+    def handle_setup(self):
+        packet = []
+        while (yield from self.read("usb_setup_have")):
+            packet.append((yield from self.read("usb_setup_data")))
+
+        if len(packet) == 8:
+            self.events.append(("setup", bytes(packet)))
+
+        yield from self.clear_pending("usb_setup")
+
+    def dcd_int_handler(self):
+        while True:
+            status = yield from self.read("usb_status_events")
+
+            if status & USB_STATUS_RESET:
+                yield from self.clear_pending("usb_device_controller")
+                yield from self.dcd_reset()
+            elif status & USB_STATUS_SETUP:
+                yield from self.handle_setup()
+            elif status & USB_STATUS_IN:
+                yield from self.clear_pending("usb_in_ep")
+                yield from self.process_tx()
+            elif status & USB_STATUS_OUT:
+                yield from self.process_rx(status)
+            elif status & USB_STATUS_POWER:
+                yield from self.clear_pending("usb_status")
+            else:
+                return
+
+    # Application
+
+    def task(self, event):
+        if event[0] == "reset":
+            # Stand-in for SET_CONFIGURATION opening the bench endpoints
+            self.rx_max_packet[1] = self.max_packet_size
+            self.tx_max_packet[1] = self.max_packet_size
+            if self.bench == "in":
+                yield from self.dcd_edpt_xfer(0x81, self.xfer_size)
+            if self.bench == "out":
+                yield from self.dcd_edpt_xfer(0x01, self.xfer_size)
+            self.ready = True
+
+        elif event[0] == "setup":
+            yield from self.dcd_edpt_xfer(0x80, 0)
+
+        elif event[0] == "xfer" and event[1] in (0x01, 0x81):
+            yield from self.dcd_edpt_xfer(event[1], self.xfer_size)
+
+    def process(self):
+        yield Passive()
+        yield from self.dcd_init()
+
+        while True:
+            yield Settle()
+            pending = False
+            for irq in self.irqs:
+                pending |= bool((yield irq))
+
+            if pending:
+                self.interrupts += 1
+                yield from self.tick(self.isr_cycles)
+                yield from self.dcd_int_handler()
+            elif self.events:
+                yield from self.tick(self.task_cycles)
+                yield from self.task(self.events.popleft())
+            else:
+                yield from self.tick()
+
+# Benches ----------------------------------------------------------------------------------------
+
+class Result:
+    def __init__(self):
+        self.packets      = 0
+        self.bytes        = 0
+        self.transactions = 0
+        self.naks         = 0
+        self.timeouts     = 0
+        self.cycles       = 0
+        self.bus_cycles   = 0
+        self.accesses     = 0
+        self.interrupts   = 0
+        self.high_speed   = False
+
+def host_process(host, fw, bench, packets, max_packet_size, high_speed, result):
+    def count(pid):
+        result.transactions += 1
+        if pid == PID_NAK:
+            result.naks += 1
+        elif pid is None:
+            result.timeouts += 1
+
+    def process():
+        yield host.utmi.line_state.eq(LINE_J)
+        while not fw.connected:
+            yield from host.tick()
+
+        result.high_speed = yield from host.bus_reset(high_speed)
+
+        waited = 0
+        while not fw.ready:
+            yield from host.tick()
+            waited += 1
+            if waited > CLOCK_FREQUENCY * 10e-3:
+                raise RuntimeError("firmware model never handled the bus reset")
+
+        start = (host.cycles, fw.bus_cycles, fw.accesses, fw.interrupts)
+
+        toggle = 0
+        while result.packets < packets:
+            if bench == "setup":
+                # SETUP, then poll the status stage until the firmware queues its ZLP
+                pid = yield from host.transaction_setup(0, SETUP_PACKET)
+                count(pid)
+                if pid != PID_ACK:
+                    raise RuntimeError("SETUP not ACK'd")
+                while True:
+                    pid, payload = yield from host.transaction_in(0, 0)
+                    count(pid)
+                    if pid in (PID_DATA0, PID_DATA1):
+                        break
+                result.packets += 1
+
+            elif bench == "in":
+                pid, payload = yield from host.transaction_in(0, 1)
+                count(pid)
+                if pid in (PID_DATA0, PID_DATA1):
+                    result.packets += 1
+                    result.bytes += len(payload)
+
+            elif bench == "out":
+                payload = bytes((result.packets + i) & 0xff for i in range(max_packet_size))
+                pid = yield from host.transaction_out(0, 1, PID_DATA1 if toggle else PID_DATA0, payload)
+                count(pid)
+                if pid == PID_ACK:
+                    toggle ^= 1
+                    result.packets += 1
+                    result.bytes += len(payload)
+
+            if result.timeouts > 16:
+                raise RuntimeError("device stopped answering")
+
+        result.cycles     = host.cycles   - start[0]
+        result.bus_cycles = fw.bus_cycles - start[1]
+        result.accesses   = fw.accesses   - start[2]
+        result.interrupts = fw.interrupts - start[3]
+
+    return process
+
+def run_bench(bench, args):
+    utmi = UTMIInterface()
+    dut = LunaEpTri(out_double_buffer=args.out_double_buffer, max_packet_size=args.max_packet_size, utmi=utmi)
+
+    host = UTMIHost(utmi)
+    fw = EpTriFirmware(dut, bench, args.out_double_buffer, args.max_packet_size, args.xfer_size,
+        args.isr_cycles, args.task_cycles, args.access_gap)
+    result = Result()
+
+    sim = Simulator(dut)
+    sim.add_clock(1 / CLOCK_FREQUENCY, domain="sync")
+    sim.add_clock(1 / CLOCK_FREQUENCY, domain="usb")
+    sim.add_sync_process(fw.process, domain="sync")
+    sim.add_sync_process(host_process(host, fw, bench, args.packets, args.max_packet_size, args.speed == "high", result), domain="usb")
+
+    if args.vcd:
+        with sim.write_vcd("{}_{}.vcd".format(args.vcd, bench)):
+            sim.run()
+    else:
+        sim.run()
+
+    return result
+
+def print_report(results):
+    print("{:<6} {:>5} {:>8} {:>10} {:>10} {:>8} {:>6} {:>10} {:>9} {:>8}".format(
+        "bench", "speed", "packets", "us", "packets/s", "MB/s", "NAK%", "bus cyc/p", "access/p", "irq/p"))
+    for bench, r in results.items():
+        seconds = r.cycles / CLOCK_FREQUENCY
+        print("{:<6} {:>5} {:>8} {:>10.1f} {:>10.0f} {:>8.2f} {:>6.1f} {:>10.1f} {:>9.1f} {:>8.2f}".format(
+            bench,
+            "high" if r.high_speed else "full",
+            r.packets,
+            seconds * 1e6,
+            r.packets / seconds,
+            r.bytes / seconds / 1e6,
+            100 * r.naks / max(r.transactions, 1),
+            r.bus_cycles / r.packets,
+            r.accesses / r.packets,
+            r.interrupts / r.packets,
+        ))
+
+def main():
+    parser = argparse.ArgumentParser(description="Simulated SETUP/IN/OUT throughput of the eptri USB gateware")
+    parser.add_argument(
+        "--bench", default="all", choices=["setup", "in", "out", "all"],
+        help="traffic to run (default=all)"
+    )
+    parser.add_argument(
+        "--packets", default=32, type=int,
+        help="packets per bench, control transfers for setup (default=32)"
+    )
+    parser.add_argument(
+        "--speed", default="high", choices=["high", "full"],
+        help="speed the host negotiates (default=high)"
+    )
+    parser.add_argument(
+        "--max-packet-size", default=512, type=int,
+        help="eptri FIFO size and EP1 wMaxPacketSize (default=512)"
+    )
+    parser.add_argument(
+        "--xfer-size", default=4096, type=int,
+        help="size of each EP1 transfer the firmware queues (default=4096)"
+    )
+    parser.add_argument(
+        "--out-double-buffer", default=False, action='store_true',
+        help="use the double buffered OUT interface, and the matching driver path"
+    )
+    parser.add_argument(
+        "--isr-cycles", default=60, type=int,
+        help="cycles charged for trap entry and exit on each interrupt (default=60)"
+    )
+    parser.add_argument(
+        "--task-cycles", default=200, type=int,
+        help="cycles charged for tud_task() to dispatch each event (default=200)"
+    )
+    parser.add_argument(
+        "--access-gap", default=0, type=int,
+        help="CPU cycles after each bus access (default=0)"
+    )
+    parser.add_argument(
+        "--vcd", default=None,
+        help="write a VCD for each bench to <VCD>_<bench>.vcd"
+    )
+    args = parser.parse_args()
+
+    benches = ["setup", "in", "out"] if args.bench == "all" else [args.bench]
+    results = {}
+    for bench in benches:
+        results[bench] = run_bench(bench, args)
+
+    print_report(results)
+
+if __name__ == "__main__":
+    main()
@@ -21,6 +21,8 @@ from amaranth.hdl.rec import Direction
 
 
 from .blanksoc import BlankSoC
+from .eptri_out import DoubleBufferedOutFIFOInterface
+from .eptri_status import USBStatusInterface
 
 
 
@@ -31,8 +33,12 @@ class LunaEpTri(Elaboratable):
     USB_SETUP_ADDRESS = 0x0000_1000
     USB_IN_ADDRESS = 0x0000_2000
     USB_OUT_ADDRESS = 0x0000_3000
+    USB_STATUS_ADDRESS = 0x0000_4000
 
-    def __init__(self, base_addr=0):
+    def __init__(self, base_addr=0, out_double_buffer=False, max_packet_size=512, utmi=None):
+
+        # Simulation can hand us a UTMI interface, which replaces the ULPI translator.
+        self._utmi = utmi
 
         # Create a stand-in for our ULPI.
         self.ulpi = Record(
@@ -59,12 +65,21 @@ class LunaEpTri(Elaboratable):
         self.usb_setup = SetupFIFOInterface()
         self.add_peripheral(self.usb_setup, addr=self.USB_SETUP_ADDRESS + base_addr)
 
-        self.usb_in_ep = InFIFOInterface()
+        # FIFOs sized for high speed bulk packets.
+        self.usb_in_ep = InFIFOInterface(max_packet_size=max_packet_size)
         self.add_peripheral(self.usb_in_ep, addr=self.USB_IN_ADDRESS + base_addr)
 
-        self.usb_out_ep = OutFIFOInterface()
+        if out_double_buffer:
+            self.usb_out_ep = DoubleBufferedOutFIFOInterface(max_packet_size=max_packet_size)
+        else:
+            self.usb_out_ep = OutFIFOInterface(max_packet_size=max_packet_size)
         self.add_peripheral(self.usb_out_ep, addr=self.USB_OUT_ADDRESS + base_addr)
 
+        # ... and a combined status word, so the ISR can dispatch from a single read.
+        # It also carries the suspend/resume interrupt.
+        self.usb_status = USBStatusInterface(self.usb_device_controller, self.usb_setup, self.usb_in_ep, self.usb_out_ep)
+        self.add_peripheral(self.usb_status, addr=self.USB_STATUS_ADDRESS + base_addr)
+
         # Pulling out the bus, freezes the decoder, so this needs to be done at the end.
         self.bus = self.soc.bus_decoder.bus
 
@@ -101,19 +116,23 @@ class LunaEpTri(Elaboratable):
 
         # Create our USB device.
         m.submodules.usb_controller = self.usb_device_controller
-        m.submodules.usb = usb = USBDevice(bus=self.ulpi)
+        m.submodules.usb_status = self.usb_status
+        m.submodules.usb = usb = USBDevice(bus=self.ulpi if self._utmi is None else self._utmi)
 
         
         # Generate our domain clocks/resets.
-        m.submodules.usb_reset = controller = PHYResetController(clock_frequency=60e6, reset_length=10e-3, stop_length=2e-4, power_on_reset=True)
+        # A UTMI bus has no PHY to bring up, so it skips the 10ms power-on reset.
+        m.submodules.usb_reset = controller = PHYResetController(clock_frequency=60e6, reset_length=10e-3, stop_length=2e-4, power_on_reset=self._utmi is None)
         m.d.comb += [
             ResetSignal("usb")  .eq(controller.phy_reset),
             self.usb_holdoff    .eq(controller.phy_stop),
-            controller.trigger  .eq(self.usb_device_controller.reset)
+            controller.trigger  .eq(self.usb_device_controller.reset),
+            self.usb_status.phy_ready.eq(~controller.phy_reset & ~controller.phy_stop),
         ]
 
 
         m.d.comb += usb.full_speed_only.eq(0)
+        m.d.comb += self.usb_status.suspended.eq(usb.suspended)
 
         # Connect up our device controller.
         m.d.comb += self.usb_device_controller.attach(usb)
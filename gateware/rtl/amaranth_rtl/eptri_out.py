@@ -0,0 +1,289 @@
+# This file is Copyright (c) 2021 Greg Davill <greg.davill@gmail.com>
+# License: BSD
+#
+# Double buffered variant of LUNA's eptri OutFIFOInterface.
+
+from amaranth import Elaboratable, Module, Array, Signal, Memory, Cat
+
+from luna.gateware.usb.usb2.endpoint import EndpointInterface
+from luna.gateware.soc.peripheral import Peripheral
+
+
+class DoubleBufferedOutFIFOInterface(Peripheral, Elaboratable):
+    """ OUT component of the USB event-driven interface, with ping-pong packet buffers.
+
+    Register compatible with LUNA's OutFIFOInterface, but instead of a single FIFO that
+    has to be drained and re-enabled before the next packet can be accepted, packets are
+    captured into one of two packet buffers. While the CPU drains one buffer the other
+    one is free to ACK the next OUT transaction, so the host only sees NAKs when both
+    buffers are full.
+
+    Each buffer records the endpoint number and byte count of the packet it holds. The
+    CPU consumes the buffer at the head through `data`, then writes `release` to hand it
+    back to the receiver. `enable` is not cleared by hardware on receive.
+
+    The buffers are shared by all endpoints, and a packet at the head blocks everything
+    behind it until the CPU has somewhere to put it. So `prime` takes a packet count
+    rather than a flag: an endpoint only ACKs as many packets as the CPU asked for, and
+    NAKs the rest, instead of parking them in front of the control endpoint.
+
+    Attributes
+    ----------
+    interface: EndpointInterface
+        Our primary interface to the core USB device hardware.
+    """
+
+    def __init__(self, max_packet_size=64):
+        super().__init__()
+
+        # Buffers are addressed by packet offset, so keep them a power of two.
+        assert max_packet_size & (max_packet_size - 1) == 0
+
+        self._max_packet_size = max_packet_size
+
+        #
+        # Registers
+        #
+
+        regs = self.csr_bank()
+        self.data = regs.csr(8, "r", desc="""
+            Returns the next byte of the packet at the head of the buffer queue. Reading this
+            register advances the read pointer within the packet.
+        """)
+
+        self.data_ep = regs.csr(4, "r", desc="""
+            Endpoint number the packet at the head of the buffer queue was received on.
+        """)
+
+        self.count = regs.csr(max_packet_size.bit_length(), "r", desc="""
+            Number of payload bytes in the packet at the head of the buffer queue.
+        """)
+
+        self.ready = regs.csr(1, "r", desc="""
+            `1` iff the buffer at the head of the queue holds a complete packet.
+        """)
+
+        self.release = regs.csr(1, "w", desc="""
+            Write a `1` to return the buffer at the head of the queue to the receiver. If the
+            other buffer already holds a packet, a new event is raised for it.
+        """)
+
+        self.reset = regs.csr(1, "w", desc="""
+            Local reset for the OUT handler; discards both buffers and clears all primes.
+        """)
+
+        self.epno = regs.csr(4, "rw", desc="""
+            Selects the endpoint number to prime, stall or access the PID of.
+        """)
+
+        self.enable = regs.csr(1, "rw", desc="""
+            Controls whether any data can be received on any primed OUT endpoint. Unlike the
+            single FIFO interface this is not cleared on receive.
+        """)
+
+        self.prime = regs.csr(16, "w", desc="""
+            Write the number of packets the endpoint selected by `epno` may receive. Each
+            packet committed to a buffer uses one up; write `0` to stop receiving early.
+        """)
+
+        self.stall = regs.csr(1, "rw", desc="""
+            Controls STALL'ing the endpoint selected by `epno`.
+        """)
+
+        self.pid = regs.csr(1, "rw", desc="""
+            Contains the current PID toggle bit for the endpoint selected by `epno`.
+        """)
+
+        self.have = regs.csr(1, "r", desc="""
+            `1` iff unread bytes remain in the packet at the head of the buffer queue.
+        """)
+
+        #
+        # Internals
+        #
+
+        # Act as a Wishbone device.
+        self._bridge = self.bridge(data_width=32, granularity=8, alignment=2)
+        self.bus     = self._bridge.bus
+
+        # Raised whenever a packet becomes available at the head of the queue.
+        self._done_irq = self.event(mode="rise")
+
+        self.interface = EndpointInterface()
+
+
+    def elaborate(self, platform):
+        m = Module()
+        m.submodules.bridge = self._bridge
+
+        interface      = self.interface
+        token          = interface.tokenizer
+        rx             = interface.rx
+        handshakes_out = interface.handshakes_out
+
+        max_packet = self._max_packet_size
+
+        #
+        # Per-endpoint state.
+        #
+        endpoint_credit   = Array(Signal(16, name=f"credit_{i}") for i in range(16))
+        endpoint_stalled  = Array(Signal(name=f"stalled_{i}") for i in range(16))
+        endpoint_data_pid = Array(Signal(name=f"pid_{i}")     for i in range(16))
+
+        with m.If(self.epno.w_stb):
+            m.d.usb += self.epno.r_data.eq(self.epno.w_data)
+
+        with m.If(self.enable.w_stb):
+            m.d.usb += self.enable.r_data.eq(self.enable.w_data)
+
+        m.d.comb += [
+            self.stall.r_data .eq(endpoint_stalled[self.epno.r_data]),
+            self.pid.r_data   .eq(endpoint_data_pid[self.epno.r_data]),
+        ]
+        with m.If(self.stall.w_stb):
+            m.d.usb += endpoint_stalled[self.epno.r_data].eq(self.stall.w_data)
+        with m.If(self.pid.w_stb):
+            m.d.usb += endpoint_data_pid[self.epno.r_data].eq(self.pid.w_data)
+
+        # A SETUP always resets the control endpoint's OUT data toggle to DATA1.
+        with m.If(token.new_token & token.is_setup):
+            m.d.usb += endpoint_data_pid[0].eq(1)
+
+
+        #
+        # Packet buffers.
+        #
+        # Both buffers live in a single memory; the top address bit selects the buffer.
+        mem = Memory(width=8, depth=2 * max_packet)
+        m.submodules.mem_w = write_port = mem.write_port(domain="usb")
+        m.submodules.mem_r = read_port  = mem.read_port(domain="usb", transparent=False)
+
+        ptr_width = max_packet.bit_length()
+
+        buffer_full  = Array(Signal(name=f"buffer_full_{i}")                for i in range(2))
+        buffer_ep    = Array(Signal(4, name=f"buffer_ep_{i}")               for i in range(2))
+        buffer_count = Array(Signal(ptr_width, name=f"buffer_count_{i}")    for i in range(2))
+
+        write_sel = Signal()
+        read_sel  = Signal()
+        write_ptr = Signal(ptr_width)
+        read_ptr  = Signal(ptr_width)
+
+
+        #
+        # Receive path.
+        #
+
+        # Decide how to respond to this transaction when its token arrives, so that
+        # a buffer filling up mid-packet can't turn an ACK into a NAK.
+        accept  = Signal()
+        stalled = Signal()
+        with m.If(token.new_token):
+            m.d.usb += [
+                accept.eq(
+                    (endpoint_credit[token.endpoint] != 0) & self.enable.r_data &
+                    ~endpoint_stalled[token.endpoint] & ~buffer_full[write_sel]
+                ),
+                stalled.eq(endpoint_stalled[token.endpoint]),
+                write_ptr.eq(0),
+            ]
+
+        m.d.comb += [
+            write_port.addr .eq(Cat(write_ptr[:ptr_width - 1], write_sel)),
+            write_port.data .eq(rx.payload),
+        ]
+
+        with m.If(token.is_out & accept & rx.valid & rx.next & (write_ptr < max_packet)):
+            m.d.comb += write_port.en.eq(1)
+            m.d.usb  += write_ptr.eq(write_ptr + 1)
+
+        with m.If(interface.rx_invalid):
+            m.d.usb += write_ptr.eq(0)
+
+        # A packet with the toggle we expect is committed to the buffer; one with the
+        # wrong toggle is a retry of a packet whose ACK the host missed, so it is ACK'd
+        # and dropped.
+        pid_match = (interface.rx_pid_toggle == endpoint_data_pid[token.endpoint])
+        commit    = Signal()
+        m.d.comb += commit.eq(token.is_out & accept & interface.rx_complete & pid_match)
+
+        with m.If(commit):
+            m.d.usb += [
+                buffer_full[write_sel]  .eq(1),
+                buffer_ep[write_sel]    .eq(token.endpoint),
+                buffer_count[write_sel] .eq(write_ptr),
+                write_sel               .eq(~write_sel),
+                endpoint_data_pid[token.endpoint].eq(~endpoint_data_pid[token.endpoint]),
+                endpoint_credit[token.endpoint].eq(endpoint_credit[token.endpoint] - 1),
+            ]
+
+        # After the commit, so a new prime written in the same cycle wins.
+        with m.If(self.prime.w_stb):
+            m.d.usb += endpoint_credit[self.epno.r_data].eq(self.prime.w_data)
+
+        m.d.comb += [
+            handshakes_out.ack   .eq(interface.rx_ready_for_response & token.is_out & accept),
+            handshakes_out.nak   .eq(interface.rx_ready_for_response & token.is_out & ~accept & ~stalled),
+            handshakes_out.stall .eq(interface.rx_ready_for_response & token.is_out & stalled),
+        ]
+
+        # High speed PING flow control: answer ACK as long as a buffer is free.
+        with m.If(token.is_ping & token.ready_for_response):
+            ping_ready = (endpoint_credit[token.endpoint] != 0) & self.enable.r_data & ~buffer_full[write_sel]
+            m.d.comb += [
+                handshakes_out.ack   .eq(ping_ready & ~endpoint_stalled[token.endpoint]),
+                handshakes_out.nak   .eq(~ping_ready & ~endpoint_stalled[token.endpoint]),
+                handshakes_out.stall .eq(endpoint_stalled[token.endpoint]),
+            ]
+
+
+        #
+        # CPU read path.
+        #
+        m.d.comb += [
+            read_port.addr      .eq(Cat(read_ptr[:ptr_width - 1], read_sel)),
+            self.data.r_data    .eq(read_port.data),
+            self.data_ep.r_data .eq(buffer_ep[read_sel]),
+            self.count.r_data   .eq(buffer_count[read_sel]),
+            self.ready.r_data   .eq(buffer_full[read_sel]),
+            self.have.r_data    .eq(buffer_full[read_sel] & (read_ptr != buffer_count[read_sel])),
+        ]
+
+        with m.If(self.data.r_stb):
+            m.d.usb += read_ptr.eq(read_ptr + 1)
+
+        with m.If(self.release.w_stb & buffer_full[read_sel]):
+            m.d.usb += [
+                buffer_full[read_sel] .eq(0),
+                read_sel              .eq(~read_sel),
+                read_ptr              .eq(0),
+            ]
+
+        # Raise our event whenever a packet reaches the head of the queue: either it was
+        # committed into an empty queue, or it was waiting behind a released buffer.
+        m.d.comb += self._done_irq.stb.eq(
+            (commit & ~buffer_full[read_sel]) |
+            (self.release.w_stb & buffer_full[read_sel] & buffer_full[~read_sel])
+        )
+
+
+        #
+        # Local reset.
+        #
+        with m.If(self.reset.w_stb):
+            m.d.usb += [
+                buffer_full[0] .eq(0),
+                buffer_full[1] .eq(0),
+                write_sel      .eq(0),
+                read_sel       .eq(0),
+                write_ptr      .eq(0),
+                read_ptr       .eq(0),
+            ]
+            for i in range(16):
+                m.d.usb += [
+                    endpoint_credit[i]   .eq(0),
+                    endpoint_stalled[i]  .eq(0),
+                    endpoint_data_pid[i] .eq(0),
+                ]
+
+        return m
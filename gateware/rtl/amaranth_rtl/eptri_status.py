@@ -0,0 +1,98 @@
+# This file is Copyright (c) 2021 Greg Davill <greg.davill@gmail.com>
+# License: BSD
+#
+# Aggregated event/status word for the eptri peripherals.
+
+from amaranth import Elaboratable, Module, Signal, Cat, Const
+
+from luna.gateware.soc.peripheral import Peripheral
+
+
+class USBStatusInterface(Peripheral, Elaboratable):
+    """ Single register snapshot of the eptri interrupt and OUT state.
+
+    Lets an interrupt handler decide what to do with one bus read, instead of polling
+    the pending register of every eptri peripheral in turn.
+
+    `events` layout:
+
+    ====== =============================================================
+    bit    meaning
+    ====== =============================================================
+    0      device controller (bus reset) event pending
+    1      SETUP event pending
+    2      IN event pending
+    3      OUT event pending
+    4      suspend/resume event pending
+    8-11   OUT endpoint number of the data at the head of the OUT FIFO
+    12     OUT FIFO has data (a complete packet, when double buffered)
+    13     bus is suspended
+    14     ULPI PHY out of reset and running
+    16-31  OUT packet byte count (double buffered interface only)
+    ====== =============================================================
+
+    The interface also raises its own interrupt when the bus enters or leaves suspend,
+    so firmware sleeping in wfi is woken by bus activity.
+    """
+
+    def __init__(self, device_controller, setup, in_ep, out_ep):
+        super().__init__()
+
+        self._device_controller = device_controller
+        self._setup  = setup
+        self._in_ep  = in_ep
+        self._out_ep = out_ep
+
+        # Inputs, driven from USBDevice.suspended and the PHYResetController
+        self.suspended = Signal()
+        self.phy_ready = Signal()
+
+        regs = self.csr_bank()
+        self.events = regs.csr(32, "r", desc="""
+            Combined pending/status word, see the class documentation for the layout.
+        """)
+
+        self._suspend_irq = self.event(mode="rise")
+        self._resume_irq  = self.event(mode="fall")
+
+        # Act as a Wishbone device.
+        self._bridge = self.bridge(data_width=32, granularity=8, alignment=2)
+        self.bus     = self._bridge.bus
+
+
+    def elaborate(self, platform):
+        m = Module()
+        m.submodules.bridge = self._bridge
+
+        out_ep = self._out_ep
+
+        # The double buffered interface reports whole packets; the FIFO one only knows
+        # whether it still has bytes.
+        if hasattr(out_ep, "ready"):
+            out_ready = out_ep.ready.r_data
+            out_count = out_ep.count.r_data
+        else:
+            out_ready = out_ep.have.r_data
+            out_count = Const(0, 16)
+
+        m.d.comb += [
+            self._suspend_irq.stb.eq(self.suspended),
+            self._resume_irq.stb.eq(self.suspended),
+        ]
+
+        m.d.comb += self.events.r_data.eq(Cat(
+            self._device_controller.irq,
+            self._setup.irq,
+            self._in_ep.irq,
+            self._out_ep.irq,
+            self.irq,
+            Const(0, 3),
+            out_ep.data_ep.r_data[:4],
+            out_ready,
+            self.suspended,
+            self.phy_ready,
+            Const(0, 1),
+            out_count[:16],
+        ))
+
+        return m
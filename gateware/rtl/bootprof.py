@@ -0,0 +1,20 @@
+# Copyright (c) 2021 Gregory Davill <greg.davill@gmail.com> 
+# SPDX-License-Identifier: BSD-2-Clause
+
+from migen import *
+
+from litex.soc.interconnect.csr import *
+
+# Boot profile -----------------------------------------------------------------------------------
+
+class BootProfile(Module, AutoCSR):
+    """Scratch registers for boot phase timestamps.
+
+    Firmware writes the cycle counter into stampN as it passes each phase. While it
+    stays in the bootloader it returns them with vendor request 7, which
+    extra/perf.py --boot prints.
+    """
+    def __init__(self, n=8):
+        for i in range(n):
+            setattr(self, "_stamp{}".format(i), CSRStorage(32, name="stamp{}".format(i),
+                description="Cycle count at boot phase {}.".format(i)))
@@ -0,0 +1,65 @@
+# Copyright (c) 2021 Gregory Davill <greg.davill@gmail.com> 
+# SPDX-License-Identifier: BSD-2-Clause
+
+from migen import *
+
+from litex.soc.interconnect.csr import *
+
+# Bus monitor ------------------------------------------------------------------------------------
+
+class BusMonitor(Module, AutoCSR):
+    """Wishbone transaction and wait state counters.
+
+    Each tap watches cyc/stb/ack of one wishbone interface without driving it.
+    A transaction is a cycle with ack, a wait state a cycle with a strobe but
+    no ack, so their sum is the time that bus was busy. `cycles` is the length
+    of the window the counts were collected over.
+
+    `csr_bus` gets one more tap, named `csr_bank`, that only counts accesses to
+    the CSR bank selected by `bank`. This singles out one peripheral behind the
+    CSR bridge, the SPI flash master for example.
+
+    Counting pauses while `enable` is clear, so firmware can read a consistent
+    snapshot.
+    """
+    def __init__(self, taps, csr_bus=None, csr_paging=0x800, csr_banks=32):
+        self._control = CSRStorage(fields=[
+            CSRField("enable", reset=1, description="Count while set."),
+            CSRField("clear", pulse=True, description="Zero every counter."),
+        ])
+        self._bank   = CSRStorage(log2_int(csr_banks), name="bank", description="CSR bank counted by the csr_bank tap.")
+        self._cycles = CSRStatus(32, name="cycles", description="Cycles counted over.")
+
+        enable = self._control.fields.enable
+        clear  = self._control.fields.clear
+
+        cycles = Signal(32)
+        self.sync += If(clear, cycles.eq(0)).Elif(enable, cycles.eq(cycles + 1))
+        self.comb += self._cycles.status.eq(cycles)
+
+        if csr_bus is not None:
+            shift = log2_int(csr_paging // (csr_bus.data_width // 8))
+            in_bank = csr_bus.adr[shift:shift + log2_int(csr_banks)] == self._bank.storage
+            taps = list(taps) + [("csr_bank", csr_bus, in_bank)]
+
+        for tap in taps:
+            name, bus = tap[:2]
+            match = tap[2] if len(tap) > 2 else 1
+
+            transactions = CSRStatus(32, name="{}_transactions".format(name), description="Acknowledged {} cycles.".format(name))
+            waits        = CSRStatus(32, name="{}_waits".format(name), description="{} cycles strobed but not acknowledged.".format(name))
+            setattr(self, "_{}_transactions".format(name), transactions)
+            setattr(self, "_{}_waits".format(name), waits)
+
+            active = Signal()
+            self.comb += active.eq(enable & bus.cyc & bus.stb & match)
+            self.sync += [
+                If(clear,
+                    transactions.status.eq(0),
+                    waits.status.eq(0),
+                ).Elif(active & bus.ack,
+                    transactions.status.eq(transactions.status + 1),
+                ).Elif(active,
+                    waits.status.eq(waits.status + 1),
+                )
+            ]
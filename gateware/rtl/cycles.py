@@ -0,0 +1,44 @@
+# Copyright (c) 2021 Gregory Davill <greg.davill@gmail.com> 
+# SPDX-License-Identifier: BSD-2-Clause
+
+from migen import *
+
+from litex.soc.interconnect.csr import *
+
+# Cycle counter ----------------------------------------------------------------------------------
+
+class CycleCounter(Module, AutoCSR):
+    """Free running 64-bit count of sys clock cycles.
+
+    Exposed as two live 32-bit halves. Firmware reads high, low, high and retries
+    if the high word changed, which is safe from any context without a latch.
+
+    If `irq` is given the low word is also captured whenever an interrupt line goes
+    from low to high, so firmware can measure how long an interrupt waited before its
+    handler ran. The CPU's interrupt mask isn't visible here, so every line counts,
+    but a line held high while masked no longer hides the edges of the others. With
+    several lines raised back to back the stamp is the latest one, so the latency of
+    the earlier ones reads short.
+    """
+    def __init__(self, irq=None):
+        self._low  = CSRStatus(32, name="low",  description="Cycle count, bits 0-31.")
+        self._high = CSRStatus(32, name="high", description="Cycle count, bits 32-63.")
+
+        count = Signal(64)
+        self.sync += count.eq(count + 1)
+
+        self.comb += [
+            self._low.status.eq(count[:32]),
+            self._high.status.eq(count[32:]),
+        ]
+
+        if irq is not None:
+            self._irq_stamp = CSRStatus(32, name="irq_stamp", description="Cycle count when an interrupt line was last raised.")
+
+            irq_last = Signal(len(irq))
+            self.sync += [
+                irq_last.eq(irq),
+                If((irq & ~irq_last) != 0,
+                    self._irq_stamp.status.eq(count[:32])
+                )
+            ]
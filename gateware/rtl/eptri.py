@@ -14,19 +14,23 @@ from litex.soc.interconnect.csr_eventmanager import *
 
 class LunaEpTriWrapper(Module):
 
-    def __init__(self, platform, base_addr=0):
+    def __init__(self, platform, base_addr=0, out_double_buffer=False, max_packet_size=512, ulpi_pads=None):
         self.platform = platform
         
-        ulpi_pads = platform.request('ulpi')
         ulpi_data = TSTriple(8)
         reset = Signal()
+
+        # Simulation passes its own pads and drives the PHY side of ulpi_data directly
+        if ulpi_pads is None:
+            ulpi_pads = platform.request('ulpi')
+            self.specials += DDROutput(~reset ,0, ulpi_pads.clk, ClockSignal("usb"))
+            self.specials += ulpi_data.get_tristate(ulpi_pads.data)
+        self.ulpi_data = ulpi_data
+
         if hasattr(ulpi_pads, "rst"):
             self.comb += ulpi_pads.rst.eq(~ResetSignal("usb"))
-
-        self.specials += DDROutput(~reset ,0, ulpi_pads.clk, ClockSignal("usb"))
-        self.specials += ulpi_data.get_tristate(ulpi_pads.data)
         
-        self.wrapper("LunaEpTri", LunaEpTri(base_addr))
+        self.wrapper("LunaEpTri", LunaEpTri(base_addr, out_double_buffer=out_double_buffer, max_packet_size=max_packet_size))
 
         self.params = dict(
             # Clock / Reset
@@ -65,12 +69,14 @@ class LunaEpTriWrapper(Module):
         irqs['setup'] = Signal()
         irqs['in_ep'] = Signal()
         irqs['out_ep'] = Signal()
+        irqs['status'] = Signal()
 
         self.params.update( 
             o_usb_device_controller_ev_irq = irqs['device_controller'],
             o_usb_setup_ev_irq = irqs['setup'],
             o_usb_in_ep_ev_irq = irqs['in_ep'],
             o_usb_out_ep_ev_irq = irqs['out_ep'],
+            o_usb_status_ev_irq = irqs['status'],
         )
 
 
@@ -17,14 +17,111 @@ class PDM(Module):
         self.comb += out.eq(sigma[width+1])
         self.sync += sigma.eq(sigma + Cat(level, out, out))
 
+# Pattern engine -----------------------------------------------------------------------------------------------
+
+sine_falloff = [0x3ff, 0x3f8, 0x3ea, 0x3cf, 0x3ae, 0x387, 0x354, 0x31b, 0x2df, 0x29f, 0x256, 0x210, 0x1c5, 0x17e, 0x138, 0x0f4,
+                0x0b8, 0x07f, 0x04d, 0x028, 0x00c, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000, 0x000]
+sine_pulse   = [0x000, 0x000, 0x000, 0x017, 0x04d, 0x09a, 0x0f4, 0x15a, 0x1c5, 0x235, 0x29f, 0x2fd, 0x354, 0x39a, 0x3cf, 0x3f1,
+                0x3ff, 0x3f1, 0x3cf, 0x39a, 0x354, 0x2fd, 0x29f, 0x235, 0x1c5, 0x15a, 0x0f4, 0x09a, 0x04d, 0x017, 0x000, 0x000]
+
+class Pattern(Module, AutoCSR):
+    """Steps each LED through a 32 entry wavetable and scales a colour by it.
+
+    Every `period` cycles the shared index advances by `step`, each LED samples the
+    table at index + its own phase. Each time the index wraps the next bit of `palette`
+    picks colour0 or colour1 for the following sweep. Firmware only sets a mode.
+    """
+    def __init__(self, n=7):
+        self._mode    = CSRStorage(2,  name="mode",    description="0: direct CSR control, 1: sine falloff, 2: sine pulse.")
+        self._period  = CSRStorage(32, name="period",  description="Cycles per wavetable step.", reset=int(60e6 * 0.04))
+        self._step    = CSRStorage(5,  name="step",    description="Wavetable entries advanced per period.", reset=1)
+        self._phase   = CSRStorage(5*n, name="phase",  description="Per LED 5-bit wavetable offset.")
+        self._colour0 = CSRStorage(30, name="colour0", description="Colour as G[29:20] B[19:10] R[9:0].")
+        self._colour1 = CSRStorage(30, name="colour1", description="Alternate colour, selected per sweep by palette.")
+        self._palette = CSRStorage(32, name="palette", description="Bit k set: sweep k (mod 32) uses colour1.")
+        self._mask    = CSRStorage(n,  name="mask",    description="LEDs driven by the pattern, others are dark.", reset=2**n-1)
+
+        # Inputs: colour channel currently being multiplexed, hold everything while parked
+        self.channel = Signal(3)
+        self.park = Signal()
+
+        # Outputs
+        self.enable = Signal()
+        self.levels = [Signal(10) for _ in range(n)]
+
+        prescale = Signal(32)
+        index = Signal(5)
+        sweep = Signal(5)
+
+        self.comb += self.enable.eq(self._mode.storage != 0)
+        self.sync += [
+            If(~self.enable | self.park,
+                prescale.eq(0),
+                index.eq(0),
+                sweep.eq(0),
+            ).Elif(prescale >= self._period.storage,
+                prescale.eq(0),
+                index.eq(index + self._step.storage),
+                If((index + self._step.storage)[5],
+                    sweep.eq(sweep + 1)
+                )
+            ).Else(
+                prescale.eq(prescale + 1)
+            )
+        ]
+
+        colour = Signal(30)
+        palette = Array(self._palette.storage[k] for k in range(32))
+        self.comb += If(palette[sweep],
+            colour.eq(self._colour1.storage)
+        ).Else(
+            colour.eq(self._colour0.storage)
+        )
+
+        # Only the channel being shown needs scaling, one multiply per LED
+        intensity = Signal(10)
+        self.comb += Case(self.channel, {
+            0b001: intensity.eq(colour[0:10]),
+            0b010: intensity.eq(colour[10:20]),
+            0b100: intensity.eq(colour[20:30]),
+            "default": intensity.eq(0),
+        })
+
+        falloff = Array(C(v, 10) for v in sine_falloff)
+        pulse = Array(C(v, 10) for v in sine_pulse)
+
+        for i in range(n):
+            sample = Signal(5)
+            wave = Signal(10)
+            product = Signal(20)
+            self.comb += [
+                sample.eq(index + self._phase.storage[5*i:5*(i+1)]),
+                If(self._mode.storage == 2,
+                    wave.eq(pulse[sample])
+                ).Else(
+                    wave.eq(falloff[sample])
+                ),
+                product.eq(intensity * wave),
+            ]
+            self.sync += If(self._mask.storage[i],
+                self.levels[i].eq(product[10:])
+            ).Else(
+                self.levels[i].eq(0)
+            )
+
 class Leds(Module, AutoCSR):
     def __init__(self, anode, cathode):
+        self.submodules.pattern = pattern = Pattern(7)
+
+        # Parking stops every counter in here and holds the LEDs dark (USB suspend)
+        self._park = CSRStorage(1, name="park", description="Stop the multiplexer, PDMs and pattern engine, all LEDs off.")
+        park = self._park.storage
         
         count = Signal(3, reset=1)
         prescale = Signal(max=300)
         blanking_duration = Signal(max=63)
 
-        self.sync += [
+        self.sync += If(~park,
             If(prescale == 0,
                 count.eq(Cat(count[1:],count[0])),
                 prescale.eq(300),
@@ -37,7 +134,7 @@ class Leds(Module, AutoCSR):
             If(blanking_duration != 0,
                 blanking_duration.eq(blanking_duration - 1)
             )
-        ]
+        )
 
         enable = Signal()
         for n in range(7):
@@ -46,12 +143,16 @@ class Leds(Module, AutoCSR):
             setattr(self, "_out{}".format(n), _csr)
             self.comb += [
                 anode[n].eq(_pdm.out),
-                _pdm.reset.eq(blanking_duration != 0),
+                _pdm.reset.eq((blanking_duration != 0) | park),
             ]
             self.sync += [
-                If(count[0], _pdm.level.eq(_csr.storage[0:10])),
-                If(count[1], _pdm.level.eq(_csr.storage[10:20])),
-                If(count[2], _pdm.level.eq(_csr.storage[20:30])),
+                If(pattern.enable,
+                    _pdm.level.eq(pattern.levels[n])
+                ).Else(
+                    If(count[0], _pdm.level.eq(_csr.storage[0:10])),
+                    If(count[1], _pdm.level.eq(_csr.storage[10:20])),
+                    If(count[2], _pdm.level.eq(_csr.storage[20:30])),
+                ),
                 
                 If(_pdm.level,
                     enable.eq(enable | 1)
@@ -62,6 +163,8 @@ class Leds(Module, AutoCSR):
             ]
 
         self.comb += [
+            pattern.channel.eq(count),
+            pattern.park.eq(park),
             If(enable,
                 cathode.eq(count)
             )
@@ -90,3 +193,31 @@ class TestPDM(unittest.TestCase):
                 
         dut = DUT()
         run_simulation(dut, generator(dut), vcd_name='test.vcd')
+
+    def test_pattern(self):
+        def generator(dut):
+            yield from dut.pattern._period.write(100)
+            yield from dut.pattern._colour0.write(0x3ff)
+            yield from dut.pattern._phase.write(16 << 5)
+            yield from dut.pattern._mode.write(1)
+            yield dut.pattern.channel.eq(0b001)
+
+            for _ in range(3):
+                yield
+
+            # LED1 sits half a table behind LED0
+            self.assertEqual((yield dut.pattern.levels[0]), (0x3ff * sine_falloff[0]) >> 10)
+            self.assertEqual((yield dut.pattern.levels[1]), (0x3ff * sine_falloff[16]) >> 10)
+
+            # Only the red channel is lit
+            yield dut.pattern.channel.eq(0b010)
+            yield
+            yield
+            self.assertEqual((yield dut.pattern.levels[0]), 0)
+
+        class DUT(Module):
+            def __init__(self):
+                self.submodules.pattern = Pattern(7)
+
+        dut = DUT()
+        run_simulation(dut, generator(dut))
@@ -0,0 +1,536 @@
+# Copyright (c) 2021 Gregory Davill <greg.davill@gmail.com>
+# SPDX-License-Identifier: BSD-2-Clause
+
+from migen import *
+
+from litex.soc.interconnect import stream
+
+from litespi.common import spi_core2phy_layout, spi_phy2core_layout
+
+# W25Q128JV ---------------------------------------------------------------------------------------
+
+W25Q_SIZE      = 16*1024*1024
+W25Q_PAGE_SIZE = 256
+W25Q_JEDEC_ID  = [0xef, 0x40, 0x18]
+
+# Datasheet typical times in us (tPP, tSE, tBE1, tBE2, tCE, tW), and tRES1
+W25Q_TIMES_US = {
+    "program":    400,
+    "erase_4k":   45000,
+    "erase_32k":  120000,
+    "erase_64k":  150000,
+    "erase_chip": 40000000,
+    "status":     10000,
+}
+W25Q_WAKE_US = 3
+
+# Bits a status register write can change, LB1-3 are one time programmable
+W25Q_SR_WRITABLE = [0xfc, 0x43, 0x64]
+
+
+class _BlockProtect(Module):
+    """Whether `addr` falls in the range BP/TB/SEC/CMP protect"""
+    def __init__(self, sr1, sr2, addr):
+        self.protected = Signal()
+
+        # # #
+
+        size   = Signal(25)
+        lower  = Signal(25)
+        inside = Signal()
+
+        cases = {0: size.eq(0), 6: size.eq(W25Q_SIZE), 7: size.eq(W25Q_SIZE)}
+        for bp in range(1, 6):
+            cases[bp] = If(sr1[6],
+                size.eq((4*1024) << min(bp - 1, 3))
+            ).Else(
+                size.eq((256*1024) << (bp - 1))
+            )
+
+        self.comb += [
+            Case(sr1[2:5], cases),
+            lower.eq(W25Q_SIZE - size),
+            If(sr1[5],
+                inside.eq(addr < size)
+            ).Else(
+                inside.eq(addr >= lower)
+            ),
+            self.protected.eq(inside ^ sr2[6]),
+        ]
+
+
+class W25Q128JVModel(Module):
+    """Command level W25Q128JV in place of the LiteSPI PHY, for simulation.
+
+    Passed to add_spi_flash(phy=...), so the memory mapped window and the
+    spiflash master both reach it. Each core transfer (`len` bits on `width`
+    lines) is answered after the SPI clocks it would take at `div` sys cycles
+    per clock, and decoded a byte at a time as the part would: status, JEDEC
+    and unique id reads, array and security register reads, page program,
+    sector/block/chip erase, status writes with block protection and lock
+    bits, and deep power-down. Program, erase and status writes hold BUSY for
+    their datasheet typical time times `time_scale`, commands other than status
+    reads are ignored meanwhile. This mirrors firmware/host/w25q128.c.
+
+    The array is stored inverted so that memory the simulator zeroes reads back
+    erased, only `init` (bytes from offset 0) is loaded. Dummy phases are
+    counted in bytes, the way flash.c clocks them.
+
+    With `trace` every command prints its opcode, start cycle and length in
+    cycles, and every busy period its length, for butterstick-sim.py.
+    """
+    def __init__(self, sys_clk_freq, init=b"", security_init=None, uid=0x0123456789abcdef,
+                 status=(0x00, 0x02, 0x60), div=3, time_scale=1.0, trace=True):
+        self.sink   = sink   = stream.Endpoint(spi_core2phy_layout)
+        self.source = source = stream.Endpoint(spi_phy2core_layout)
+        self.cs     = Signal()
+
+        # # #
+
+        def cycles_for(us):
+            return max(1, int(us * sys_clk_freq / 1e6 * time_scale))
+
+        cycles = Signal(64)
+        self.sync += cycles.eq(cycles + 1)
+
+        # Storage ----------------------------------------------------------------------------------
+        array = Memory(8, W25Q_SIZE, init=[~b & 0xff for b in init] or None, name="w25q_array")
+        array_port = array.get_port(write_capable=True)
+
+        security_init = security_init or [b""]*3
+        sec_init = []
+        for page in security_init:
+            page = bytes(page) + b"\xff"*(W25Q_PAGE_SIZE - len(page))
+            sec_init += [~b & 0xff for b in page]
+        security = Memory(8, 3*W25Q_PAGE_SIZE, init=sec_init, name="w25q_security")
+        security_port = security.get_port(write_capable=True)
+
+        # Program data latched until CS goes high, bytes never sent program as 0xff
+        page = Memory(8, W25Q_PAGE_SIZE, name="w25q_page")
+        page_wr = page.get_port(write_capable=True)
+        page_rd = page.get_port()
+        page_valid = Signal(W25Q_PAGE_SIZE)
+        page_clear = Signal()
+
+        self.specials += array, array_port, security, security_port, page, page_wr, page_rd
+
+        sr1 = Signal(8, reset=status[0] & 0xfc)
+        sr2 = Signal(8, reset=status[1])
+        sr3 = Signal(8, reset=status[2])
+        sr_new = [Signal(8) for _ in range(3)]
+        sr_len = Signal(2)
+
+        wel          = Signal()
+        powered_down = Signal()
+        awake        = Signal(16) # tRES1 left
+        awake_load   = Signal()
+        busy_count   = Signal(32)
+        busy_load    = Signal()
+        busy_value   = Signal(32)
+        committing   = Signal()
+        busy         = Signal()
+        self.comb += busy.eq((busy_count != 0) | committing)
+        self.sync += [
+            If(busy_load,
+                busy_count.eq(busy_value)
+            ).Elif(busy_count != 0,
+                busy_count.eq(busy_count - 1)
+            ),
+            If(awake_load,
+                awake.eq(cycles_for(W25Q_WAKE_US))
+            ).Elif(awake != 0,
+                awake.eq(awake - 1)
+            ),
+        ]
+
+        # WEL reads as set until the write it enabled has finished
+        status1 = Signal(8)
+        self.comb += status1.eq(Cat(busy, wel | busy, sr1[2:]))
+
+        # Command decode ---------------------------------------------------------------------------
+        cmd         = Signal(8)
+        count       = Signal(16) # bytes clocked since CS, including the opcode
+        address     = Signal(24)
+        index       = Signal(24) # data phase bytes
+        jedec_index = Signal(2)
+        length      = Signal(9)
+        ignored     = Signal()
+
+        addr_bytes  = Signal(3)
+        dummy_bytes = Signal(3)
+        data_width  = Signal(4)
+        formats = {}
+        for op in [0x03, 0x02, 0x20, 0x52, 0xd8, 0x42, 0x44, 0x90]:
+            formats[op] = addr_bytes.eq(3)
+        for op in [0x0b, 0x48]:
+            formats[op] = [addr_bytes.eq(3), dummy_bytes.eq(1)]
+        formats[0x32] = [addr_bytes.eq(3), data_width.eq(4)]
+        formats[0x3b] = [addr_bytes.eq(3), dummy_bytes.eq(1), data_width.eq(2)]
+        formats[0x6b] = [addr_bytes.eq(3), dummy_bytes.eq(1), data_width.eq(4)]
+        formats[0x4b] = dummy_bytes.eq(4)
+        formats[0xab] = dummy_bytes.eq(3)
+        self.comb += [
+            addr_bytes.eq(0),
+            dummy_bytes.eq(0),
+            data_width.eq(1),
+            Case(cmd, formats),
+        ]
+
+        security_page = Signal(4)
+        security_row  = Signal(2)
+        security_addr = Signal(10)
+        self.comb += [
+            security_page.eq(address[12:16]),
+            security_row.eq(security_page - 1),
+            security_addr.eq(Cat((address + index)[:8], security_row)),
+        ]
+        security_ok = (security_page >= 1) & (security_page <= 3)
+        security_locked = Array(sr2[3 + i] for i in range(3))[security_row]
+
+        # Ranges a write or erase touches, both ends are checked against the protected area
+        range_lo = Signal(24)
+        range_hi = Signal(24)
+        ranges = {}
+        for op in [0x02, 0x32]:
+            ranges[op] = [range_lo.eq(Cat(Replicate(0, 8), address[8:])), range_hi.eq(Cat(Replicate(1, 8), address[8:]))]
+        for op, bits in [(0x20, 12), (0x52, 15), (0xd8, 16)]:
+            ranges[op] = [range_lo.eq(Cat(Replicate(0, bits), address[bits:])), range_hi.eq(Cat(Replicate(1, bits), address[bits:]))]
+        for op in [0x60, 0xc7]:
+            ranges[op] = [range_lo.eq(0), range_hi.eq(W25Q_SIZE - 1)]
+        self.comb += Case(cmd, ranges)
+
+        protect_lo = _BlockProtect(sr1, sr2, range_lo)
+        protect_hi = _BlockProtect(sr1, sr2, range_hi)
+        self.submodules += protect_lo, protect_hi
+        protected = protect_lo.protected | protect_hi.protected
+
+        # Commit engine, applies program and erase to the array while BUSY -------------------------
+        commit_start  = Signal()
+        commit_erase  = Signal()
+        commit_sec    = Signal()
+        commit_base   = Signal(24)
+        commit_length = Signal(25)
+        commit_index  = Signal(25)
+        commit_addr   = Signal(24)
+        commit_row    = Signal(2)
+        self.comb += [
+            commit_addr.eq(commit_base + commit_index),
+            commit_row.eq(commit_base[12:16] - 1),
+        ]
+
+        self.submodules.commit = commit = FSM(reset_state="IDLE")
+        commit.act("IDLE",
+            If(commit_start,
+                NextValue(commit_index, 0),
+                NextState("COMMIT")
+            )
+        )
+        # Erase writes a byte per cycle, program reads first and only clears bits
+        commit.act("COMMIT",
+            committing.eq(1),
+            If(commit_erase,
+                NextState("ERASE")
+            ).Else(
+                NextState("PROGRAM-READ")
+            )
+        )
+        commit.act("ERASE",
+            committing.eq(1),
+            array_port.we.eq(~commit_sec),
+            security_port.we.eq(commit_sec),
+            NextValue(commit_index, commit_index + 1),
+            If(commit_index == (commit_length - 1),
+                NextState("IDLE")
+            )
+        )
+        commit.act("PROGRAM-READ",
+            committing.eq(1),
+            NextState("PROGRAM-WRITE")
+        )
+        commit.act("PROGRAM-WRITE",
+            committing.eq(1),
+            array_port.we.eq(~commit_sec),
+            security_port.we.eq(commit_sec),
+            NextValue(commit_index, commit_index + 1),
+            If(commit_index == (commit_length - 1),
+                NextState("IDLE")
+            ).Else(
+                NextState("PROGRAM-READ")
+            )
+        )
+        page_byte = Signal(8)
+        self.comb += [
+            page_rd.adr.eq(commit_index[:8]),
+            page_byte.eq(Mux((page_valid >> commit_index[:8])[0], page_rd.dat_r, 0xff)),
+            array_port.dat_w.eq(Mux(commit_erase, 0, array_port.dat_r | ~page_byte)),
+            security_port.dat_w.eq(Mux(commit_erase, 0, security_port.dat_r | ~page_byte)),
+        ]
+
+        # Transfers --------------------------------------------------------------------------------
+        word     = Signal(32)
+        width    = Signal(4)
+        nbytes   = Signal(3)
+        rdata    = Signal(32)
+        due      = Signal(64) # cycle the SPI clocks for this transfer are done
+        byte_in  = Signal(8)
+        byte_out = Signal(8)
+        out_kind = Signal(2) # 0: out_const, 1: array, 2: security register
+        out_const = Signal(8)
+
+        cs_d     = Signal()
+        cs_start = Signal(64)
+        self.sync += [
+            cs_d.eq(self.cs),
+            If(self.cs & ~cs_d,
+                cs_start.eq(cycles)
+            )
+        ]
+
+        self.comb += [
+            byte_in.eq(Array([word[0:8], word[8:16], word[16:24], word[24:32]])[nbytes - 1]),
+            Case(out_kind, {
+                0: byte_out.eq(out_const),
+                1: byte_out.eq(~array_port.dat_r),
+                2: byte_out.eq(~security_port.dat_r),
+                "default": byte_out.eq(0xff),
+            }),
+        ]
+
+        # Reads are addressed from the byte being decoded, the commit engine owns the ports while BUSY
+        self.comb += [
+            If(committing,
+                array_port.adr.eq(commit_addr),
+                security_port.adr.eq(Cat(commit_index[:8], commit_row)),
+            ).Else(
+                array_port.adr.eq(address + index),
+                security_port.adr.eq(security_addr),
+            )
+        ]
+
+        phase_addr  = (count != 0) & (count <= addr_bytes)
+        phase_dummy = (count > addr_bytes) & (count <= (addr_bytes + dummy_bytes))
+        phase_data  = (count > (addr_bytes + dummy_bytes))
+
+        page_write = [
+            page_wr.we.eq(1),
+            NextValue(length, Mux(length == 511, 511, length + 1)),
+        ]
+        self.sync += [
+            If(page_clear,
+                page_valid.eq(0)
+            ).Elif(page_wr.we,
+                page_valid.eq(page_valid | (1 << page_wr.adr))
+            )
+        ]
+        status_latch = If(index < 3,
+            Case(index[:2], {i: NextValue(sr_new[i], byte_in) for i in range(3)}),
+            NextValue(sr_len, index[:2] + 1)
+        )
+        jedec_id = Array(Constant(v, 8) for v in W25Q_JEDEC_ID)
+        uid_bytes = Array(Constant((uid >> (56 - 8*i)) & 0xff, 8) for i in range(8))
+
+        def accepts(op):
+            return If(busy,
+                # While busy only the status registers can be read
+                NextValue(ignored, ~((op == 0x05) | (op == 0x35) | (op == 0x15)))
+            ).Elif(awake != 0,
+                NextValue(ignored, 1)
+            ).Elif(((op == 0x32) | (op == 0x6b)) & ~sr2[1],
+                # With QE clear IO2 and IO3 are /WP and /HOLD
+                NextValue(ignored, 1)
+            ).Else(
+                NextValue(ignored, 0)
+            )
+
+        data_phase = Case(cmd, {
+            0x05: NextValue(out_const, status1),
+            0x35: NextValue(out_const, sr2),
+            0x15: NextValue(out_const, sr3),
+            0x9f: [
+                NextValue(out_const, jedec_id[jedec_index]),
+                NextValue(jedec_index, Mux(jedec_index == 2, 0, jedec_index + 1)),
+            ],
+            0x90: NextValue(out_const, Mux(index[0], 0x17, 0xef)),
+            0xab: NextValue(out_const, 0x17),
+            0x4b: NextValue(out_const, Mux(index < 8, uid_bytes[index[:3]], 0xff)),
+            0x03: NextValue(out_kind, 1),
+            0x0b: NextValue(out_kind, 1),
+            0x3b: NextValue(out_kind, 1),
+            0x6b: NextValue(out_kind, 1),
+            0x48: If(security_ok, NextValue(out_kind, 2)),
+            # Page buffer wraps, the last 256 bytes sent are the ones programmed
+            0x02: page_write,
+            0x32: page_write,
+            0x42: page_write,
+            0x01: status_latch,
+            0x31: status_latch,
+            0x11: status_latch,
+        })
+        self.comb += [
+            page_wr.adr.eq(address[:8] + index[:8]),
+            page_wr.dat_w.eq(byte_in),
+        ]
+
+        self.submodules.fsm = fsm = FSM(reset_state="IDLE")
+        fsm.act("IDLE",
+            If(~self.cs & (count != 0),
+                NextState("EXECUTE")
+            ).Elif(self.cs & sink.valid,
+                sink.ready.eq(1),
+                NextValue(word, sink.data),
+                NextValue(width, sink.width),
+                NextValue(nbytes, sink.len[3:]),
+                NextValue(rdata, 0),
+                Case(sink.width, {
+                    1: NextValue(due, cycles + sink.len * div),
+                    2: NextValue(due, cycles + sink.len[1:] * div),
+                    4: NextValue(due, cycles + sink.len[2:] * div),
+                    "default": NextValue(due, cycles + sink.len[3:] * div),
+                }),
+                NextState("DECODE")
+            )
+        )
+        fsm.act("DECODE",
+            NextValue(out_kind, 0),
+            NextValue(out_const, 0xff),
+            If(count == 0,
+                NextValue(cmd, byte_in),
+                NextValue(address, 0),
+                NextValue(index, 0),
+                NextValue(jedec_index, 0),
+                NextValue(length, 0),
+                NextValue(sr_len, 0),
+                page_clear.eq(1),
+                If(width != 1,
+                    NextValue(ignored, 1)
+                ).Elif(powered_down,
+                    NextValue(ignored, 0)
+                ).Else(
+                    accepts(byte_in)
+                )
+            # Asleep, only Release Power-down gets through
+            ).Elif((powered_down & (cmd != 0xab)) | ignored,
+            ).Elif(phase_addr,
+                If(width != 1, NextValue(ignored, 1)),
+                NextValue(address, Cat(byte_in, address[:16]))
+            ).Elif(phase_dummy,
+                If(width != 1, NextValue(ignored, 1)),
+            ).Elif(width != data_width,
+                NextValue(ignored, 1)
+            ).Else(
+                data_phase,
+                NextValue(index, index + 1)
+            ),
+            NextState("OUTPUT")
+        )
+        # Memory reads land a cycle after the address
+        fsm.act("OUTPUT",
+            NextValue(rdata, Cat(byte_out, rdata[:24])),
+            NextValue(count, Mux(count == 0xffff, count, count + 1)),
+            NextValue(nbytes, nbytes - 1),
+            If(nbytes == 1,
+                NextState("RESPOND")
+            ).Else(
+                NextState("DECODE")
+            )
+        )
+        fsm.act("RESPOND",
+            If(cycles >= due,
+                source.valid.eq(1),
+                source.data.eq(rdata),
+                If(source.ready,
+                    NextState("IDLE")
+                )
+            )
+        )
+
+        # CS high, commands that change the array or the status registers run here
+        def start(op, us, erase=False, sec=False, base=0, length=W25Q_PAGE_SIZE):
+            return [
+                NextValue(wel, 0),
+                busy_load.eq(1),
+                busy_value.eq(cycles_for(W25Q_TIMES_US[us])),
+                commit_start.eq(op),
+                NextValue(commit_erase, erase),
+                NextValue(commit_sec, sec),
+                NextValue(commit_base, base),
+                NextValue(commit_length, length),
+            ]
+
+        def status_write(first):
+            writes = []
+            for r, reg in enumerate([sr1, sr2, sr3]):
+                if r < first:
+                    continue
+                mask = W25Q_SR_WRITABLE[r]
+                value = (reg & (~mask & 0xff)) | (sr_new[r - first] & mask)
+                # Lock bits can't be cleared once set
+                if r == 1:
+                    value = value | (reg & 0x38)
+                writes.append(If(sr_len > (r - first), NextValue(reg, value)))
+            return If(wel,
+                *writes,
+                NextValue(wel, 0),
+                busy_load.eq(1),
+                busy_value.eq(cycles_for(W25Q_TIMES_US["status"])),
+            )
+
+        erase_start = lambda size, us: If(wel & (count >= 4) & ~protected,
+            start(1, us, erase=True, base=range_lo, length=size)
+        ).Else(
+            NextValue(wel, 0)
+        )
+
+        execute = Case(cmd, {
+            0x06: NextValue(wel, 1),
+            0x04: NextValue(wel, 0),
+            0xb9: NextValue(powered_down, 1),
+            0x02: If(wel & (length != 0) & ~protected, start(1, "program", base=range_lo)).Else(NextValue(wel, 0)),
+            0x32: If(wel & (length != 0) & ~protected, start(1, "program", base=range_lo)).Else(NextValue(wel, 0)),
+            0x20: erase_start(4*1024, "erase_4k"),
+            0x52: erase_start(32*1024, "erase_32k"),
+            0xd8: erase_start(64*1024, "erase_64k"),
+            0x60: If(wel & ~protected, start(1, "erase_chip", erase=True, base=0, length=W25Q_SIZE)).Else(NextValue(wel, 0)),
+            0xc7: If(wel & ~protected, start(1, "erase_chip", erase=True, base=0, length=W25Q_SIZE)).Else(NextValue(wel, 0)),
+            0x01: status_write(0),
+            0x31: status_write(1),
+            0x11: status_write(2),
+            0x42: If(wel & security_ok & ~security_locked,
+                start(1, "program", sec=True, base=address)
+            ).Else(NextValue(wel, 0)),
+            0x44: If(wel & security_ok & ~security_locked,
+                start(1, "erase_4k", erase=True, sec=True, base=address)
+            ).Else(NextValue(wel, 0)),
+        })
+
+        fsm.act("EXECUTE",
+            NextValue(count, 0),
+            If(powered_down,
+                If(cmd == 0xab,
+                    NextValue(powered_down, 0),
+                    awake_load.eq(1)
+                )
+            ).Elif(~ignored,
+                execute
+            ),
+            NextState("IDLE")
+        )
+
+        # Trace ------------------------------------------------------------------------------------
+        if trace:
+            busy_d     = Signal()
+            busy_start = Signal(64)
+            busy_op    = Signal(8)
+            self.sync += [
+                busy_d.eq(busy),
+                If(fsm.ongoing("EXECUTE"),
+                    Display("flash: cmd %02x start %0d cycles %0d", cmd, cs_start, cycles - cs_start),
+                    busy_op.eq(cmd),
+                ),
+                If(busy & ~busy_d,
+                    busy_start.eq(cycles)
+                ),
+                If(~busy & busy_d,
+                    Display("flash: busy %02x start %0d cycles %0d", busy_op, busy_start, cycles - busy_start)
+                ),
+            ]